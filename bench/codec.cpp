@@ -0,0 +1,360 @@
+#include <chrono>
+#include <memory>
+
+#include "codec.hpp"
+#include "common.hpp"
+#include "macros/unwrap.hpp"
+#include "util/charconv.hpp"
+
+namespace {
+namespace func = niz::func;
+
+// the hand-written packets and encoder which keymap.cpp used before codec, kept as the baseline
+struct KeyFunctionType {
+    enum : uint8_t {
+        Keys        = 0x00, // press keys at the same time
+        Emulate     = 0x01, // press keys in a row at constant intervals
+        CountMacro  = 0x02, // run a recorded macro a specified number of times
+        HoldMacro   = 0x03, // run a recorded macro while the key is pressed
+        ToggleMacro = 0x04, // keep running the recorded macro until the same key is pressed again
+    };
+};
+
+struct KeyFunctionPacket : niz::Packet {
+    uint8_t layer;
+    uint8_t pos;
+    uint8_t func_type;
+} __attribute__((packed));
+
+struct KeysKeyFunctionPacket : KeyFunctionPacket {
+    uint8_t data_size;
+    uint8_t keycodes[];
+} __attribute__((packed));
+
+struct EmulateKeyFunctionPacket : KeyFunctionPacket {
+    uint8_t delay_upper;
+    uint8_t delay_lower;
+    uint8_t data_size;
+    uint8_t keycodes[];
+} __attribute__((packed));
+
+struct MacroEvent {
+    uint8_t keycode;
+    uint8_t unknown1;
+    uint8_t delay_upper;
+    uint8_t delay_lower;
+} __attribute__((packed));
+
+struct MacroKeyFunctionPacket : KeyFunctionPacket {
+    uint8_t repeat_count;
+    uint8_t use_recorded_delay;
+    uint8_t auto_delay_upper;
+    uint8_t auto_delay_lower;
+    uint8_t unknown2;
+    uint8_t data_size;
+} __attribute__((packed));
+
+struct AutoDelayMacroKeyFunctionPacket : MacroKeyFunctionPacket {
+    uint8_t keycodes[];
+} __attribute__((packed));
+
+struct RecordedDelayMacroKeyFunctionPacket : MacroKeyFunctionPacket {
+    MacroEvent macro_events[]; // unaligned!
+} __attribute__((packed));
+
+using KeyPacket = std::array<uint8_t, niz::codec::packet_size>;
+
+// encodes a key function into a KeyData report, buf[0] is the report id
+// returns false if the function is empty
+auto legacy_encode(const func::KeyFunction& function, const int layer, const int pos, niz::Report& buf) -> bool {
+    buf.fill(0);
+    auto& key = *std::bit_cast<KeyFunctionPacket*>(buf.data() + 1);
+    key.type  = niz::PacketType::KeyData;
+    key.layer = layer + 1;
+    key.pos   = pos + 1;
+    switch(function.get_index()) {
+    case func::KeyFunction::index_of<func::KeysFunction>: {
+        const auto& func = function.as<func::KeysFunction>();
+
+        auto& keys_key     = *std::bit_cast<KeysKeyFunctionPacket*>(&key);
+        keys_key.func_type = 0x00;
+        keys_key.data_size = func.keycodes.size();
+        for(auto i = 0u; i < func.keycodes.size(); i += 1) {
+            keys_key.keycodes[i] = func.keycodes[i];
+        }
+        keys_key.keycodes[func.keycodes.size()] = 0;
+    } break;
+    case func::KeyFunction::index_of<func::EmulateKeyFunction>: {
+        const auto& func = function.as<func::EmulateKeyFunction>();
+
+        auto& emu_key       = *std::bit_cast<EmulateKeyFunctionPacket*>(&key);
+        emu_key.func_type   = 0x01;
+        emu_key.delay_upper = (func.delay & 0xff00) >> 8;
+        emu_key.delay_lower = (func.delay & 0x00ff);
+        emu_key.data_size   = func.keycodes.size();
+        for(auto i = 0u; i < func.keycodes.size(); i += 1) {
+            emu_key.keycodes[i] = func.keycodes[i];
+        }
+    } break;
+    case func::KeyFunction::index_of<func::MacroKeyFunction>: {
+        const auto& func = function.as<func::MacroKeyFunction>();
+
+        auto& macro_key = *std::bit_cast<MacroKeyFunctionPacket*>(&key);
+        switch(func.repeat) {
+        case func::MacroRepeat::Count:
+            macro_key.func_type    = 0x02;
+            macro_key.repeat_count = func.repeat_count;
+            break;
+        case func::MacroRepeat::Hold:
+            macro_key.func_type    = 0x03;
+            macro_key.repeat_count = 0;
+            break;
+        case func::MacroRepeat::Toggle:
+            macro_key.func_type    = 0x04;
+            macro_key.repeat_count = 0;
+            break;
+        }
+        switch(func.sequence->get_index()) {
+        case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
+            auto& sequence                    = func.sequence->as<func::AutoDelayMacroSequence>();
+            auto& auto_macro_key              = *std::bit_cast<AutoDelayMacroKeyFunctionPacket*>(&key);
+            auto_macro_key.use_recorded_delay = 0;
+            auto_macro_key.auto_delay_upper   = (sequence.delay & 0xff00) >> 8;
+            auto_macro_key.auto_delay_lower   = (sequence.delay & 0x00ff);
+            auto_macro_key.unknown2           = 0;
+            auto_macro_key.data_size          = sequence.keycodes.size();
+            for(auto i = 0u; i < sequence.keycodes.size(); i += 1) {
+                auto_macro_key.keycodes[i] = sequence.keycodes[i];
+            }
+        } break;
+        case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
+            auto& sequence                   = func.sequence->as<func::RecordedDelayMacroSequence>();
+            auto& rec_macro_key              = *std::bit_cast<RecordedDelayMacroKeyFunctionPacket*>(&key);
+            rec_macro_key.use_recorded_delay = 1;
+            rec_macro_key.auto_delay_upper   = 0;
+            rec_macro_key.auto_delay_lower   = 0;
+            rec_macro_key.unknown2           = 0;
+            rec_macro_key.data_size          = sequence.events.size() * sizeof(MacroEvent);
+            for(auto i = 0u; i < sequence.events.size(); i += 1) {
+                auto& key_event       = rec_macro_key.macro_events[i];
+                auto& seq_event       = sequence.events[i];
+                key_event.keycode     = seq_event.keycode;
+                key_event.unknown1    = 0xc8;
+                key_event.delay_upper = (seq_event.delay & 0xff00) >> 8;
+                key_event.delay_lower = (seq_event.delay & 0x00ff);
+            }
+        } break;
+        }
+    } break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+auto legacy_decode(const KeyPacket& buf) -> func::KeyFunction {
+    const auto& key  = *std::bit_cast<KeyFunctionPacket*>(buf.data());
+    auto        func = func::KeyFunction();
+    switch(key.func_type) {
+    case KeyFunctionType::Keys: {
+        const auto& key = *std::bit_cast<KeysKeyFunctionPacket*>(buf.data());
+
+        auto keycodes = std::vector<uint8_t>();
+        for(auto i = 0u; i < key.data_size; i += 1) {
+            keycodes.push_back(key.keycodes[i]);
+        }
+
+        func.emplace<func::KeysFunction>(std::move(keycodes));
+    } break;
+    case KeyFunctionType::CountMacro:
+    case KeyFunctionType::HoldMacro:
+    case KeyFunctionType::ToggleMacro: {
+        auto        macro_func = func::MacroKeyFunction();
+        const auto& key        = *std::bit_cast<MacroKeyFunctionPacket*>(buf.data());
+        switch(key.func_type) {
+        case KeyFunctionType::CountMacro:
+            macro_func.repeat       = func::MacroRepeat::Count;
+            macro_func.repeat_count = key.repeat_count;
+            break;
+        case KeyFunctionType::HoldMacro:
+            macro_func.repeat = func::MacroRepeat::Hold;
+            break;
+        case KeyFunctionType::ToggleMacro:
+            macro_func.repeat = func::MacroRepeat::Toggle;
+            break;
+        }
+        auto macro_sequence = std::make_shared<func::MacroSequence>();
+        if(key.use_recorded_delay) {
+            auto& sequence = macro_sequence->emplace<func::RecordedDelayMacroSequence>();
+
+            const auto& key = *std::bit_cast<RecordedDelayMacroKeyFunctionPacket*>(buf.data());
+            for(auto i = 0; i < int(key.data_size / sizeof(MacroEvent)); i += 1) {
+                const auto& s     = key.macro_events[i];
+                const auto  delay = uint16_t(s.delay_upper << 8 | s.delay_lower);
+                sequence.events.push_back(func::RecordedDelayMacroSequence::Event{s.keycode, delay});
+            }
+        } else {
+            auto& sequence = macro_sequence->emplace<func::AutoDelayMacroSequence>();
+
+            const auto& key = *std::bit_cast<AutoDelayMacroKeyFunctionPacket*>(buf.data());
+            sequence.delay  = key.auto_delay_upper << 8 | key.auto_delay_lower;
+            for(auto i = 0; i < key.data_size; i += 1) {
+                sequence.keycodes.push_back(key.keycodes[i]);
+            }
+        }
+        macro_func.sequence = std::move(macro_sequence);
+        func.emplace<func::MacroKeyFunction>(std::move(macro_func));
+    } break;
+    case KeyFunctionType::Emulate: {
+        auto& emu_func = func.emplace<func::EmulateKeyFunction>();
+
+        const auto& key = *std::bit_cast<EmulateKeyFunctionPacket*>(buf.data());
+        emu_func.delay  = key.delay_upper << 8 | key.delay_lower;
+        for(auto i = 0; i < key.data_size; i += 1) {
+            emu_func.keycodes.push_back(key.keycodes[i]);
+        }
+    } break;
+    }
+    return func;
+}
+
+auto make_functions() -> std::vector<func::KeyFunction> {
+    auto functions = std::vector<func::KeyFunction>();
+    auto seed      = uint32_t(1);
+    auto random    = [&seed](const int limit) {
+        seed = seed * 1103515245 + 12345;
+        return int(seed >> 16) % limit;
+    };
+    auto make_keycodes = [&](const int count) {
+        auto keycodes = std::vector<uint8_t>(count);
+        for(auto& keycode : keycodes) {
+            keycode = 1 + random(200);
+        }
+        return keycodes;
+    };
+    for(auto i = 0; i < 256; i += 1) {
+        auto& function = functions.emplace_back();
+        switch(i % 4) {
+        case 0:
+            function.emplace<func::KeysFunction>(make_keycodes(1 + random(4)));
+            break;
+        case 1:
+            function.emplace<func::EmulateKeyFunction>(uint16_t(random(3000)), make_keycodes(1 + random(20)));
+            break;
+        case 2: {
+            auto sequence = std::make_shared<func::MacroSequence>();
+            sequence->emplace<func::AutoDelayMacroSequence>(uint16_t(random(3000)), make_keycodes(1 + random(30)));
+            function.emplace<func::MacroKeyFunction>(func::MacroRepeat(random(3)), uint8_t(random(10)), std::move(sequence));
+        } break;
+        case 3: {
+            auto  sequence = std::make_shared<func::MacroSequence>();
+            auto& recorded = sequence->emplace<func::RecordedDelayMacroSequence>();
+            for(auto e = random(13); e >= 0; e -= 1) {
+                recorded.events.push_back({uint8_t(1 + random(200)), uint16_t(random(60000))});
+            }
+            function.emplace<func::MacroKeyFunction>(func::MacroRepeat(random(3)), uint8_t(random(10)), std::move(sequence));
+        } break;
+        }
+    }
+    return functions;
+}
+
+auto encode(const func::KeyFunction& function, niz::Report& buf) -> bool {
+    buf.fill(0);
+    return niz::codec::encode_key(function, niz::codec::Buffer(buf.data() + 1, niz::codec::packet_size));
+}
+
+auto get_packet(const niz::Report& buf) -> const KeyPacket& {
+    return *std::bit_cast<const KeyPacket*>(buf.data() + 1);
+}
+
+auto run(const char* const name, const std::vector<func::KeyFunction>& functions, const int iterations, auto func) -> bool {
+    auto       sink  = size_t(0);
+    const auto begin = std::chrono::steady_clock::now();
+    for(auto n = 0; n < iterations; n += 1) {
+        for(const auto& function : functions) {
+            ensure(func(function, sink));
+        }
+    }
+    const auto end  = std::chrono::steady_clock::now();
+    const auto secs = std::chrono::duration<double>(end - begin).count();
+    printf("%-14s %8.1f ns/key (%zx)\n", name, secs * 1e9 / (double(functions.size()) * iterations), sink & 0xff);
+    return true;
+}
+
+// the codec has to produce the same packets as the baseline and survive a round trip
+auto check(const std::vector<func::KeyFunction>& functions) -> bool {
+    auto expect = niz::Report();
+    auto actual = niz::Report();
+    for(const auto& function : functions) {
+        ensure(legacy_encode(function, 0, 0, expect));
+        ensure(encode(function, actual));
+        ensure(memcmp(expect.data() + 1 + niz::codec::payload_offset, actual.data() + 1 + niz::codec::payload_offset, niz::codec::packet_size - niz::codec::payload_offset) == 0);
+        unwrap(size, niz::codec::get_payload_size(get_packet(actual)));
+        ensure(size > 0);
+        unwrap(decoded, niz::codec::decode_key(get_packet(actual)));
+        ensure(encode(decoded, expect));
+        ensure(expect == actual);
+    }
+
+    // oversized functions and data sizes past the packet have to be rejected
+    auto keys = func::KeyFunction();
+    keys.emplace<func::KeysFunction>(std::vector<uint8_t>(58, 4));
+    ensure(encode(keys, actual));
+    keys.as<func::KeysFunction>().keycodes.push_back(4);
+    ensure(!encode(keys, actual));
+    ensure(encode(functions[0], actual));
+    actual[1 + niz::codec::payload_offset + 1] = 59;
+    ensure(!niz::codec::get_payload_size(get_packet(actual)));
+    ensure(!niz::codec::decode_key(get_packet(actual)));
+    return true;
+}
+
+auto measure(const std::vector<func::KeyFunction>& functions, const int iterations) -> bool {
+    auto actual = niz::Report();
+    ensure(run("legacy encode", functions, iterations, [&actual](const func::KeyFunction& function, size_t& sink) -> bool {
+        ensure(legacy_encode(function, 0, 0, actual));
+        sink += actual[8];
+        return true;
+    }));
+    ensure(run("codec encode", functions, iterations, [&actual](const func::KeyFunction& function, size_t& sink) -> bool {
+        ensure(encode(function, actual));
+        sink += actual[8];
+        return true;
+    }));
+
+    auto packets = std::vector<KeyPacket>();
+    for(const auto& function : functions) {
+        ensure(encode(function, actual));
+        packets.push_back(get_packet(actual));
+    }
+    auto index = size_t(0);
+    ensure(run("legacy decode", functions, iterations, [&](const func::KeyFunction& /*function*/, size_t& sink) -> bool {
+        sink += legacy_decode(packets[index++ % packets.size()]).get_index();
+        return true;
+    }));
+    ensure(run("codec decode", functions, iterations, [&](const func::KeyFunction& /*function*/, size_t& sink) -> bool {
+        unwrap(decoded, niz::codec::decode_key(packets[index++ % packets.size()]));
+        sink += decoded.get_index();
+        return true;
+    }));
+    return true;
+}
+
+auto run(const int argc, const char* const argv[]) -> bool {
+    auto iterations = 2000;
+    if(argc >= 2) {
+        unwrap(num, from_chars<int>(argv[1]));
+        iterations = num;
+    }
+    const auto functions = make_functions();
+    ensure(check(functions));
+    // 0 iterations only checks, as the test does
+    return iterations == 0 || measure(functions, iterations);
+}
+} // namespace
+
+// codec-bench [ITERATIONS]
+auto main(const int argc, const char* const argv[]) -> int {
+    return run(argc, argv) ? 0 : 1;
+}
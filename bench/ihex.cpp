@@ -0,0 +1,91 @@
+#include <chrono>
+
+#include "ihex.hpp"
+#include "macros/unwrap.hpp"
+#include "util/charconv.hpp"
+
+namespace {
+// the decoder flush_firmware used before ihex, kept as the baseline
+auto decode_from_chars(const std::string_view hex, const std::span<uint8_t> out) -> bool {
+    for(auto i = 0u; i < hex.size(); i += 2) {
+        unwrap(byte, from_chars<uint8_t>(hex.substr(i, 2), 16));
+        out[i / 2] = byte;
+    }
+    return true;
+}
+
+auto make_records(const int count) -> std::vector<std::string> {
+    auto records = std::vector<std::string>();
+    auto line    = std::array<char, 64>();
+    auto seed    = uint32_t(1);
+    for(auto i = 0; i < count; i += 1) {
+        auto data = std::array<uint8_t, 16>();
+        auto sum  = uint8_t(0x10 + ((i * 16) >> 8 & 0xff) + (i * 16 & 0xff));
+        for(auto& b : data) {
+            seed = seed * 1103515245 + 12345;
+            b    = seed >> 16;
+            sum += b;
+        }
+        auto len = snprintf(line.data(), line.size(), "10%04X00", (i * 16) & 0xffff);
+        for(const auto b : data) {
+            len += snprintf(line.data() + len, line.size() - len, "%02x", b);
+        }
+        snprintf(line.data() + len, line.size() - len, "%02X", uint8_t(-sum));
+        records.emplace_back(line.data());
+    }
+    return records;
+}
+
+auto run(const char* const name, const std::vector<std::string>& records, const int iterations, auto decode) -> bool {
+    auto       out   = std::array<uint8_t, niz::ihex::max_record_size>();
+    auto       sink  = uint8_t(0);
+    const auto begin = std::chrono::steady_clock::now();
+    for(auto n = 0; n < iterations; n += 1) {
+        for(const auto& record : records) {
+            ensure(decode(std::string_view(record), std::span(out)));
+            sink ^= out[4];
+        }
+    }
+    const auto end     = std::chrono::steady_clock::now();
+    const auto secs    = std::chrono::duration<double>(end - begin).count();
+    const auto decoded = double(records.size()) * iterations;
+    printf("%-14s %8.1f ns/record %8.1f MiB/s (%02x)\n", name, secs * 1e9 / decoded, decoded * records[0].size() / secs / 1024 / 1024, sink);
+    return true;
+}
+} // namespace
+
+auto main(const int argc, const char* const argv[]) -> int {
+    auto iterations = 200;
+    if(argc >= 2) {
+        unwrap(num, from_chars<int>(argv[1]));
+        iterations = num;
+    }
+
+    const auto records = make_records(4096);
+
+    // every decoder has to agree before timing them
+    for(const auto& record : records) {
+        auto expect = std::array<uint8_t, niz::ihex::max_record_size>();
+        auto actual = std::array<uint8_t, niz::ihex::max_record_size>();
+        ensure(decode_from_chars(record, expect));
+        ensure(niz::ihex::decode_hex(record, actual));
+        ensure(expect == actual);
+        ensure(niz::ihex::decode_hex_scalar(record, actual));
+        ensure(expect == actual);
+        ensure(niz::ihex::decode_record(record, actual));
+    }
+    // a bad digit and a flipped bit have to be rejected
+    auto buf = std::array<uint8_t, niz::ihex::max_record_size>();
+    auto bad = records[0];
+    bad[20]  = 'g';
+    ensure(!niz::ihex::decode_record(bad, buf));
+    bad = records[0];
+    bad[9] ^= 1;
+    ensure(!niz::ihex::decode_record(bad, buf));
+
+    ensure(run("from_chars", records, iterations, [](auto hex, auto out) { return decode_from_chars(hex, out); }));
+    ensure(run("table", records, iterations, [](auto hex, auto out) { return niz::ihex::decode_hex_scalar(hex, out); }));
+    ensure(run("decode_hex", records, iterations, [](auto hex, auto out) { return niz::ihex::decode_hex(hex, out); }));
+    ensure(run("decode_record", records, iterations, [](auto hex, auto out) { return niz::ihex::decode_record(hex, out).has_value(); }));
+    return 0;
+}
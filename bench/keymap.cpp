@@ -0,0 +1,259 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <unordered_map>
+
+#include <fcntl.h>
+
+#include "common.hpp"
+#include "ihex.hpp"
+#include "macros/unwrap.hpp"
+#include "niz.hpp"
+#include "util/charconv.hpp"
+#include "util/fd.hpp"
+#include "util/file-io.hpp"
+
+// every heap allocation of the process goes through these, so that allocations per op can be reported
+namespace {
+auto allocations = std::atomic_size_t(0);
+} // namespace
+
+auto operator new(const size_t size) -> void* {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(const auto ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator new[](const size_t size) -> void* {
+    return operator new(size);
+}
+
+// gcc takes the free() of a replaced operator delete for a mismatch with operator new
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+auto operator delete(void* const ptr) noexcept -> void {
+    std::free(ptr);
+}
+#pragma GCC diagnostic pop
+
+auto operator delete[](void* const ptr) noexcept -> void {
+    operator delete(ptr);
+}
+
+auto operator delete(void* const ptr, size_t /*size*/) noexcept -> void {
+    operator delete(ptr);
+}
+
+auto operator delete[](void* const ptr, size_t /*size*/) noexcept -> void {
+    operator delete(ptr);
+}
+
+namespace {
+using KeyPacket = std::array<uint8_t, 64>;
+
+// inputs are this many times the size of the reference keymap
+constexpr auto scales = std::array{1, 10, 100};
+// each benchmark repeats its op at least this long
+constexpr auto min_duration = std::chrono::milliseconds(100);
+
+struct Result {
+    double ns_per_op     = 0;
+    double allocs_per_op = 0;
+};
+
+// runs op until min_duration has passed
+auto measure(auto op) -> std::optional<Result> {
+    // the first run warms up caches and lazily allocated storage
+    ensure(op());
+    auto       ops    = size_t(0);
+    const auto allocs = allocations.load();
+    const auto begin  = std::chrono::steady_clock::now();
+    auto       end    = begin;
+    for(; ops < 3 || end - begin < min_duration; ops += 1) {
+        ensure(op());
+        end = std::chrono::steady_clock::now();
+    }
+    auto result          = Result();
+    result.ns_per_op     = std::chrono::duration<double, std::nano>(end - begin).count() / ops;
+    result.allocs_per_op = double(allocations.load() - allocs) / ops;
+    return result;
+}
+
+// the reference keymap repeated, later copies rebind the same keys
+auto make_text(const std::string_view keymap, const int scale) -> std::string {
+    auto text = std::string();
+    text.reserve(keymap.size() * scale);
+    for(auto i = 0; i < scale; i += 1) {
+        text += keymap;
+    }
+    return text;
+}
+
+// firmware image of about the same size as the keymap text, 16 data bytes per record
+auto make_image(const size_t size) -> std::string {
+    auto text = std::string();
+    auto line = std::array<char, 64>();
+    auto seed = uint32_t(1);
+    for(auto i = 0; text.size() < size; i += 1) {
+        const auto addr = (i * 16) & 0xffff;
+        auto       sum  = uint8_t(0x10 + (addr >> 8) + (addr & 0xff));
+        auto       len  = snprintf(line.data(), line.size(), ":10%04X00", addr);
+        for(auto b = 0; b < 16; b += 1) {
+            seed            = seed * 1103515245 + 12345;
+            const auto byte = uint8_t(seed >> 16);
+            sum += byte;
+            len += snprintf(line.data() + len, line.size() - len, "%02X", byte);
+        }
+        snprintf(line.data() + len, line.size() - len, "%02X\n", uint8_t(-sum));
+        text += line.data();
+    }
+    text += ":00000001FF\n";
+    return text;
+}
+
+// "NAME NS_PER_OP ALLOCS_PER_OP" lines, both rounded to integers
+auto load_baseline(const char* const path) -> std::optional<std::unordered_map<std::string, Result>> {
+    unwrap(data, read_file(path));
+    auto baseline = std::unordered_map<std::string, Result>();
+    auto text     = std::string_view(std::bit_cast<const char*>(data.data()), data.size());
+    while(!text.empty()) {
+        const auto end  = std::min(text.find('\n'), text.size());
+        const auto line = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+        if(line.empty() || line.starts_with('#')) {
+            continue;
+        }
+        const auto first  = line.find(' ');
+        const auto second = line.find(' ', first + 1);
+        ensure(first != line.npos && second != line.npos, "malformed baseline line ", line);
+        unwrap(ns, from_chars<uint64_t>(line.substr(first + 1, second - first - 1)));
+        unwrap(allocs, from_chars<uint64_t>(line.substr(second + 1)));
+        auto& result         = baseline[std::string(line.substr(0, first))];
+        result.ns_per_op     = ns;
+        result.allocs_per_op = allocs;
+    }
+    return baseline;
+}
+
+struct Suite {
+    std::optional<std::unordered_map<std::string, Result>> baseline;
+    std::optional<double>                                  threshold; // allowed slowdown over the baseline, timings are not compared without it
+    std::string                                            report;    // baseline of this run
+    bool                                                   ok = true;
+
+    auto run(const std::string& name, auto op) -> bool {
+        unwrap(result, measure(op));
+        printf("%-24s %12.1f ns/op %10.1f allocs/op", name.data(), result.ns_per_op, result.allocs_per_op);
+        report += build_string(name, " ", std::llround(result.ns_per_op), " ", std::llround(result.allocs_per_op), "\n");
+        if(!baseline) {
+            printf("\n");
+            return true;
+        }
+        const auto found = baseline->find(name);
+        if(found == baseline->end()) {
+            printf("  no baseline\n");
+            return true;
+        }
+        const auto& base = found->second;
+        // allocation counts do not depend on the machine, so any increase is a regression
+        // timings do, so they are only compared on request, against a baseline taken on the same machine
+        const auto slow   = threshold && result.ns_per_op > base.ns_per_op * (1 + *threshold);
+        const auto allocs = result.allocs_per_op > base.allocs_per_op + 0.5;
+        printf("  %+6.1f%%%s%s\n", (result.ns_per_op / base.ns_per_op - 1) * 100, slow ? "  SLOWER" : "", allocs ? "  MORE ALLOCS" : "");
+        ok &= !slow && !allocs;
+        return true;
+    }
+};
+
+auto run(const int argc, const char* const argv[]) -> bool {
+    ensure(argc >= 2, "usage: keymap-bench CONFIG [--threshold PERCENT] [--baseline FILE] [--write-baseline FILE]");
+    auto suite       = Suite();
+    auto output_path = (const char*)(nullptr);
+    for(auto i = 2; i + 1 < argc; i += 2) {
+        const auto option = std::string_view(argv[i]);
+        if(option == "--threshold") {
+            unwrap(percent, from_chars<int>(argv[i + 1]));
+            suite.threshold = percent / 100.0;
+        } else if(option == "--baseline") {
+            suite.baseline = load_baseline(argv[i + 1]);
+            ensure(suite.baseline);
+        } else if(option == "--write-baseline") {
+            output_path = argv[i + 1];
+        } else {
+            bail("unknown option ", option);
+        }
+    }
+
+    unwrap(keymap_file, read_file(argv[1]));
+    const auto keymap_txt = std::string_view(std::bit_cast<const char*>(keymap_file.data()), keymap_file.size());
+    unwrap(keymap, niz::KeyMap::from_string(keymap_txt));
+    unwrap(compact, niz::CompactKeyMap::from_keymap(keymap));
+    // what from_keyboard receives: the KeyData packets without report id
+    auto captured = std::vector<KeyPacket>();
+    for(const auto& report : compact.make_reports()) {
+        if(report[2] == niz::PacketType::KeyData) {
+            std::memcpy(captured.emplace_back().data(), report.data() + 1, sizeof(KeyPacket));
+        }
+    }
+
+    for(const auto scale : scales) {
+        const auto text  = make_text(keymap_txt, scale);
+        const auto image = make_image(text.size());
+        const auto tag   = build_string("/", scale, "x");
+
+        ensure(suite.run("parse" + tag, [&text]() -> bool {
+            unwrap(parsed, niz::KeyMap::from_string(text));
+            return !parsed.functions[0].empty();
+        }));
+        ensure(suite.run("serialize" + tag, [&keymap, scale]() -> bool {
+            for(auto i = 0; i < scale; i += 1) {
+                ensure(!keymap.to_string().empty());
+            }
+            return true;
+        }));
+        ensure(suite.run("encode" + tag, [&keymap, scale]() -> bool {
+            for(auto i = 0; i < scale; i += 1) {
+                unwrap(encoded, niz::CompactKeyMap::from_keymap(keymap));
+                ensure(encoded.make_reports().size() > 2);
+            }
+            return true;
+        }));
+        ensure(suite.run("decode" + tag, [&captured, scale]() -> bool {
+            for(auto i = 0; i < scale; i += 1) {
+                auto decoded = niz::CompactKeyMap();
+                for(const auto& packet : captured) {
+                    ensure(decoded.set_key(packet));
+                }
+                ensure(decoded.to_keymap());
+            }
+            return true;
+        }));
+        ensure(suite.run("hex-decode" + tag, [&image]() -> bool {
+            auto reader = niz::ihex::LineReader{image};
+            auto buf    = std::array<uint8_t, niz::ihex::max_record_size>();
+            while(!reader.at_end()) {
+                unwrap(record, reader.next());
+                ensure(niz::ihex::decode_record(record, buf));
+            }
+            return true;
+        }));
+    }
+
+    if(output_path != nullptr) {
+        const auto out = FileDescriptor(open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        ensure(out.as_handle() >= 0, strerror(errno));
+        ensure(out.write(suite.report.data(), suite.report.size()));
+    }
+    ensure(suite.ok, "regression over the baseline");
+    return true;
+}
+} // namespace
+
+// keymap-bench CONFIG [--threshold PERCENT] [--baseline FILE] [--write-baseline FILE]
+auto main(const int argc, const char* const argv[]) -> int {
+    return run(argc, argv) ? 0 : 1;
+}
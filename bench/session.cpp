@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "emulator.hpp"
+#include "fleet.hpp"
+#include "image.hpp"
+#include "macros/unwrap.hpp"
+#include "niz.hpp"
+#include "server.hpp"
+#include "util/charconv.hpp"
+#include "util/file-io.hpp"
+#include "watch.hpp"
+
+namespace {
+auto make_keymap(const int keys) -> niz::KeyMap {
+    auto keymap = niz::KeyMap();
+    for(auto layer = 0; layer < 3; layer += 1) {
+        auto& funcs = keymap.functions[layer];
+        funcs.resize(keys);
+        for(auto pos = 0; pos < keys; pos += 1) {
+            funcs[pos].emplace<niz::func::KeysFunction>(std::vector<uint8_t>{uint8_t(pos + 1)});
+        }
+    }
+    return keymap;
+}
+
+auto make_temp_path() -> std::optional<std::string> {
+    auto       path = std::string("/tmp/niz-bench-XXXXXX");
+    const auto fd   = mkstemp(path.data());
+    ensure(fd >= 0);
+    close(fd);
+    return path;
+}
+
+auto write_file(const std::string& path, const std::span<const uint8_t> data) -> bool {
+    auto fd = FileDescriptor(open(path.data(), O_WRONLY | O_TRUNC));
+    ensure(fd.as_handle() >= 0);
+    ensure(fd.write(data.data(), data.size()));
+    return true;
+}
+
+auto make_file(const std::filesystem::path& path) -> std::string {
+    close(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    return path.string();
+}
+
+// writes records of 16 data bytes, each line is sent as a single report
+auto make_firmware(const char* const path, const int records) -> bool {
+    auto str  = std::string();
+    auto line = std::array<char, 64>();
+    for(auto i = 0; i < records; i += 1) {
+        // checksum is the two's complement of length + address + type + data
+        const auto addr = (i * 16) & 0xffff;
+        const auto sum  = uint8_t(0x10 + (addr >> 8) + (addr & 0xff) + 16 * 0xa5);
+        snprintf(line.data(), line.size(), ":10%04X00A5A5A5A5A5A5A5A5A5A5A5A5A5A5A5A5%02X\r\n", addr, uint8_t(-sum));
+        str += line.data();
+    }
+    str += ":00000001FF\r\n";
+    auto fd = FileDescriptor(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    ensure(fd.as_handle() >= 0);
+    ensure(fd.write(str.data(), str.size()));
+    return true;
+}
+
+// stdout is redirected while a session runs so that progress printing does not reach the terminal
+struct Silence {
+    int saved;
+
+    Silence() {
+        fflush(stdout);
+        saved          = dup(STDOUT_FILENO);
+        const auto nul = open("/dev/null", O_WRONLY);
+        dup2(nul, STDOUT_FILENO);
+        close(nul);
+    }
+
+    ~Silence() {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+};
+
+auto run_session(niz::Emulator& emu, const char* const name, const int iterations, auto func) -> bool {
+    const auto packets_before = emu.counters.received + emu.counters.sent;
+    const auto begin          = std::chrono::steady_clock::now();
+    {
+        auto silence = Silence();
+        for(auto i = 0; i < iterations; i += 1) {
+            ensure(func());
+        }
+        // a round trip guarantees that every report written so far was consumed by the emulator
+        ensure(niz::get_version(emu.get_fd()));
+    }
+    const auto end     = std::chrono::steady_clock::now();
+    const auto packets = emu.counters.received + emu.counters.sent - packets_before;
+    const auto secs    = std::chrono::duration<double>(end - begin).count();
+    printf("%-18s %4d sessions %8zu packets %10.3fms total %8.3fms/session %12.0f packets/s\n",
+           name, iterations, packets, secs * 1000, secs * 1000 / iterations, packets / secs);
+    return true;
+}
+// text keymaps are parsed and encoded on every write, images are sent as they are
+auto run_keymap_file_sessions(niz::Emulator& emu, const niz::KeyMap& keymap, const int iterations) -> bool {
+    const auto fd = emu.get_fd();
+    unwrap(text_path, make_temp_path());
+    unwrap(image_path, make_temp_path());
+    const auto text = keymap.to_string();
+    unwrap(image, niz::image::compile(keymap));
+    const auto ok = write_file(text_path, std::span(std::bit_cast<const uint8_t*>(text.data()), text.size())) &&
+                    write_file(image_path, image) &&
+                    run_session(emu, "write-keymap-text", iterations, [&]() -> bool {
+                        unwrap(keymap_txt, read_file(text_path.data()));
+                        unwrap(keymap, niz::KeyMap::from_string(std::string_view((char*)keymap_txt.data(), keymap_txt.size())));
+                        return keymap.write_to_keyboard(fd);
+                    }) &&
+                    run_session(emu, "write-keymap-image", iterations, [&]() { return niz::image::write_to_keyboard(fd, image_path.data()); });
+    unlink(text_path.data());
+    unlink(image_path.data());
+    return ok;
+}
+// the same keymap written to several keyboards, one at a time and all at once
+auto run_fleet_sessions(const niz::KeyMap& keymap, const int iterations) -> bool {
+    constexpr auto count = 8;
+
+    auto emus    = std::array<niz::Emulator, count>();
+    auto devices = std::vector<std::string>();
+    for(auto i = 0; i < count; i += 1) {
+        emus[i].latency = std::chrono::microseconds(125); // high speed usb
+        ensure(emus[i].start());
+        // like fleet::open_device, writes wait in poll when the device is busy
+        ensure(fcntl(emus[i].get_fd(), F_SETFL, O_NONBLOCK) == 0);
+        devices.push_back(std::to_string(i));
+    }
+    const auto open = [&emus](const std::string& device) {
+        return FileDescriptor(dup(emus[std::stoi(device)].get_fd()));
+    };
+
+    unwrap(compact, niz::CompactKeyMap::from_keymap(keymap));
+    const auto reports = compact.make_reports();
+    // hidraw writes block until the device takes the report, a round trip emulates that
+    const auto job = [&reports](const int fd, const std::string&, std::string&) {
+        return niz::write_reports(fd, reports) && niz::get_version(fd).has_value();
+    };
+    for(const auto workers : {1, count}) {
+        const auto begin = std::chrono::steady_clock::now();
+        for(auto i = 0; i < iterations; i += 1) {
+            const auto results = niz::fleet::run(devices, job, workers, open);
+            ensure(std::ranges::all_of(results, [](const auto& result) { return result.ok; }));
+        }
+        const auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("fleet-write-keymap %4d sessions %8d devices %10.3fms total %8.3fms/session %12d workers\n",
+               iterations, count, secs * 1000, secs * 1000 / iterations, workers);
+    }
+    return true;
+}
+
+// keyboards appear in a temporary dev directory, the watcher provisions each one
+auto run_hotplug_session(const niz::KeyMap& keymap) -> bool {
+    constexpr auto count = 4;
+
+    auto root = std::string("/tmp/niz-bench-XXXXXX");
+    ensure(mkdtemp(root.data()) != nullptr);
+    const auto dev_dir = std::filesystem::path(root) / "dev";
+    const auto sys_dir = std::filesystem::path(root) / "sys";
+    std::filesystem::create_directories(dev_dir);
+    for(auto i = 0; i < count; i += 1) {
+        const auto device = sys_dir / ("hidraw" + std::to_string(i)) / "device";
+        std::filesystem::create_directories(device);
+        const auto uevent = std::string_view("HID_NAME=CATEX TECH. 84EC-XRGB\n");
+        ensure(write_file(make_file(device / "uevent"), {std::bit_cast<const uint8_t*>(uevent.data()), uevent.size()}));
+    }
+
+    auto emus = std::array<niz::Emulator, count>();
+    for(auto& emu : emus) {
+        emu.latency = std::chrono::microseconds(125);
+        ensure(emu.start());
+    }
+    const auto open = [&emus](const std::string& device) {
+        const auto num = std::stoi(device.substr(device.rfind("hidraw") + 6));
+        return FileDescriptor(dup(emus[num].get_fd()));
+    };
+
+    unwrap(compact, niz::CompactKeyMap::from_keymap(keymap));
+    const auto job = [reports = compact.make_reports()](const int fd, const std::string&, std::string&) {
+        return niz::write_reports(fd, reports) && niz::get_version(fd).has_value();
+    };
+    auto options        = niz::watch::Options();
+    options.dev_dir     = dev_dir;
+    options.sys_dir     = sys_dir;
+    options.max_devices = count;
+    auto ok             = false;
+    auto watcher        = std::thread([&]() { ok = niz::watch::run(options, job, open); });
+    // give the watcher time to set up its inotify watch
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const auto begin = std::chrono::steady_clock::now();
+    for(auto i = 0; i < count; i += 1) {
+        make_file(dev_dir / ("hidraw" + std::to_string(i)));
+    }
+    watcher.join();
+    const auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("hotplug-write-keymap %8d devices %10.3fms total\n", count, secs * 1000);
+    std::filesystem::remove_all(root);
+    ensure(ok);
+
+    // the watcher only logs failed jobs, so every keyboard is read back
+    for(const auto& emu : emus) {
+        unwrap(written, niz::CompactKeyMap::from_keyboard(emu.get_fd()));
+        ensure(written.get_hash() == compact.get_hash(), "a keyboard did not get the keymap");
+    }
+    return true;
+}
+
+// per call setup of the cli against requests to a daemon which keeps the device open
+auto run_daemon_sessions(niz::Emulator& emu, const niz::KeyMap& keymap, const int iterations) -> bool {
+    unwrap(socket_path, make_temp_path());
+    unlink(socket_path.data());
+
+    unwrap(version, niz::get_version(emu.get_fd()));
+    auto ok     = false;
+    auto server = std::thread([&]() { ok = niz::server::serve(emu.get_fd(), version, socket_path.data()); });
+    auto client = FileDescriptor();
+    for(auto i = 0; i < 100 && client.as_handle() < 0; i += 1) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        client = niz::server::connect(socket_path.data());
+    }
+    ensure(client.as_handle() >= 0);
+
+    const auto keymap_txt = keymap.to_string();
+    ensure(niz::server::request(client.as_handle(), niz::server::Command::WriteKeymap, keymap_txt));
+    unwrap(read_txt, niz::server::request(client.as_handle(), niz::server::Command::ReadKeymap));
+    // the daemon names the positions of the model, as read-keymap does
+    auto expected = keymap;
+    expected.set_layout_for(version);
+    ensure(read_txt == expected.to_string(), "cached keymap differs");
+
+    const auto time = [iterations](const char* const name, auto func) -> bool {
+        const auto begin = std::chrono::steady_clock::now();
+        for(auto i = 0; i < iterations; i += 1) {
+            ensure(func());
+        }
+        const auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        printf("%-22s %4d sessions %10.3fms total %8.3fms/session\n", name, iterations, secs * 1000, secs * 1000 / iterations);
+        return true;
+    };
+    ensure(time("cli-read-keymap", [&]() {
+        const auto fd = FileDescriptor(dup(emu.get_fd()));
+        return niz::get_version(fd.as_handle()) && niz::KeyMap::from_keyboard(fd.as_handle()).has_value();
+    }));
+    ensure(time("daemon-read-keymap", [&]() {
+        return niz::server::request(client.as_handle(), niz::server::Command::ReadKeymap).has_value();
+    }));
+    ensure(time("cli-print-keycounts", [&]() {
+        const auto fd = FileDescriptor(dup(emu.get_fd()));
+        return niz::get_version(fd.as_handle()) && niz::read_counts(fd.as_handle()).has_value();
+    }));
+    ensure(time("daemon-print-keycounts", [&]() {
+        return niz::server::request(client.as_handle(), niz::server::Command::ReadCounts).has_value();
+    }));
+
+    ensure(niz::server::request(client.as_handle(), niz::server::Command::Stop));
+    server.join();
+    return ok;
+}
+
+auto run(const int argc, const char* const argv[]) -> bool {
+    auto       emu    = niz::Emulator();
+    const auto keymap = make_keymap(emu.key_count);
+    if(argc >= 2 && std::string_view(argv[1]) == "hotplug") {
+        return run_hotplug_session(keymap);
+    }
+    auto iterations = 20;
+    if(argc >= 2) {
+        unwrap(num, from_chars<int>(argv[1]));
+        iterations = num;
+    }
+
+    ensure(emu.start());
+    const auto fd = emu.get_fd();
+
+    ensure(run_session(emu, "write-keymap", iterations, [&]() { return keymap.write_to_keyboard(fd); }));
+    ensure(run_keymap_file_sessions(emu, keymap, iterations));
+    auto modified = keymap;
+    modified.functions[0][0].emplace<niz::func::KeysFunction>(std::vector<uint8_t>{0x10});
+    ensure(run_session(emu, "write-keymap-diff", iterations, [&]() { return modified.write_diff_to_keyboard(fd, keymap); }));
+    ensure(run_session(emu, "read-keymap", iterations, [&]() { return niz::KeyMap::from_keyboard(fd).has_value(); }));
+    ensure(run_session(emu, "print-keycounts", iterations, [&]() { return niz::read_counts(fd).has_value(); }));
+    ensure(run_daemon_sessions(emu, keymap, iterations));
+
+    ensure(run_fleet_sessions(keymap, std::max(iterations / 10, 1)));
+    ensure(run_hotplug_session(keymap));
+
+    unwrap(firmware_path, make_temp_path());
+    const auto ok = make_firmware(firmware_path.data(), 4096) &&
+                    run_session(emu, "flush-firmware", iterations, [&]() { return niz::flush_firmware(fd, firmware_path.data()); });
+    unlink(firmware_path.data());
+    return ok;
+}
+} // namespace
+
+// session-bench [ITERATIONS], or session-bench hotplug to only check that the watcher provisions every keyboard
+auto main(const int argc, const char* const argv[]) -> int {
+    return run(argc, argv) ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#include <charconv>
+#include <cinttypes>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+#include "macros/unwrap.hpp"
+#include "niz.hpp"
+#include "util/fd.hpp"
+#include "util/file-io.hpp"
+
+namespace niz::cache {
+namespace {
+auto get_dir() -> std::optional<std::filesystem::path> {
+    if(const auto xdg = getenv("XDG_CACHE_HOME"); xdg != nullptr && xdg[0] == '/') {
+        return std::filesystem::path(xdg) / "niz-kbd-util";
+    }
+    const auto home = getenv("HOME");
+    ensure(home != nullptr && home[0] != '\0', "neither XDG_CACHE_HOME nor HOME is set");
+    return std::filesystem::path(home) / ".cache" / "niz-kbd-util";
+}
+
+auto to_hex(const uint64_t value) -> std::string {
+    auto buf = std::array<char, 17>();
+    snprintf(buf.data(), buf.size(), "%016" PRIx64, value);
+    return buf.data();
+}
+
+// replaces path at once, so that a reader never sees a partial file
+auto write_file_atomic(const std::string& path, const std::string_view data) -> bool {
+    const auto tmp = path + ".tmp";
+    {
+        const auto fd = FileDescriptor(open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        ensure(fd.as_handle() >= 0, "can not write ", tmp, ": ", strerror(errno));
+        ensure(fd.write(data.data(), data.size()));
+    }
+    ensure(rename(tmp.data(), path.data()) == 0, "can not rename ", tmp, ": ", strerror(errno));
+    return true;
+}
+} // namespace
+
+auto Entry::get_hash() const -> std::optional<uint64_t> {
+    const auto data = read_file((path + ".hash").data());
+    if(!data || data->size() < 16) {
+        return std::nullopt;
+    }
+    auto       hash = uint64_t();
+    const auto text = std::bit_cast<const char*>(data->data());
+    if(std::from_chars(text, text + 16, hash, 16).ptr != text + 16) {
+        return std::nullopt;
+    }
+    return hash;
+}
+
+auto Entry::read_keymap() const -> std::optional<std::string> {
+    unwrap(hash, get_hash());
+    unwrap(data, read_file((path + ".niz").data()));
+    auto text = std::string(std::bit_cast<const char*>(data.data()), data.size());
+    unwrap(keymap, KeyMap::from_string(text));
+    unwrap(compact, CompactKeyMap::from_keymap(keymap));
+    ensure(compact.get_hash() == hash, "cached keymap does not match its hash");
+    return text;
+}
+
+auto Entry::store(const uint64_t hash, const std::string_view keymap_text) const -> bool {
+    // the hash is written last, it makes the keymap valid
+    ensure(write_file_atomic(path + ".niz", keymap_text));
+    ensure(write_file_atomic(path + ".hash", to_hex(hash) + "\n"));
+    return true;
+}
+
+auto Entry::invalidate() const -> void {
+    unlink((path + ".hash").data());
+}
+
+auto Entry::open(const std::string_view serial, const std::string_view version) -> std::optional<Entry> {
+    unwrap(dir, get_dir());
+    auto error = std::error_code();
+    std::filesystem::create_directories(dir, error);
+    ensure(!error, "can not create ", dir.string(), ": ", error.message());
+    // versions are free text, serials are hex digits
+    return Entry{(dir / (std::string(serial) + "-" + to_hex(hash_bytes(version)))).string()};
+}
+
+auto open_device(const int fd, const std::string_view version) -> std::optional<Entry> {
+    unwrap(serial, get_serial(fd));
+    return Entry::open(serial, version);
+}
+
+auto write_if_changed(const int fd, const std::optional<Entry>& entry, const std::span<const Report> reports, const uint64_t hash, const std::string_view keymap_text, std::string& output) -> bool {
+    if(!entry) {
+        output = "serial unavailable, cache not used";
+        return write_reports(fd, reports);
+    }
+    if(entry->get_hash() == hash) {
+        output = "keymap is on the keyboard already";
+        return true;
+    }
+    entry->invalidate();
+    ensure(write_reports(fd, reports));
+    if(!entry->store(hash, keymap_text)) {
+        output = "keymap written, but not cached";
+    }
+    return true;
+}
+} // namespace niz::cache
@@ -0,0 +1,32 @@
+#pragma once
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "common.hpp"
+
+namespace niz::cache {
+// keymap last read from or written to each keyboard, keyed by serial and firmware version
+// stored under $XDG_CACHE_HOME/niz-kbd-util, or ~/.cache/niz-kbd-util
+// an entry goes stale if the keymap is changed by other means, so callers can bypass the cache
+struct Entry {
+    std::string path; // without extension
+
+    auto get_hash() const -> std::optional<uint64_t>;
+    // returns the cached keymap text if it still has the cached hash
+    auto read_keymap() const -> std::optional<std::string>;
+    auto store(uint64_t hash, std::string_view keymap_text) const -> bool;
+    // forgets the keymap, before a write which can fail halfway
+    auto invalidate() const -> void;
+
+    static auto open(std::string_view serial, std::string_view version) -> std::optional<Entry>;
+};
+
+// opens the entry of the keyboard on fd, nullopt if its serial can not be read
+auto open_device(int fd, std::string_view version) -> std::optional<Entry>;
+
+// writes reports unless entry says that a keymap with hash is on the keyboard already
+// keymap_text is cached after a successful write, without entry the reports are just written
+auto write_if_changed(int fd, const std::optional<Entry>& entry, std::span<const Report> reports, uint64_t hash, std::string_view keymap_text, std::string& output) -> bool;
+} // namespace niz::cache
@@ -9,12 +9,17 @@ namespace {
 auto read_and_expect(const int fd, const uint16_t type, const int expect) -> bool {
     ensure(send_packet(fd, type, {}));
 
+    // calibration finishes when the user is done with the keys
+    auto deadlines    = get_deadlines();
+    deadlines.report  = deadlines.calibration;
+    deadlines.session = deadlines.calibration;
+
     auto       buf = std::array<uint8_t, 64>();
-    const auto len = read(fd, buf.data(), buf.size());
+    const auto len = read_report(fd, type, buf, deadlines);
     ensure(len > 0);
 
     auto& count = *std::bit_cast<Packet*>(buf.data());
-    ensure(count.type == expect);
+    ensure(count.type == expect, "expected ", get_packet_name(expect), " but got ", get_packet_name(count.type));
 
     return true;
 }
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.hpp"
+#include "macros/assert.hpp"
+#include "util/fd.hpp"
+#include "util/print.hpp"
+
+namespace niz::check {
+namespace {
+// reads the whole file into buf, which is reused across files of a worker
+auto read_into(const char* const path, std::string& buf) -> std::optional<std::string> {
+    const auto fd = FileDescriptor(open(path, O_RDONLY | O_CLOEXEC));
+    if(fd.as_handle() < 0) {
+        return strerror(errno);
+    }
+    struct stat st = {};
+    if(fstat(fd.as_handle(), &st) != 0) {
+        return strerror(errno);
+    }
+    buf.resize(st.st_size);
+    for(auto done = size_t(0); done < buf.size();) {
+        const auto len = read(fd.as_handle(), buf.data() + done, buf.size() - done);
+        if(len < 0 && errno == EINTR) {
+            continue;
+        }
+        if(len <= 0) {
+            return len < 0 ? strerror(errno) : "file shrank while reading";
+        }
+        done += len;
+    }
+    return std::nullopt;
+}
+
+auto check_file(const std::string& path, std::string& buf, ParseCache& cache) -> FileResult {
+    auto result = FileResult();
+    result.path = path;
+    if(const auto error = read_into(path.data(), buf)) {
+        result.diagnostics.push_back({0, 0, true, *error});
+        return result;
+    }
+    result.ok = KeyMap::from_string(buf, result.diagnostics, path.data(), &cache).has_value();
+    return result;
+}
+
+// a directory which can not be read fails the check, but its siblings are still searched
+auto search(const std::filesystem::path& dir, std::vector<std::string>& files, std::vector<FileResult>& errors) -> void {
+    auto error = std::error_code();
+    auto it    = std::filesystem::directory_iterator(dir, error);
+    for(; !error && it != std::filesystem::directory_iterator(); it.increment(error)) {
+        // symlinks to directories are not followed, so that loops end, broken symlinks are skipped
+        auto entry_error = std::error_code();
+        if(it->symlink_status(entry_error).type() == std::filesystem::file_type::directory) {
+            search(it->path(), files, errors);
+        } else if(it->path().extension() == ".niz" && it->is_regular_file(entry_error)) {
+            files.push_back(it->path().string());
+        }
+    }
+    if(error) {
+        auto& result = errors.emplace_back();
+        result.path  = dir.string();
+        result.diagnostics.push_back({0, 0, true, build_string("can not search the directory: ", error.message())});
+    }
+}
+} // namespace
+
+auto find_files(const std::span<const char* const> paths, std::vector<FileResult>& errors) -> std::vector<std::string> {
+    auto files = std::vector<std::string>();
+    for(const auto path : paths) {
+        auto error = std::error_code();
+        if(!std::filesystem::is_directory(path, error)) {
+            files.emplace_back(path);
+            continue;
+        }
+        const auto begin = files.size();
+        search(path, files, errors);
+        std::sort(files.begin() + begin, files.end());
+    }
+    return files;
+}
+
+auto run(const std::span<const std::string> paths, const size_t threads) -> std::vector<FileResult> {
+    auto results = std::vector<FileResult>(paths.size());
+    auto next    = std::atomic_size_t(0);
+    auto cache   = ParseCache();
+    auto worker  = [&]() {
+        auto buf = std::string();
+        for(auto i = next++; i < paths.size(); i = next++) {
+            results[i] = check_file(paths[i], buf, cache);
+        }
+    };
+
+    const auto cores   = size_t(std::max(std::thread::hardware_concurrency(), 1u));
+    auto       workers = std::vector<std::thread>(std::min(paths.size(), threads == 0 ? cores : threads));
+    for(auto& thread : workers) {
+        thread = std::thread(worker);
+    }
+    for(auto& thread : workers) {
+        thread.join();
+    }
+    return results;
+}
+
+auto print_report(const std::span<const FileResult> results) -> bool {
+    auto failed   = size_t(0);
+    auto errors   = size_t(0);
+    auto warnings = size_t(0);
+    for(const auto& result : results) {
+        failed += result.ok ? 0 : 1;
+        for(const auto& diagnostic : result.diagnostics) {
+            (diagnostic.error ? errors : warnings) += 1;
+            printf("%s:%zu:%zu: %s: %s\n", result.path.data(), diagnostic.line, diagnostic.column,
+                   diagnostic.error ? "error" : "warning", diagnostic.message.data());
+        }
+    }
+    warn(results.size(), " files checked, ", failed, " invalid, ", errors, " errors, ", warnings, " warnings");
+    return failed == 0;
+}
+} // namespace niz::check
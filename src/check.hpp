@@ -0,0 +1,26 @@
+#pragma once
+#include <span>
+#include <string>
+#include <vector>
+
+#include "niz.hpp"
+
+namespace niz::check {
+struct FileResult {
+    std::string             path;
+    std::vector<Diagnostic> diagnostics;
+    bool                    ok = false;
+};
+
+// paths with directories replaced by the .niz files under them, directories are searched recursively
+// files found in a directory are sorted, paths given as files are kept even without the extension
+// directories which can not be read are added to errors as failed results
+auto find_files(std::span<const char* const> paths, std::vector<FileResult>& errors) -> std::vector<std::string>;
+// parses every file with KeyMap::from_string on a pool of threads, 0 threads for one per core
+// included files are parsed once per run
+// results are in the order of paths
+auto run(std::span<const std::string> paths, size_t threads = 0) -> std::vector<FileResult>;
+// prints a "PATH:LINE:COLUMN: error|warning: MESSAGE" line for each diagnostic and a summary to stderr
+// returns true if no file has an error
+auto print_report(std::span<const FileResult> results) -> bool;
+} // namespace niz::check
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <array>
+#include <memory>
+
+#include "codec.hpp"
+#include "macros/assert.hpp"
+
+namespace niz::codec {
+namespace {
+struct KeyFunctionType {
+    enum : uint8_t {
+        Keys        = 0x00, // press keys at the same time
+        Emulate     = 0x01, // press keys in a row at constant intervals
+        CountMacro  = 0x02, // run a recorded macro a specified number of times
+        HoldMacro   = 0x03, // run a recorded macro while the key is pressed
+        ToggleMacro = 0x04, // keep running the recorded macro until the same key is pressed again
+    };
+};
+
+// a layout is a list of fields, each of which knows how to move one member between an object and a packet
+// begin and end are the bytes a field always occupies, size() also covers variable length data
+
+template <size_t begin_, size_t end_>
+struct Field {
+    static constexpr auto begin = begin_;
+    static constexpr auto end   = end_;
+
+    static auto matches(ConstBuffer /*buf*/) -> bool {
+        return true;
+    }
+
+    static auto size(ConstBuffer /*buf*/) -> size_t {
+        return end;
+    }
+};
+
+// byte which identifies the layout, decoding does not match if it differs
+template <size_t offset, uint8_t value>
+struct Tag : Field<offset, offset + 1> {
+    static auto matches(const ConstBuffer buf) -> bool {
+        return buf[offset] == value;
+    }
+
+    static auto encode(const auto& /*obj*/, const Buffer buf) -> bool {
+        buf[offset] = value;
+        return true;
+    }
+
+    static auto decode(ConstBuffer /*buf*/, auto& /*obj*/) -> bool {
+        return true;
+    }
+};
+
+// byte which is always sent with the same value and ignored on receive
+template <size_t offset, uint8_t value>
+struct Constant : Field<offset, offset + 1> {
+    static auto encode(const auto& /*obj*/, const Buffer buf) -> bool {
+        buf[offset] = value;
+        return true;
+    }
+
+    static auto decode(ConstBuffer /*buf*/, auto& /*obj*/) -> bool {
+        return true;
+    }
+};
+
+auto store_be16(uint8_t* const ptr, const uint16_t value) -> void {
+    ptr[0] = value >> 8;
+    ptr[1] = value & 0xff;
+}
+
+auto load_be16(const uint8_t* const ptr) -> uint16_t {
+    return ptr[0] << 8 | ptr[1];
+}
+
+template <size_t offset, auto member>
+struct BE16 : Field<offset, offset + 2> {
+    static auto encode(const auto& obj, const Buffer buf) -> bool {
+        store_be16(&buf[offset], obj.*member);
+        return true;
+    }
+
+    static auto decode(const ConstBuffer buf, auto& obj) -> bool {
+        obj.*member = load_be16(&buf[offset]);
+        return true;
+    }
+};
+
+struct Keycode {
+    using Type                  = uint8_t;
+    static constexpr auto bytes = size_t(1);
+
+    static auto encode(const Type keycode, uint8_t* const ptr) -> void {
+        ptr[0] = keycode;
+    }
+
+    static auto decode(const uint8_t* const ptr) -> Type {
+        return ptr[0];
+    }
+};
+
+struct Event {
+    using Type                  = func::RecordedDelayMacroSequence::Event;
+    static constexpr auto bytes = size_t(4);
+
+    static auto encode(const Type event, uint8_t* const ptr) -> void {
+        ptr[0] = event.keycode;
+        ptr[1] = 0xc8; // unknown
+        store_be16(ptr + 2, event.delay);
+    }
+
+    static auto decode(const uint8_t* const ptr) -> Type {
+        return {ptr[0], load_be16(ptr + 2)};
+    }
+};
+
+// data_size byte followed by elements, data_size counts bytes
+template <size_t size_offset, size_t offset, auto member, class Element>
+struct Array : Field<size_offset, offset> {
+    static_assert(size_offset < offset);
+    static constexpr auto max_elements = std::min(packet_size - offset, size_t(255)) / Element::bytes;
+    static_assert(max_elements > 0);
+
+    static auto size(const ConstBuffer buf) -> size_t {
+        return offset + buf[size_offset];
+    }
+
+    static auto encode(const auto& obj, const Buffer buf) -> bool {
+        const auto& elements = obj.*member;
+        ensure(elements.size() <= max_elements, elements.size(), " elements do not fit in a packet, the limit is ", max_elements);
+        buf[size_offset] = elements.size() * Element::bytes;
+        for(auto i = 0u; i < elements.size(); i += 1) {
+            Element::encode(elements[i], &buf[offset + i * Element::bytes]);
+        }
+        return true;
+    }
+
+    static auto decode(const ConstBuffer buf, auto& obj) -> bool {
+        const auto data_size = buf[size_offset];
+        ensure(data_size % Element::bytes == 0, "data size ", int(data_size), " is not a multiple of ", Element::bytes);
+        ensure(offset + data_size <= packet_size, "data size ", int(data_size), " exceeds the packet");
+        auto& elements = obj.*member;
+        elements.resize(data_size / Element::bytes);
+        for(auto i = 0u; i < elements.size(); i += 1) {
+            elements[i] = Element::decode(&buf[offset + i * Element::bytes]);
+        }
+        return true;
+    }
+};
+
+// func_type of macros also carries the repeat mode
+template <size_t type_offset, size_t count_offset>
+struct Repeat : Field<type_offset, count_offset + 1> {
+    static_assert(type_offset + 1 == count_offset);
+
+    static auto matches(const ConstBuffer buf) -> bool {
+        return buf[type_offset] >= KeyFunctionType::CountMacro && buf[type_offset] <= KeyFunctionType::ToggleMacro;
+    }
+
+    static auto encode(const func::MacroKeyFunction& obj, const Buffer buf) -> bool {
+        switch(obj.repeat) {
+        case func::MacroRepeat::Count:
+            buf[type_offset]  = KeyFunctionType::CountMacro;
+            buf[count_offset] = obj.repeat_count;
+            return true;
+        case func::MacroRepeat::Hold:
+            buf[type_offset]  = KeyFunctionType::HoldMacro;
+            buf[count_offset] = 0;
+            return true;
+        case func::MacroRepeat::Toggle:
+            buf[type_offset]  = KeyFunctionType::ToggleMacro;
+            buf[count_offset] = 0;
+            return true;
+        }
+        bail("invalid repeat mode");
+    }
+
+    static auto decode(const ConstBuffer buf, func::MacroKeyFunction& obj) -> bool {
+        switch(buf[type_offset]) {
+        case KeyFunctionType::CountMacro:
+            obj.repeat       = func::MacroRepeat::Count;
+            obj.repeat_count = buf[count_offset];
+            return true;
+        case KeyFunctionType::HoldMacro:
+            obj.repeat = func::MacroRepeat::Hold;
+            return true;
+        case KeyFunctionType::ToggleMacro:
+            obj.repeat = func::MacroRepeat::Toggle;
+            return true;
+        }
+        bail("invalid repeat mode");
+    }
+};
+
+template <class Object, class... Fields>
+struct Layout {
+    // fields must be listed in order and must not overlap
+    static constexpr auto is_ordered() -> bool {
+        const auto begins = std::array{Fields::begin...};
+        const auto ends   = std::array{Fields::end...};
+        for(auto i = 1u; i < begins.size(); i += 1) {
+            if(ends[i - 1] > begins[i]) {
+                return false;
+            }
+        }
+        return begins[0] >= payload_offset && ends.back() <= packet_size;
+    }
+    static_assert(is_ordered(), "fields overlap or exceed the packet");
+
+    static constexpr auto fixed_size = std::max({Fields::end...});
+
+    static auto matches(const ConstBuffer buf) -> bool {
+        return (Fields::matches(buf) && ...);
+    }
+
+    static auto size(const ConstBuffer buf) -> size_t {
+        return std::max({Fields::size(buf)...});
+    }
+
+    static auto encode(const Object& obj, const Buffer buf) -> bool {
+        return (Fields::encode(obj, buf) && ...);
+    }
+
+    static auto decode(const ConstBuffer buf, Object& obj) -> bool {
+        return (Fields::decode(buf, obj) && ...);
+    }
+};
+
+// packet offsets: 0 unknown1, 1 type, 2 layer, 3 pos, 4 func_type
+using KeysLayout = Layout<func::KeysFunction,
+                          Tag<4, KeyFunctionType::Keys>,
+                          Array<5, 6, &func::KeysFunction::keycodes, Keycode>>;
+
+using EmulateLayout = Layout<func::EmulateKeyFunction,
+                             Tag<4, KeyFunctionType::Emulate>,
+                             BE16<5, &func::EmulateKeyFunction::delay>,
+                             Array<7, 8, &func::EmulateKeyFunction::keycodes, Keycode>>;
+
+// macros share the header and continue with one of the sequence layouts
+using MacroLayout = Layout<func::MacroKeyFunction,
+                           Repeat<4, 5>>;
+
+using AutoDelayMacroLayout = Layout<func::AutoDelayMacroSequence,
+                                    Tag<6, 0>, // use_recorded_delay
+                                    BE16<7, &func::AutoDelayMacroSequence::delay>,
+                                    Constant<9, 0>, // unknown
+                                    Array<10, 11, &func::AutoDelayMacroSequence::keycodes, Keycode>>;
+
+using RecordedDelayMacroLayout = Layout<func::RecordedDelayMacroSequence,
+                                        Tag<6, 1>,      // use_recorded_delay
+                                        Constant<7, 0>, // auto delay
+                                        Constant<8, 0>,
+                                        Constant<9, 0>, // unknown
+                                        Array<10, 11, &func::RecordedDelayMacroSequence::events, Event>>;
+
+static_assert(KeysLayout::fixed_size == 6);
+static_assert(EmulateLayout::fixed_size == 8);
+static_assert(MacroLayout::fixed_size == 6);
+static_assert(AutoDelayMacroLayout::fixed_size == 11 && RecordedDelayMacroLayout::fixed_size == 11);
+} // namespace
+
+auto encode_key(const func::KeyFunction& function, const Buffer buf) -> bool {
+    switch(function.get_index()) {
+    case func::KeyFunction::index_of<func::KeysFunction>:
+        return KeysLayout::encode(function.as<func::KeysFunction>(), buf);
+    case func::KeyFunction::index_of<func::EmulateKeyFunction>:
+        return EmulateLayout::encode(function.as<func::EmulateKeyFunction>(), buf);
+    case func::KeyFunction::index_of<func::MacroKeyFunction>: {
+        const auto& macro = function.as<func::MacroKeyFunction>();
+        ensure(MacroLayout::encode(macro, buf));
+        switch(macro.sequence->get_index()) {
+        case func::MacroSequence::index_of<func::AutoDelayMacroSequence>:
+            return AutoDelayMacroLayout::encode(macro.sequence->as<func::AutoDelayMacroSequence>(), buf);
+        case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>:
+            return RecordedDelayMacroLayout::encode(macro.sequence->as<func::RecordedDelayMacroSequence>(), buf);
+        }
+    } break;
+    }
+    bail("invalid key function");
+}
+
+auto decode_key(const ConstBuffer buf) -> std::optional<func::KeyFunction> {
+    auto function = func::KeyFunction();
+    if(KeysLayout::matches(buf)) {
+        ensure(KeysLayout::decode(buf, function.emplace<func::KeysFunction>()));
+    } else if(EmulateLayout::matches(buf)) {
+        ensure(EmulateLayout::decode(buf, function.emplace<func::EmulateKeyFunction>()));
+    } else if(MacroLayout::matches(buf)) {
+        auto& macro = function.emplace<func::MacroKeyFunction>();
+        ensure(MacroLayout::decode(buf, macro));
+        auto sequence = std::make_shared<func::MacroSequence>();
+        if(AutoDelayMacroLayout::matches(buf)) {
+            ensure(AutoDelayMacroLayout::decode(buf, sequence->emplace<func::AutoDelayMacroSequence>()));
+        } else if(RecordedDelayMacroLayout::matches(buf)) {
+            ensure(RecordedDelayMacroLayout::decode(buf, sequence->emplace<func::RecordedDelayMacroSequence>()));
+        } else {
+            bail("unknown macro type ", int(buf[6]));
+        }
+        macro.sequence = std::move(sequence);
+    } else {
+        bail("unknown function type ", int(buf[payload_offset]));
+    }
+    return function;
+}
+
+auto get_payload_size(const ConstBuffer buf) -> std::optional<size_t> {
+    auto size = size_t(0);
+    if(KeysLayout::matches(buf)) {
+        size = KeysLayout::size(buf);
+        if(size == KeysLayout::fixed_size) {
+            return 0;
+        }
+    } else if(EmulateLayout::matches(buf)) {
+        size = EmulateLayout::size(buf);
+    } else if(MacroLayout::matches(buf) && AutoDelayMacroLayout::matches(buf)) {
+        size = AutoDelayMacroLayout::size(buf);
+    } else if(MacroLayout::matches(buf) && RecordedDelayMacroLayout::matches(buf)) {
+        size = RecordedDelayMacroLayout::size(buf);
+    } else {
+        bail("unknown function type ", int(buf[payload_offset]));
+    }
+    ensure(size <= packet_size, "data size exceeds the packet");
+    return size - payload_offset;
+}
+
+auto get_sequence_size(const func::MacroSequence& sequence) -> size_t {
+    switch(sequence.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>:
+        return AutoDelayMacroLayout::fixed_size - payload_offset + sequence.as<func::AutoDelayMacroSequence>().keycodes.size() * Keycode::bytes;
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>:
+        return RecordedDelayMacroLayout::fixed_size - payload_offset + sequence.as<func::RecordedDelayMacroSequence>().events.size() * Event::bytes;
+    }
+    return 0;
+}
+
+auto get_function_size(const func::KeyFunction& function) -> size_t {
+    switch(function.get_index()) {
+    case func::KeyFunction::index_of<func::KeysFunction>:
+        return KeysLayout::fixed_size - payload_offset + function.as<func::KeysFunction>().keycodes.size() * Keycode::bytes;
+    case func::KeyFunction::index_of<func::EmulateKeyFunction>:
+        return EmulateLayout::fixed_size - payload_offset + function.as<func::EmulateKeyFunction>().keycodes.size() * Keycode::bytes;
+    case func::KeyFunction::index_of<func::MacroKeyFunction>:
+        return get_sequence_size(*function.as<func::MacroKeyFunction>().sequence);
+    }
+    return 0;
+}
+} // namespace niz::codec
@@ -0,0 +1,27 @@
+#pragma once
+#include <optional>
+#include <span>
+
+#include "niz.hpp"
+
+namespace niz::codec {
+// KeyData packets without the report id
+constexpr auto packet_size = size_t(64);
+// unknown1, type, layer and pos come before the function
+constexpr auto payload_offset = size_t(4);
+
+using Buffer      = std::span<uint8_t, packet_size>;
+using ConstBuffer = std::span<const uint8_t, packet_size>;
+
+// writes the function from payload_offset onwards, the rest of buf is left untouched
+// returns false if the function does not fit in a packet
+auto encode_key(const func::KeyFunction& function, Buffer buf) -> bool;
+// returns nullopt for an unknown or malformed function
+auto decode_key(ConstBuffer buf) -> std::optional<func::KeyFunction>;
+// returns the number of bytes from payload_offset which carry the function, 0 for a key without function
+auto get_payload_size(ConstBuffer buf) -> std::optional<size_t>;
+// bytes from payload_offset onwards which a macro running sequence takes, even if it exceeds a packet
+auto get_sequence_size(const func::MacroSequence& sequence) -> size_t;
+// same for any function
+auto get_function_size(const func::KeyFunction& function) -> size_t;
+} // namespace niz::codec
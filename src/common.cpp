@@ -1,37 +1,268 @@
+#include <utility>
+
+#include <poll.h>
 #include <unistd.h>
 
 #include "common.hpp"
 #include "macros/assert.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#if defined(NIZ_IO_URING)
+#include "uring.hpp"
+#endif
 
 namespace niz {
-auto keycodes = std::array<const char*, 256>{
-#include "keycodes.txt"
-};
+namespace {
+auto deadlines = Deadlines();
 
-auto send_packet(const int fd, const int type, const std::span<const uint8_t> data) -> bool {
-    ensure(data.size() < 62);
-    auto  buf    = std::array<uint8_t, 65>();
+auto              message_handler        = MessageHandler();
+thread_local auto thread_message_handler = MessageHandler();
+
+constexpr auto packet_names = [] {
+    auto names                          = std::array<std::string_view, 256>();
+    names[PacketType::ReadSerial]       = "ReadSerial";
+    names[PacketType::Firmware]         = "Firmware";
+    names[PacketType::Keylock]          = "Keylock";
+    names[PacketType::InitialCalibDone] = "InitialCalibDone";
+    names[PacketType::InitialCalib]     = "InitialCalib";
+    names[PacketType::PressCalib]       = "PressCalib";
+    names[PacketType::PressCalibDone]   = "PressCalibDone";
+    names[PacketType::XXXData]          = "XXXData";
+    names[PacketType::ReadXXX]          = "ReadXXX";
+    names[PacketType::ReadCounter]      = "ReadCounter";
+    names[PacketType::XXXEnd]           = "XXXEnd";
+    names[PacketType::KeyData]          = "KeyData";
+    names[PacketType::WriteAll]         = "WriteAll";
+    names[PacketType::ReadAll]          = "ReadAll";
+    names[PacketType::DataEnd]          = "DataEnd";
+    names[PacketType::Version]          = "Version";
+    return names;
+}();
+
+// returns false on timeout or error
+auto wait_fd(const int fd, const short events, const std::chrono::milliseconds timeout) -> bool {
+    const auto end = std::chrono::steady_clock::now() + timeout;
+    while(true) {
+        const auto left = std::chrono::ceil<std::chrono::milliseconds>(end - std::chrono::steady_clock::now());
+        auto       pfd  = pollfd{.fd = fd, .events = events, .revents = 0};
+        const auto ret  = poll(&pfd, 1, std::max<int>(left.count(), 0));
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret < 0) {
+            line_warn("poll: ", strerror(errno));
+        }
+        return ret > 0;
+    }
+}
+
+// records a received report in the trace and the stats
+auto note_received(const int fd, const int request, const std::span<const uint8_t> report) -> void {
+    trace::record(fd, trace::Direction::Received, report);
+    // some responses, such as Version, carry data where the type would be
+    const auto type = report.size() > 1 && !packet_names[report[1]].empty() ? report[1] : request;
+    stats::count_packet(false, type, report.size());
+}
+
+auto read_with_timeout(const int fd, const int type, const std::span<uint8_t> buf, const std::chrono::milliseconds timeout) -> ssize_t {
+    const auto timer = stats::Timer(stats::Operation::Read);
+    const auto end   = std::chrono::steady_clock::now() + timeout;
+    while(true) {
+        const auto left = std::chrono::ceil<std::chrono::milliseconds>(end - std::chrono::steady_clock::now());
+        if(left.count() <= 0 || !wait_fd(fd, POLLIN, left)) {
+            line_warn("no response to ", get_packet_name(type), " within ", timeout.count(), "ms");
+            return -1;
+        }
+        const auto len = ::read(fd, buf.data(), buf.size());
+        if(len > 0) {
+            note_received(fd, type, buf.first(len));
+        }
+        if(len >= 0 || (errno != EAGAIN && errno != EINTR)) {
+            return len;
+        }
+    }
+}
+} // namespace
+
+auto get_packet_name(const int type) -> std::string {
+    const auto name = packet_names[type & 0xff];
+    auto       hex  = std::array<char, 8>();
+    snprintf(hex.data(), hex.size(), "(0x%02x)", type & 0xff);
+    return std::string(name.empty() ? "Unknown" : name) + hex.data();
+}
+
+auto get_deadlines() -> const Deadlines& {
+    return deadlines;
+}
+
+auto set_deadlines(const Deadlines& new_deadlines) -> void {
+    deadlines = new_deadlines;
+}
+
+auto set_message_handler(MessageHandler handler) -> void {
+    message_handler = std::move(handler);
+}
+
+auto set_thread_message_handler(MessageHandler handler) -> MessageHandler {
+    return std::exchange(thread_message_handler, std::move(handler));
+}
+
+auto message(const std::string_view text, const MessageKind kind) -> void {
+    if(thread_message_handler) {
+        thread_message_handler(text, kind);
+    } else if(message_handler) {
+        message_handler(text, kind);
+    }
+}
+
+auto make_report(const int type, const std::span<const uint8_t> data) -> Report {
+    auto  buf    = Report();
     auto& packet = *std::bit_cast<Packet*>(buf.data() + 1);
     packet.type  = type;
-    memcpy(buf.data() + 1 + sizeof(Packet), data.data(), data.size());
-    ensure(write(fd, buf.data(), buf.size()) == buf.size());
+    memcpy(buf.data() + 1 + sizeof(Packet), data.data(), std::min(data.size(), buf.size() - 1 - sizeof(Packet)));
+    return buf;
+}
+
+auto hash_bytes(const std::span<const uint8_t> data, uint64_t hash) -> uint64_t {
+    for(const auto byte : data) {
+        hash = (hash ^ byte) * 1099511628211u;
+    }
+    return hash;
+}
+
+auto hash_bytes(const std::string_view data, const uint64_t hash) -> uint64_t {
+    return hash_bytes(std::span(std::bit_cast<const uint8_t*>(data.data()), data.size()), hash);
+}
+
+auto hash_reports(const std::span<const Report> reports) -> uint64_t {
+    auto hash = hash_seed;
+    for(const auto& report : reports) {
+        hash = hash_bytes(report, hash);
+    }
+    return hash;
+}
+
+auto write_report(const int fd, const std::span<const uint8_t> report) -> bool {
+    // [report id, unknown1, type, ...]
+    const auto type  = report.size() > 2 ? report[2] : 0;
+    const auto timer = stats::Timer(stats::Operation::Write);
+    while(true) {
+        const auto len = write(fd, report.data(), report.size());
+        if(len == ssize_t(report.size())) {
+            trace::record(fd, trace::Direction::Sent, report);
+            stats::count_packet(true, type, report.size());
+            return true;
+        }
+        ensure(len < 0 && (errno == EAGAIN || errno == EINTR), "write of ", get_packet_name(type), " failed: ", len < 0 ? strerror(errno) : "short write");
+        ensure(errno == EINTR || wait_fd(fd, POLLOUT, deadlines.report), "keyboard did not take ", get_packet_name(type), " within ", deadlines.report.count(), "ms");
+    }
+}
+
+auto write_reports(const int fd, std::span<const Report> reports) -> bool {
+#if defined(NIZ_IO_URING)
+    if(uring::available()) {
+        const auto begin   = std::chrono::steady_clock::now();
+        const auto written = uring::write_reports(fd, reports);
+        ensure(written);
+        // reports of a chain complete together, the time of the chain is split evenly
+        const auto latency = *written > 0 ? (std::chrono::steady_clock::now() - begin) / int64_t(*written) : std::chrono::nanoseconds();
+        for(const auto& report : reports.first(*written)) {
+            trace::record(fd, trace::Direction::Sent, report);
+            stats::count_packet(true, report[2], report.size());
+            stats::add_latency(stats::Operation::Write, latency);
+        }
+        // the rest waits for the device with a deadline
+        reports = reports.subspan(*written);
+    }
+#endif
+    for(const auto& report : reports) {
+        ensure(write_report(fd, report));
+    }
     return true;
 }
 
-auto dump_buffer(const std::span<const uint8_t> buf) -> void {
-    for(auto i = 0;; i += 1) {
-        for(auto j = 0; j < 4; j += 1) {
-            for(auto k = 0; k < 4; k += 1) {
-                const auto index = size_t(i * 16 + j * 4 + k);
-                if(index >= buf.size()) {
-                    printf("\n");
-                    return;
-                }
-                printf("%02X", buf[index]);
+auto ReportReader::read(const std::span<uint8_t> buf) -> ssize_t {
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(session_end - std::chrono::steady_clock::now());
+    if(left.count() <= 0) {
+        line_warn("response to ", get_packet_name(type), " did not end in time");
+        return -1;
+    }
+    const auto timeout = std::min(report_timeout, left);
+#if defined(NIZ_IO_URING)
+    if(stream != nullptr) {
+        const auto timer = stats::Timer(stats::Operation::Read);
+        if(const auto len = uring::read_stream(stream, buf, timeout.count()); len != 0) {
+            if(len > 0) {
+                note_received(fd, type, buf.first(len));
             }
-            printf(" ");
+            if(len < 0 && errno == ETIMEDOUT) {
+                line_warn("no response to ", get_packet_name(type), " within ", timeout.count(), "ms");
+            }
+            return len;
+        }
+        uring::close_stream(std::exchange(stream, nullptr));
+    }
+#endif
+    return read_with_timeout(fd, type, buf, timeout);
+}
+
+ReportReader::ReportReader(const int fd, const int type, const Deadlines& deadlines)
+    : fd(fd),
+      type(type),
+      report_timeout(deadlines.report),
+      session_end(std::chrono::steady_clock::now() + deadlines.session) {
+#if defined(NIZ_IO_URING)
+    stream = uring::open_stream(fd);
+#endif
+}
+
+ReportReader::~ReportReader() {
+#if defined(NIZ_IO_URING)
+    if(stream != nullptr) {
+        uring::close_stream(stream);
+    }
+#endif
+}
+
+auto read_report(const int fd, const int type, const std::span<uint8_t> buf, const Deadlines& deadlines) -> ssize_t {
+    return read_with_timeout(fd, type, buf, std::min(deadlines.report, deadlines.session));
+}
+
+auto prepare_retry(const int fd, const int type, const int attempt) -> bool {
+    const auto last = attempt >= deadlines.retries;
+    if(!last) {
+        message(build_string("retrying ", get_packet_name(type), ", attempt ", attempt + 2, " of ", deadlines.retries + 1));
+    }
+    // late reports of the failed attempt must not be taken as the response to the next request, even after the last attempt
+    const auto quiet = std::min(deadlines.report, std::chrono::milliseconds(50));
+    auto       buf   = std::array<uint8_t, 64>();
+    while(wait_fd(fd, POLLIN, quiet)) {
+        const auto len = ::read(fd, buf.data(), buf.size());
+        if(len <= 0) {
+            break;
+        }
+        note_received(fd, type, std::span(buf).first(len));
+    }
+    return !last;
+}
+
+auto send_packet(const int fd, const int type, const std::span<const uint8_t> data) -> bool {
+    ensure(data.size() < 62);
+    ensure(write_report(fd, make_report(type, data)));
+    return true;
+}
+
+auto format_buffer(const std::span<const uint8_t> buf) -> std::string {
+    auto text = std::string();
+    auto hex  = std::array<char, 3>();
+    for(auto i = 0u; i < buf.size(); i += 1) {
+        if(i != 0) {
+            text += i % 16 == 0 ? "\n" : i % 4 == 0 ? " " : "";
         }
-        printf("\n");
+        snprintf(hex.data(), hex.size(), "%02X", buf[i]);
+        text += hex.data();
     }
+    return text;
 }
 } // namespace niz
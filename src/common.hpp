@@ -1,8 +1,14 @@
 #pragma once
 #include <array>
+#include <chrono>
+#include <functional>
 #include <span>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include <sys/types.h>
+
 namespace niz {
 struct PacketType {
     enum : uint8_t {
@@ -25,12 +31,21 @@ struct PacketType {
     };
 };
 
+// returns the name of a packet type for messages, e.g. "ReadAll(0xf2)"
+auto get_packet_name(int type) -> std::string;
+
 struct Packet {
     uint8_t unknown1;
     uint8_t type;
 } __attribute__((packed));
 
-extern std::array<const char*, 256> keycodes;
+// names are null-terminated
+constexpr auto keycodes = std::array<std::string_view, 256>{
+#include "keycodes.txt"
+};
+
+// names of the layers in keymap files, indexed by layer
+constexpr auto layer_names = std::array<std::string_view, 3>{"normal", "rightfn", "leftfn"};
 
 template <class T>
 auto may_enlarge(std::vector<T>& vec, const size_t index) -> T& {
@@ -40,6 +55,88 @@ auto may_enlarge(std::vector<T>& vec, const size_t index) -> T& {
     return vec[index];
 }
 
+// output report with the leading report id
+using Report = std::array<uint8_t, 65>;
+
+namespace uring {
+struct Stream;
+}
+
+// limits of waiting for the keyboard, so that a board which stops answering does not hang the tool
+// fds may be non-blocking, every wait goes through poll
+struct Deadlines {
+    std::chrono::milliseconds report      = std::chrono::seconds(1);  // for each report to arrive or be taken
+    std::chrono::milliseconds session     = std::chrono::seconds(10); // for a whole response
+    std::chrono::milliseconds calibration = std::chrono::minutes(10); // calibration waits for the user
+    int                       retries     = 2;                        // repeats of requests which are safe to repeat
+};
+
+// deadlines are process wide, set them before any device is opened
+auto get_deadlines() -> const Deadlines&;
+auto set_deadlines(const Deadlines& deadlines) -> void;
+
+// progress and status messages, such as retries and firmware progress, the library prints nothing by itself
+// a handler which is set for the calling thread takes the messages of that thread instead of the process wide one
+// the process wide handler is like the deadlines, set it before any device is opened
+// progress messages repeat while an operation runs, each one replaces the previous one
+enum class MessageKind {
+    Status,
+    Progress,
+};
+using MessageHandler = std::function<void(std::string_view message, MessageKind kind)>;
+auto set_message_handler(MessageHandler handler) -> void;
+// returns the previous handler of the thread, an empty handler falls back to the process wide one
+auto set_thread_message_handler(MessageHandler handler) -> MessageHandler;
+auto message(std::string_view text, MessageKind kind = MessageKind::Status) -> void;
+
+// fnv-1a, pass the result as hash to continue with more data
+constexpr auto hash_seed = uint64_t(14695981039346656037u);
+auto hash_bytes(std::span<const uint8_t> data, uint64_t hash = hash_seed) -> uint64_t;
+auto hash_bytes(std::string_view data, uint64_t hash = hash_seed) -> uint64_t;
+
+auto make_report(int type, std::span<const uint8_t> data = {}) -> Report;
+// hash_bytes of a report stream, identifies a keymap by what is sent to the keyboard
+auto hash_reports(std::span<const Report> reports) -> uint64_t;
+auto write_report(int fd, std::span<const uint8_t> report) -> bool;
+// writes reports in order, batched when built with the io_uring transport
+auto write_reports(int fd, std::span<const Report> reports) -> bool;
+
+// reads a stream of input reports, such as the response to ReadAll
+// read fails with a message naming type if a report or the whole response is late
+struct ReportReader {
+    int                                   fd;
+    int                                   type; // request which is answered
+    std::chrono::milliseconds             report_timeout;
+    std::chrono::steady_clock::time_point session_end;
+    uring::Stream*                        stream = nullptr;
+
+    auto read(std::span<uint8_t> buf) -> ssize_t;
+
+    ReportReader(int fd, int type, const Deadlines& deadlines = get_deadlines());
+    ReportReader(const ReportReader&) = delete;
+    ~ReportReader();
+};
+
+// reads a single report of the response to type
+auto read_report(int fd, int type, std::span<uint8_t> buf, const Deadlines& deadlines = get_deadlines()) -> ssize_t;
+// drops input which arrived for attempt, returns false if it was the last one
+auto prepare_retry(int fd, int type, int attempt) -> bool;
+
+// runs request, and repeats it after a failure up to get_deadlines().retries times
+// only for requests which do not change the keyboard
+template <class Func>
+auto retry(const int fd, const int type, const Func request) -> decltype(request()) {
+    for(auto attempt = 0;; attempt += 1) {
+        if(auto result = request()) {
+            return result;
+        }
+        if(!prepare_retry(fd, type, attempt)) {
+            return {};
+        }
+    }
+}
+
 auto send_packet(int fd, int type, std::span<const uint8_t> data) -> bool;
-auto dump_buffer(std::span<const uint8_t> buf) -> void;
+// hex dump with a space every 4 bytes and a line every 16
+auto format_buffer(std::span<const uint8_t> buf) -> std::string;
 } // namespace niz
@@ -1,217 +1,812 @@
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/uio.h>
+
+#include "codec.hpp"
 #include "common.hpp"
+#include "layout.hpp"
+#include "macro.hpp"
 #include "macros/unwrap.hpp"
+#include "name-table.hpp"
 #include "niz.hpp"
+#include "stats.hpp"
 #include "util/charconv.hpp"
+#include "util/file-io.hpp"
 #include "util/print.hpp"
-#include "util/split.hpp"
 
 namespace niz {
-const auto layer_str = std::array{"normal", "rightfn", "leftfn"};
+namespace {
+constexpr auto layer_table   = NameTable<layer_names.size(), 8>(layer_names);
+constexpr auto keycode_table = NameTable<keycodes.size(), 512>(keycodes);
+
+static_assert(layer_table.find("leftfn") == 2);
+static_assert(keycode_table.find("Esc") == 1);
+static_assert(keycode_table.find("unknown") == 178);
+static_assert(!keycode_table.find("NoSuchKey"));
+} // namespace
+
+namespace {
+// splits the input into tokens without copying, one line at a time
+struct Tokenizer {
+    std::string_view str;
+    size_t           pos        = 0;
+    size_t           line_begin = 0;
+    size_t           line       = 0; // 1-based number of the current line
+    size_t           column     = 0; // 1-based column of the last token, or of the line end
+
+    static constexpr auto is_blank(const char c) -> bool {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    // moves to the next line, returns false at the end of the input
+    auto next_line() -> bool {
+        if(line != 0) {
+            pos = str.find('\n', pos);
+            pos = pos == str.npos ? str.size() : pos + 1;
+        }
+        if(pos >= str.size()) {
+            return false;
+        }
+        line += 1;
+        line_begin = pos;
+        column     = 1;
+        return true;
+    }
 
-auto find_layer_by_str(std::string_view str) -> std::optional<uint8_t> {
-    for(auto i = 0u; i < layer_str.size(); i += 1) {
-        if(layer_str[i] == str) {
-            return i;
+    // returns nullopt at the end of the current line
+    auto next() -> std::optional<std::string_view> {
+        while(pos < str.size() && is_blank(str[pos])) {
+            pos += 1;
+        }
+        column = pos - line_begin + 1;
+        if(pos >= str.size() || str[pos] == '\n') {
+            return std::nullopt;
+        }
+        const auto begin = pos;
+        while(pos < str.size() && str[pos] != '\n' && !is_blank(str[pos])) {
+            pos += 1;
         }
+        return str.substr(begin, pos - begin);
+    }
+};
+
+// ensure which points at the offending token instead of the source location
+// collected instead of printed when the parser has diagnostics
+#define parse_ensure(cond, ...)                                                                    \
+    if(!(cond)) {                                                                                  \
+        if(diagnostics != nullptr) {                                                               \
+            diagnostics->push_back({tokens.line, tokens.column, true, build_string(__VA_ARGS__)}); \
+        } else {                                                                                   \
+            line_warn("line ", tokens.line, " column ", tokens.column, ": ", __VA_ARGS__);         \
+        }                                                                                          \
+        return {};                                                                                 \
+    }
+
+// what a file gives to the files which include it, shared through the parse cache
+struct Parsed {
+    // inheritance is not resolved yet, so that the includers can still change the parent layers
+    KeyMap                                                                      map;
+    std::unordered_map<std::string, std::shared_ptr<const func::MacroSequence>> macros;
+    std::array<std::optional<uint8_t>, 3>                                       parents;
+};
+
+} // namespace
+
+struct ParseCache::Entries {
+    std::mutex mutex;
+    // by canonical path, the files do not change while the cache is alive
+    std::unordered_map<std::string, std::shared_ptr<const Parsed>> parsed;
+
+    auto find(const std::filesystem::path& path) -> std::shared_ptr<const Parsed> {
+        const auto lock  = std::lock_guard(mutex);
+        const auto found = parsed.find(path.native());
+        return found != parsed.end() ? found->second : nullptr;
+    }
+
+    // another thread may have parsed the same file meanwhile, the first one is kept
+    auto insert(const std::filesystem::path& path, std::shared_ptr<const Parsed> entry) -> std::shared_ptr<const Parsed> {
+        const auto lock = std::lock_guard(mutex);
+        return parsed.try_emplace(path.native(), std::move(entry)).first->second;
     }
-    bail("invalid layer ", str);
+};
+
+ParseCache::ParseCache() : entries(std::make_unique<Entries>()) {}
+
+ParseCache::~ParseCache() = default;
+
+namespace {
+// an empty key is sent as no key at all, so it counts as unbound
+auto is_bound(const func::KeyFunction& function) -> bool {
+    return function.get_index() != func::KeyFunction::index_of<func::KeysFunction> || !function.as<func::KeysFunction>().keycodes.empty();
 }
 
-auto find_keycode_by_str(std::string_view str) -> std::optional<uint8_t> {
-    for(auto i = 0u; i < keycodes.size(); i += 1) {
-        if(keycodes[i] == str) {
-            return i;
+constexpr auto max_include_depth = size_t(16);
+
+auto load_parsed(ParseCache& cache, const std::filesystem::path& path, std::string_view text, std::vector<std::filesystem::path> stack, std::vector<Diagnostic>* diagnostics) -> std::shared_ptr<const Parsed>;
+
+struct Parser {
+    Tokenizer tokens;
+    KeyMap    map;
+    // macro bodies are shared by every key which runs them
+    std::unordered_map<std::string_view, std::shared_ptr<const func::MacroSequence>> macros;
+    // set by the batch checker, which also wants the warnings
+    std::vector<Diagnostic>* diagnostics = nullptr;
+    // line which bound each key, 0 if it is unbound, only kept with diagnostics
+    std::array<std::vector<size_t>, 3> bound_lines;
+    // includes are relative to dir, stack holds the files being parsed to catch include cycles
+    std::filesystem::path              dir;
+    std::vector<std::filesystem::path> stack;
+    // given by the caller for a batch, otherwise created at the first include
+    ParseCache*                 cache = nullptr;
+    std::unique_ptr<ParseCache> own_cache;
+    // layer which each layer takes the keys it does not bind from
+    std::array<std::optional<uint8_t>, 3> parents;
+    // keeps the macro names of the included files alive
+    std::vector<std::shared_ptr<const Parsed>> includes;
+
+    auto read_token(const char* const what) -> std::optional<std::string_view> {
+        const auto token = tokens.next();
+        parse_ensure(token, "missing ", what);
+        return token;
+    }
+
+    template <class T>
+    auto read_number(const char* const what) -> std::optional<T> {
+        unwrap(token, read_token(what));
+        const auto number = from_chars<T>(token);
+        parse_ensure(number, "invalid ", what, " ", token);
+        return number;
+    }
+
+    auto read_layer() -> std::optional<uint8_t> {
+        unwrap(token, read_token("layer"));
+        const auto layer = layer_table.find(token);
+        parse_ensure(layer, "invalid layer ", token);
+        return layer;
+    }
+
+    auto read_keycode(const std::string_view token) -> std::optional<uint8_t> {
+        const auto keycode = keycode_table.find(token);
+        parse_ensure(keycode, "invalid keycode ", token);
+        return keycode;
+    }
+
+    // reads keycodes until the end of the line
+    auto read_keycodes(std::vector<uint8_t>& keycodes) -> bool {
+        while(const auto token = tokens.next()) {
+            unwrap(keycode, read_keycode(*token));
+            keycodes.push_back(keycode);
+        }
+        parse_ensure(!keycodes.empty(), "missing keycode");
+        return true;
+    }
+
+    auto read_end() -> bool {
+        const auto token = tokens.next();
+        parse_ensure(!token, "unexpected token ", *token);
+        return true;
+    }
+
+    auto define_macro(const std::string_view name, std::shared_ptr<const func::MacroSequence> sequence) -> bool {
+        // macros are optimized before they are sent, so only the smallest form has to fit
+        const auto size = codec::get_sequence_size(macro::get_smallest(*sequence));
+        parse_ensure(size <= CompactKeyMap::max_payload_size, "macro ", name, " takes ", size, " bytes, the limit is ", CompactKeyMap::max_payload_size);
+        const auto [it, inserted] = macros.try_emplace(name, std::move(sequence));
+        parse_ensure(inserted, "macro ", name, " is already defined");
+        return true;
+    }
+
+    auto check_size(const func::KeyFunction& function) -> bool {
+        const auto size = codec::get_function_size(function);
+        parse_ensure(size <= CompactKeyMap::max_payload_size, "function takes ", size, " bytes, the limit is ", CompactKeyMap::max_payload_size);
+        return true;
+    }
+
+    auto parse_fixed_macro() -> bool {
+        unwrap(name, read_token("macro name"));
+        unwrap(interval, read_number<uint16_t>("interval"));
+        auto keycodes = std::vector<uint8_t>();
+        ensure(read_keycodes(keycodes));
+        auto sequence = std::make_shared<func::MacroSequence>();
+        sequence->emplace<func::AutoDelayMacroSequence>(interval, std::move(keycodes));
+        return define_macro(name, std::move(sequence));
+    }
+
+    auto parse_record_macro() -> bool {
+        unwrap(name, read_token("macro name"));
+        auto  sequence = std::make_shared<func::MacroSequence>();
+        auto& recorded = sequence->emplace<func::RecordedDelayMacroSequence>();
+        while(const auto token = tokens.next()) {
+            unwrap(keycode, read_keycode(*token));
+            unwrap(interval, read_number<uint16_t>("interval"));
+            recorded.events.push_back({keycode, interval});
+        }
+        parse_ensure(!recorded.events.empty(), "missing event");
+        return define_macro(name, std::move(sequence));
+    }
+
+    // a number, or a name of the layout
+    auto read_position(const uint8_t layer) -> std::optional<uint8_t> {
+        unwrap(token, read_token("position"));
+        auto pos = from_chars<uint8_t>(token);
+        if(!pos && map.layout != nullptr) {
+            pos = map.layout->find_position(token);
+        }
+        parse_ensure(pos, "invalid position ", token);
+        // positions are sent as pos + 1
+        parse_ensure(*pos < CompactKeyMap::max_keys, "position ", int(*pos), " is out of range, the limit is ", CompactKeyMap::max_keys - 1);
+        if(map.layout != nullptr) {
+            parse_ensure(map.layout->layers[layer], map.layout->name, " has no ", layer_names[layer], " layer");
+            parse_ensure(*pos < map.layout->get_key_count(), "position ", int(*pos), " is out of range, ", map.layout->name, " has ", map.layout->get_key_count(), " keys");
+        }
+        return pos;
+    }
+
+    auto read_key() -> std::optional<func::KeyFunction*> {
+        unwrap(layer, read_layer());
+        unwrap(pos, read_position(layer));
+        if(diagnostics != nullptr) {
+            auto& line = may_enlarge(bound_lines[layer], pos);
+            if(line != 0) {
+                diagnostics->push_back({tokens.line, tokens.column, false, build_string(layer_names[layer], " ", int(pos), " is already bound on line ", line)});
+            }
+            line = tokens.line;
+        }
+        return &may_enlarge(map.functions[layer], pos);
+    }
+
+    auto parse_map_keys() -> bool {
+        unwrap(key, read_key());
+        auto keycodes = std::vector<uint8_t>();
+        ensure(read_keycodes(keycodes));
+        key->emplace<func::KeysFunction>(std::move(keycodes));
+        return check_size(*key);
+    }
+
+    auto parse_map_emu() -> bool {
+        unwrap(key, read_key());
+        unwrap(interval, read_number<uint16_t>("interval"));
+        auto keycodes = std::vector<uint8_t>();
+        ensure(read_keycodes(keycodes));
+        key->emplace<func::EmulateKeyFunction>(interval, std::move(keycodes));
+        return check_size(*key);
+    }
+
+    auto parse_map_macro() -> bool {
+        unwrap(key, read_key());
+        unwrap(name, read_token("macro name"));
+        const auto found = macros.find(name);
+        parse_ensure(found != macros.end(), "undefined macro ", name);
+
+        auto macro     = func::MacroKeyFunction();
+        macro.sequence = found->second;
+        unwrap(repeat, read_token("repeat"));
+        if(repeat == "hold") {
+            macro.repeat = func::MacroRepeat::Hold;
+        } else if(repeat == "toggle") {
+            macro.repeat = func::MacroRepeat::Toggle;
+        } else {
+            const auto count = from_chars<uint8_t>(repeat);
+            parse_ensure(count, "invalid repeat ", repeat);
+            macro.repeat       = func::MacroRepeat::Count;
+            macro.repeat_count = *count;
+        }
+        ensure(read_end());
+        key->emplace<func::MacroKeyFunction>(std::move(macro));
+        return true;
+    }
+
+    auto parse_layout() -> bool {
+        unwrap(name, read_token("layout name"));
+        const auto found = layout::find(name);
+        parse_ensure(found != nullptr, "unknown layout ", name);
+        parse_ensure(map.layout == nullptr, "layout is already set");
+        parse_ensure(std::ranges::all_of(map.functions, [](const auto& funcs) { return funcs.empty(); }), "layout must come before the keys");
+        ensure(read_end());
+        map.layout = found;
+        // layers do not grow past the key count
+        for(auto layer = 0u; layer < map.functions.size(); layer += 1) {
+            if(found->layers[layer]) {
+                map.functions[layer].reserve(found->get_key_count());
+            }
+        }
+        return true;
+    }
+
+    auto set_parent(const uint8_t layer, const uint8_t parent) -> bool {
+        // following the parents from parent must not lead back to layer
+        for(auto next = std::optional(parent); next; next = parents[*next]) {
+            parse_ensure(*next != layer, layer_names[layer], " can not inherit from ", layer_names[parent], ", which inherits from it");
+        }
+        parents[layer] = parent;
+        return true;
+    }
+
+    auto parse_inherit() -> bool {
+        unwrap(layer, read_layer());
+        unwrap(parent, read_layer());
+        ensure(read_end());
+        return set_parent(layer, parent);
+    }
+
+    // applies the statements of an included file as if they were written here
+    auto merge(const Parsed& parsed) -> bool {
+        if(parsed.map.layout != nullptr) {
+            parse_ensure(map.layout == nullptr || map.layout == parsed.map.layout, "included layout ", parsed.map.layout->name, " differs from ", map.layout->name);
+            map.layout = parsed.map.layout;
+        }
+        for(const auto& [name, sequence] : parsed.macros) {
+            const auto [it, inserted] = macros.try_emplace(name, sequence);
+            // a file which is included twice defines the same macros again
+            parse_ensure(inserted || it->second == sequence, "macro ", name, " is already defined");
+        }
+        for(auto layer = 0u; layer < map.functions.size(); layer += 1) {
+            const auto& funcs = parsed.map.functions[layer];
+            for(auto pos = 0u; pos < funcs.size(); pos += 1) {
+                if(is_bound(funcs[pos])) {
+                    may_enlarge(map.functions[layer], pos) = funcs[pos];
+                }
+            }
+            if(parsed.parents[layer]) {
+                ensure(set_parent(layer, *parsed.parents[layer]));
+            }
+        }
+        return true;
+    }
+
+    auto parse_include() -> bool {
+        unwrap(name, read_token("file name"));
+        ensure(read_end());
+        parse_ensure(stack.size() < max_include_depth, "includes are nested deeper than ", max_include_depth, " files");
+        auto       error = std::error_code();
+        const auto path  = std::filesystem::weakly_canonical(dir / name, error);
+        parse_ensure(!error, "invalid path ", name);
+        parse_ensure(std::ranges::find(stack, path) == stack.end(), name, " includes itself");
+        if(cache == nullptr) {
+            own_cache = std::make_unique<ParseCache>();
+            cache     = own_cache.get();
+        }
+        auto parsed = cache->entries->find(path);
+        if(parsed != nullptr) {
+            includes.push_back(parsed);
+            return merge(*parsed);
+        }
+        const auto text = read_file(path.c_str());
+        parse_ensure(text, "can not read ", name);
+
+        // errors of the included file are reported at this line
+        auto nested = std::vector<Diagnostic>();
+        parsed      = load_parsed(*cache, path, std::string_view(std::bit_cast<const char*>(text->data()), text->size()), stack, diagnostics != nullptr ? &nested : nullptr);
+        if(diagnostics != nullptr) {
+            for(const auto& diagnostic : nested) {
+                if(diagnostic.error) {
+                    diagnostics->push_back({tokens.line, tokens.column, true, build_string(name, ":", diagnostic.line, ":", diagnostic.column, ": ", diagnostic.message)});
+                }
+            }
         }
+        parse_ensure(parsed != nullptr, "can not include ", name);
+        includes.push_back(parsed);
+        return merge(*parsed);
     }
-    bail("invalid keycode ", str);
+
+    // fills the keys which a layer does not bind from its parent, after the parent got its own
+    auto resolve_inheritance() -> void {
+        auto done    = std::array<bool, 3>();
+        auto resolve = [this, &done](auto& self, const uint8_t layer) -> void {
+            if(std::exchange(done[layer], true) || !parents[layer]) {
+                return;
+            }
+            self(self, *parents[layer]);
+            const auto& from  = map.functions[*parents[layer]];
+            auto&       funcs = map.functions[layer];
+            for(auto pos = 0u; pos < from.size(); pos += 1) {
+                if(is_bound(from[pos]) && (pos >= funcs.size() || !is_bound(funcs[pos]))) {
+                    may_enlarge(funcs, pos) = from[pos];
+                }
+            }
+        };
+        for(auto layer = uint8_t(0); layer < map.functions.size(); layer += 1) {
+            resolve(resolve, layer);
+        }
+    }
+
+    auto to_parsed() -> Parsed {
+        auto parsed    = Parsed();
+        parsed.map     = std::move(map);
+        parsed.parents = parents;
+        for(const auto& [name, sequence] : macros) {
+            parsed.macros.emplace(name, sequence);
+        }
+        return parsed;
+    }
+
+    auto parse_line() -> bool {
+        const auto statement = tokens.next();
+        if(!statement || statement->starts_with('#')) {
+            return true;
+        }
+        if(*statement == "layout") {
+            return parse_layout();
+        } else if(*statement == "include") {
+            return parse_include();
+        } else if(*statement == "inherit") {
+            return parse_inherit();
+        } else if(*statement == "fixed-macro") {
+            return parse_fixed_macro();
+        } else if(*statement == "record-macro") {
+            return parse_record_macro();
+        } else if(*statement == "map-keys") {
+            return parse_map_keys();
+        } else if(*statement == "map-emu") {
+            return parse_map_emu();
+        } else if(*statement == "map-macro") {
+            return parse_map_macro();
+        } else {
+            parse_ensure(false, "unknown statement ", *statement);
+        }
+    }
+};
+
+#undef parse_ensure
+
+auto load_parsed(ParseCache& cache, const std::filesystem::path& path, const std::string_view text, std::vector<std::filesystem::path> stack, std::vector<Diagnostic>* const diagnostics) -> std::shared_ptr<const Parsed> {
+    auto parser        = Parser();
+    parser.tokens.str  = text;
+    parser.diagnostics = diagnostics;
+    parser.dir         = path.parent_path();
+    parser.stack       = std::move(stack);
+    parser.cache       = &cache;
+    parser.stack.push_back(path);
+    auto ok = true;
+    while(ok && parser.tokens.next_line()) {
+        ok = parser.parse_line();
+    }
+    if(!ok) {
+        return nullptr;
+    }
+    return cache.entries->insert(path, std::make_shared<const Parsed>(parser.to_parsed()));
+}
+
+auto make_parser(const std::string_view str, const char* const path, ParseCache* const cache = nullptr) -> Parser {
+    auto parser       = Parser();
+    parser.tokens.str = str;
+    parser.cache      = cache;
+    if(path != nullptr) {
+        auto error  = std::error_code();
+        parser.dir  = std::filesystem::path(path).parent_path();
+        parser.stack.push_back(std::filesystem::weakly_canonical(path, error));
+    }
+    return parser;
 }
+} // namespace
 
 namespace {
-struct FixedMacro {
-    std::string_view     name;
-    uint16_t             interval;
-    std::vector<uint8_t> keycodes;
+// collects text into fixed chunks and hands them to writev when all are full
+struct FdSink {
+    static constexpr auto chunk_size   = size_t(4096);
+    static constexpr auto chunks_count = size_t(8);
+
+    int                                                    fd;
+    std::array<std::array<char, chunk_size>, chunks_count> chunks;
+    size_t                                                 chunk = 0;
+    size_t                                                 used  = 0;
+    bool                                                   ok    = true;
+
+    auto flush() -> bool {
+        auto iovs  = std::array<iovec, chunks_count>();
+        auto count = 0;
+        for(auto i = 0u; i < chunk; i += 1) {
+            iovs[count++] = iovec{chunks[i].data(), chunk_size};
+        }
+        if(used > 0) {
+            iovs[count++] = iovec{chunks[chunk].data(), used};
+        }
+        chunk = 0;
+        used  = 0;
+        for(auto iov = iovs.data(); count > 0;) {
+            auto written = writev(fd, iov, count);
+            if(written < 0 && errno == EINTR) {
+                continue;
+            }
+            ensure(written >= 0, "writev: ", strerror(errno));
+            // skip what was written, the last one may be partial
+            while(count > 0 && size_t(written) >= iov->iov_len) {
+                written -= iov->iov_len;
+                iov += 1;
+                count -= 1;
+            }
+            if(count > 0) {
+                iov->iov_base = std::bit_cast<char*>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+    auto append(std::string_view str) -> void {
+        while(!str.empty()) {
+            const auto len = std::min(chunk_size - used, str.size());
+            memcpy(chunks[chunk].data() + used, str.data(), len);
+            used += len;
+            str.remove_prefix(len);
+            if(used == chunk_size) {
+                chunk += 1;
+                used = 0;
+                if(chunk == chunks_count) {
+                    ok &= flush();
+                }
+            }
+        }
+    }
+};
+
+// copies as much as fits, size keeps counting past the end
+struct BufferSink {
+    std::span<char> buf;
+    size_t          size = 0;
+
+    auto append(const std::string_view str) -> void {
+        if(size < buf.size()) {
+            memcpy(buf.data() + size, str.data(), std::min(str.size(), buf.size() - size));
+        }
+        size += str.size();
+    }
 };
 
-auto parse_fixed_macro(const std::span<const std::string_view> elms) -> std::optional<FixedMacro> {
-    ensure(elms.size() >= 3);
-    const auto name = elms[1];
-    unwrap(interval, from_chars<uint16_t>(elms[2]));
-    auto keycodes = std::vector<uint8_t>();
-    for(auto i = 3u; i < elms.size(); i += 1) {
-        unwrap(keycode, find_keycode_by_str(elms[i]));
-        keycodes.emplace_back(keycode);
+template <class Sink>
+auto append_number(Sink& sink, const unsigned number) -> void {
+    auto buf      = std::array<char, 16>();
+    const auto rc = std::to_chars(buf.data(), buf.data() + buf.size(), number);
+    sink.append(std::string_view(buf.data(), rc.ptr));
+}
+
+template <class Sink>
+auto append_keycodes(Sink& sink, const std::span<const uint8_t> codes) -> void {
+    for(const auto keycode : codes) {
+        sink.append(" ");
+        sink.append(keycodes[keycode]);
+    }
+}
+
+template <class Sink>
+auto append_key(Sink& sink, const std::string_view statement, const int layer, const unsigned pos, const layout::Layout* const layout) -> void {
+    sink.append(statement);
+    sink.append(" ");
+    sink.append(layer_names[layer]);
+    sink.append(" ");
+    if(layout != nullptr && pos < layout->get_key_count()) {
+        sink.append(layout->positions[pos]);
+    } else {
+        append_number(sink, pos);
     }
-    return FixedMacro{name, interval, std::move(keycodes)};
 }
 
-struct RecordMacro {
-    std::string_view                                     name;
-    std::vector<func::RecordedDelayMacroSequence::Event> events;
+auto hash_sequence(const func::MacroSequence& sequence) -> size_t {
+    // hash_bytes over the fields
+    auto hash = hash_seed;
+    auto feed = [&hash](const unsigned value) {
+        hash = hash_bytes(std::bit_cast<std::array<uint8_t, sizeof(value)>>(value), hash);
+    };
+    feed(sequence.get_index());
+    switch(sequence.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
+        const auto& fixed = sequence.as<func::AutoDelayMacroSequence>();
+        feed(fixed.delay);
+        hash = hash_bytes(fixed.keycodes, hash);
+    } break;
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
+        for(const auto& event : sequence.as<func::RecordedDelayMacroSequence>().events) {
+            feed(event.keycode);
+            feed(event.delay);
+        }
+    } break;
+    }
+    return hash;
+}
+
+auto equal_sequence(const func::MacroSequence& a, const func::MacroSequence& b) -> bool {
+    if(a.get_index() != b.get_index()) {
+        return false;
+    }
+    switch(a.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
+        const auto& fa = a.as<func::AutoDelayMacroSequence>();
+        const auto& fb = b.as<func::AutoDelayMacroSequence>();
+        return fa.delay == fb.delay && fa.keycodes == fb.keycodes;
+    }
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
+        const auto& ea = a.as<func::RecordedDelayMacroSequence>().events;
+        const auto& eb = b.as<func::RecordedDelayMacroSequence>().events;
+        return std::equal(ea.begin(), ea.end(), eb.begin(), eb.end(), [](const auto& x, const auto& y) {
+            return x.keycode == y.keycode && x.delay == y.delay;
+        });
+    }
+    }
+    return false;
+}
+
+// gives identical macro sequences the same number, so that each is defined once
+struct MacroNumbers {
+    // sequence hash -> (sequence, number)
+    std::unordered_multimap<size_t, std::pair<const func::MacroSequence*, unsigned>> numbers;
+
+    // returns the number and whether the sequence is seen for the first time
+    auto find_or_add(const func::MacroSequence& sequence) -> std::pair<unsigned, bool> {
+        const auto hash         = hash_sequence(sequence);
+        const auto [begin, end] = numbers.equal_range(hash);
+        for(auto it = begin; it != end; it = std::next(it)) {
+            if(it->second.first == &sequence || equal_sequence(*it->second.first, sequence)) {
+                return {it->second.second, false};
+            }
+        }
+        const auto number = unsigned(numbers.size() + 1);
+        numbers.emplace(hash, std::pair{&sequence, number});
+        return {number, true};
+    }
 };
 
-auto parse_record_macro(const std::span<const std::string_view> elms) -> std::optional<RecordMacro> {
-    ensure(elms.size() >= 4);
-    const auto name   = elms[1];
-    auto       events = std::vector<func::RecordedDelayMacroSequence::Event>();
-    for(auto i = 2u; i < elms.size(); i += 2) {
-        ensure(i + 1 < elms.size());
-        unwrap(keycode, find_keycode_by_str(elms[i]));
-        unwrap(interval, from_chars<uint16_t>(elms[i + 1]));
-        events.push_back({keycode, interval});
+template <class Sink>
+auto append_macro_definition(Sink& sink, const unsigned number, const func::MacroSequence& sequence) -> void {
+    switch(sequence.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
+        const auto& fixed = sequence.as<func::AutoDelayMacroSequence>();
+        sink.append("fixed-macro macro");
+        append_number(sink, number);
+        sink.append(" ");
+        append_number(sink, fixed.delay);
+        append_keycodes(sink, fixed.keycodes);
+    } break;
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
+        sink.append("record-macro macro");
+        append_number(sink, number);
+        for(const auto& event : sequence.as<func::RecordedDelayMacroSequence>().events) {
+            sink.append(" ");
+            sink.append(keycodes[event.keycode]);
+            sink.append(" ");
+            append_number(sink, event.delay);
+        }
+    } break;
     }
-    return RecordMacro{name, std::move(events)};
+    sink.append("\n");
 }
-} // namespace
 
-auto KeyMap::to_string() const -> std::string {
-    auto str         = std::string();
-    auto macro_count = 0;
+template <class Sink>
+auto serialize(const KeyMap& map, Sink& sink) -> void {
+    auto macros = MacroNumbers();
+    if(map.layout != nullptr) {
+        sink.append("layout ");
+        sink.append(map.layout->name);
+        sink.append("\n");
+    }
     for(auto layer = 0; layer < 3; layer += 1) {
-        auto& funcs = functions[layer];
+        auto& funcs = map.functions[layer];
         for(auto pos = 0u; pos < funcs.size(); pos += 1) {
             switch(funcs[pos].get_index()) {
             case func::KeyFunction::index_of<func::KeysFunction>: {
                 const auto& func = funcs[pos].as<func::KeysFunction>();
 
-                str += build_string("map-keys ", layer_str[layer], " ", pos);
-                for(auto i = 0u; i < func.keycodes.size(); i += 1) {
-                    str += " ";
-                    str += keycodes[func.keycodes[i]];
-                }
-                str += "\n";
+                append_key(sink, "map-keys", layer, pos, map.layout);
+                append_keycodes(sink, func.keycodes);
+                sink.append("\n");
             } break;
             case func::KeyFunction::index_of<func::EmulateKeyFunction>: {
                 const auto& func = funcs[pos].as<func::EmulateKeyFunction>();
 
-                str += build_string("map-emu ", layer_str[layer], " ", pos, " ", func.delay);
-                for(auto i = 0u; i < func.keycodes.size(); i += 1) {
-                    str += " ";
-                    str += keycodes[func.keycodes[i]];
-                }
-                str += "\n";
+                append_key(sink, "map-emu", layer, pos, map.layout);
+                sink.append(" ");
+                append_number(sink, func.delay);
+                append_keycodes(sink, func.keycodes);
+                sink.append("\n");
             } break;
             case func::KeyFunction::index_of<func::MacroKeyFunction>: {
                 const auto& func = funcs[pos].as<func::MacroKeyFunction>();
 
-                auto macro_name = build_string("macro", macro_count += 1);
-                switch(func.sequence.get_index()) {
-                case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
-                    auto& sequence = func.sequence.as<func::AutoDelayMacroSequence>();
-                    str += build_string("fixed-macro ", macro_name, " ", sequence.delay);
-                    for(const auto keycode : sequence.keycodes) {
-                        str += " ";
-                        str += keycodes[keycode];
-                    }
-                    str += "\n";
-                } break;
-                case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
-                    auto& sequence = func.sequence.as<func::RecordedDelayMacroSequence>();
-                    str += build_string("record-macro ", macro_name);
-                    for(auto i = 0u; i < sequence.events.size(); i += 1) {
-                        str += " ";
-                        str += keycodes[sequence.events[i].keycode];
-                        str += " ";
-                        str += std::to_string(sequence.events[i].delay);
-                    }
-                    str += "\n";
-                } break;
+                const auto [number, is_new] = macros.find_or_add(*func.sequence);
+                if(is_new) {
+                    append_macro_definition(sink, number, *func.sequence);
                 }
 
-                str += build_string("map-macro ", layer_str[layer], " ", pos, " ", macro_name, " ");
+                append_key(sink, "map-macro", layer, pos, map.layout);
+                sink.append(" macro");
+                append_number(sink, number);
+                sink.append(" ");
                 switch(func.repeat) {
                 case func::MacroRepeat::Count:
-                    str += std::to_string(func.repeat_count);
+                    append_number(sink, func.repeat_count);
                     break;
                 case func::MacroRepeat::Hold:
-                    str += "hold";
+                    sink.append("hold");
                     break;
                 case func::MacroRepeat::Toggle:
-                    str += "toggle";
+                    sink.append("toggle");
                     break;
                 }
-                str += "\n";
+                sink.append("\n");
             } break;
             }
         }
     }
+}
+} // namespace
 
+auto KeyMap::set_layout_for(const std::string_view version) -> void {
+    const auto found = layout::find_by_version(version);
+    if(found == nullptr) {
+        return;
+    }
+    for(auto layer = 0u; layer < functions.size(); layer += 1) {
+        const auto keys = found->layers[layer] ? found->get_key_count() : 0;
+        if(functions[layer].size() > keys) {
+            message(build_string("the keyboard has keys which ", found->name, " does not, the keymap is written without layout"));
+            return;
+        }
+    }
+    layout = found;
+}
+
+auto KeyMap::to_string() const -> std::string {
+    const auto timer = stats::Timer(stats::Operation::Serialize);
+    auto       str   = std::string(serialize({}), '\0');
+    serialize(str);
     return str;
 }
 
+auto KeyMap::serialize(const std::span<char> buf) const -> size_t {
+    auto sink = BufferSink{buf};
+    niz::serialize(*this, sink);
+    return sink.size;
+}
+
+auto KeyMap::write_to_file(const int fd) const -> bool {
+    const auto timer = stats::Timer(stats::Operation::Serialize);
+    // chunks are too large for the stack
+    auto sink = std::make_unique<FdSink>();
+    sink->fd  = fd;
+    niz::serialize(*this, *sink);
+    ensure(sink->ok);
+    ensure(sink->flush());
+    return true;
+}
+
 auto KeyMap::from_string(const std::string_view str) -> std::optional<KeyMap> {
-    auto map           = KeyMap();
-    auto fixed_macros  = std::vector<FixedMacro>();
-    auto record_macros = std::vector<RecordMacro>();
-    for(auto& line : split(str, "\n")) {
-        if(line.empty() || line[0] == '#') {
-            continue;
-        }
-
-        const auto elms = split(line, " ");
-        if(elms[0] == "fixed-macro") {
-            unwrap_mut(macro, parse_fixed_macro(elms));
-            fixed_macros.emplace_back(std::move(macro));
-        } else if(elms[0] == "record-macro") {
-            unwrap_mut(macro, parse_record_macro(elms));
-            record_macros.emplace_back(std::move(macro));
-        } else if(elms[0] == "map-keys") {
-            ensure(elms.size() >= 4);
-            unwrap(layer, find_layer_by_str(elms[1]));
-            unwrap(pos, from_chars<uint8_t>(elms[2]));
-            auto keycodes = std::vector<uint8_t>();
-            for(auto i = 3u; i < elms.size(); i += 1) {
-                unwrap(keycode, find_keycode_by_str(elms[i]));
-                keycodes.emplace_back(keycode);
-            }
-            may_enlarge(map.functions[layer], pos).emplace<func::KeysFunction>(std::move(keycodes));
-        } else if(elms[0] == "map-emu") {
-            ensure(elms.size() >= 5);
-            unwrap(layer, find_layer_by_str(elms[1]));
-            unwrap(pos, from_chars<uint8_t>(elms[2]));
-            unwrap(interval, from_chars<uint16_t>(elms[3]));
-            auto keycodes = std::vector<uint8_t>();
-            for(auto i = 4u; i < elms.size(); i += 1) {
-                unwrap(keycode, find_keycode_by_str(elms[i]));
-                keycodes.emplace_back(keycode);
-            }
-            may_enlarge(map.functions[layer], pos).emplace<func::EmulateKeyFunction>(interval, std::move(keycodes));
-        } else if(elms[0] == "map-macro") {
-            ensure(elms.size() == 5);
-            unwrap(layer, find_layer_by_str(elms[1]));
-            unwrap(pos, from_chars<uint8_t>(elms[2]));
-            const auto macro_name = elms[3];
-            auto       macro      = func::MacroKeyFunction();
-            if(elms[4] == "hold") {
-                macro.repeat = func::MacroRepeat::Hold;
-            } else if(elms[4] == "toggle") {
-                macro.repeat = func::MacroRepeat::Toggle;
-            } else {
-                macro.repeat = func::MacroRepeat::Count;
-                unwrap(count, from_chars<uint8_t>(elms[4]));
-                macro.repeat_count = count;
-            }
-            for(const auto& fixed : fixed_macros) {
-                if(fixed.name == macro_name) {
-                    macro.sequence.emplace<func::AutoDelayMacroSequence>(fixed.interval, fixed.keycodes);
-                    break;
-                }
-            }
-            if(!macro.sequence.is_valid()) {
-                for(const auto& recorded : record_macros) {
-                    if(recorded.name == macro_name) {
-                        macro.sequence.emplace<func::RecordedDelayMacroSequence>(recorded.events);
-                        break;
-                    }
-                }
-            }
-            ensure(macro.sequence.is_valid());
-            may_enlarge(map.functions[layer], pos).emplace<func::MacroKeyFunction>(std::move(macro));
-        } else {
-            bail("unknown statement ", elms[0]);
-        }
+    const auto timer  = stats::Timer(stats::Operation::Parse);
+    auto       parser = make_parser(str, nullptr);
+    while(parser.tokens.next_line()) {
+        ensure(parser.parse_line());
     }
+    parser.resolve_inheritance();
+    return std::move(parser.map);
+}
 
-    return map;
+auto KeyMap::from_string(const std::string_view str, std::vector<Diagnostic>& diagnostics, const char* const path, ParseCache* const cache) -> std::optional<KeyMap> {
+    const auto timer   = stats::Timer(stats::Operation::Parse);
+    auto       parser  = make_parser(str, path, cache);
+    parser.diagnostics = &diagnostics;
+    auto ok            = true;
+    while(parser.tokens.next_line()) {
+        ok &= parser.parse_line();
+    }
+    if(!ok) {
+        return std::nullopt;
+    }
+    parser.resolve_inheritance();
+    return std::move(parser.map);
+}
+
+auto KeyMap::from_file(const char* const path) -> std::optional<KeyMap> {
+    unwrap(text, read_file(path));
+    const auto timer  = stats::Timer(stats::Operation::Parse);
+    auto       parser = make_parser(std::string_view(std::bit_cast<const char*>(text.data()), text.size()), path);
+    while(parser.tokens.next_line()) {
+        ensure(parser.parse_line());
+    }
+    parser.resolve_inheritance();
+    return std::move(parser.map);
 }
 } // namespace niz
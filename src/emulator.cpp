@@ -0,0 +1,136 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "emulator.hpp"
+#include "macros/assert.hpp"
+
+namespace niz {
+auto Emulator::start() -> bool {
+    auto fds = std::array<int, 2>();
+    ensure(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds.data()) == 0, strerror(errno));
+    host   = FileDescriptor(fds[0]);
+    device = FileDescriptor(fds[1]);
+    worker = std::thread(&Emulator::run, this);
+    return true;
+}
+
+auto Emulator::stop() -> void {
+    if(!worker.joinable()) {
+        return;
+    }
+    shutdown(host.as_handle(), SHUT_RDWR);
+    worker.join();
+}
+
+auto Emulator::get_fd() const -> int {
+    return host.as_handle();
+}
+
+Emulator::~Emulator() {
+    stop();
+}
+
+auto Emulator::run() -> void {
+    // host writes a leading report id, hidraw strips it before the device sees the report
+    auto buf = std::array<uint8_t, 65>();
+    while(true) {
+        const auto len = read(device.as_handle(), buf.data(), buf.size());
+        if(len <= 1) {
+            break;
+        }
+        counters.received += 1;
+        if(latency.count() > 0) {
+            std::this_thread::sleep_for(latency);
+        }
+        if(!handle(std::span(buf).subspan(1, len - 1))) {
+            break;
+        }
+    }
+}
+
+auto Emulator::send(const std::span<const uint8_t> report) -> bool {
+    ensure(write(device.as_handle(), report.data(), report.size()) == ssize_t(report.size()));
+    counters.sent += 1;
+    return true;
+}
+
+auto Emulator::handle(const std::span<const uint8_t> report) -> bool {
+    ensure(report.size() >= sizeof(Packet));
+    auto reply = std::array<uint8_t, 64>();
+
+    const auto& packet = *std::bit_cast<Packet*>(report.data());
+    switch(packet.type) {
+    case PacketType::Version:
+        memcpy(reply.data() + 1, version.data(), std::min(version.size(), reply.size() - 2));
+        ensure(send(reply));
+        break;
+    case PacketType::ReadSerial:
+        reply[1] = PacketType::ReadSerial;
+        memcpy(reply.data() + 2, serial.data(), std::min(serial.size(), reply.size() - 2));
+        ensure(send(reply));
+        break;
+    case PacketType::WriteAll:
+    case PacketType::DataEnd:
+        break;
+    case PacketType::KeyData: {
+        const auto layer = report[2];
+        const auto pos   = report[3];
+        ensure(layer >= 1 && layer <= keys.size());
+        ensure(pos >= 1 && pos <= keys[0].size());
+        memcpy(keys[layer - 1][pos - 1].data(), report.data(), std::min(report.size(), size_t(64)));
+    } break;
+    case PacketType::ReadAll:
+        for(auto layer = 0u; layer < keys.size(); layer += 1) {
+            for(auto pos = 0; pos < key_count; pos += 1) {
+                auto& key = keys[layer][pos];
+                if(key[1] == PacketType::KeyData) {
+                    ensure(send(key));
+                } else {
+                    reply.fill(0);
+                    reply[1] = PacketType::KeyData;
+                    reply[2] = layer + 1;
+                    reply[3] = pos + 1;
+                    ensure(send(reply));
+                }
+            }
+        }
+        reply.fill(PacketType::DataEnd);
+        ensure(send(reply));
+        break;
+    case PacketType::ReadCounter: {
+        // [unknown1, type, data_size, count...], up to 15 unaligned counts per report
+        constexpr auto counts_per_report = (64 - 3) / sizeof(uint32_t);
+        for(auto i = 0u; i < counts.size(); i += counts_per_report) {
+            const auto num = std::min(counts_per_report, counts.size() - i);
+            reply.fill(0);
+            reply[1] = PacketType::ReadCounter;
+            reply[2] = num * sizeof(uint32_t);
+            memcpy(reply.data() + 3, &counts[i], num * sizeof(uint32_t));
+            ensure(send(reply));
+        }
+        reply.fill(0);
+        reply[1] = PacketType::DataEnd;
+        ensure(send(reply));
+    } break;
+    case PacketType::Firmware:
+        counters.firmware_bytes += report.size() - sizeof(Packet);
+        break;
+    case PacketType::Keylock:
+        keypress = report[2] != 0;
+        break;
+    case PacketType::InitialCalib:
+        reply[1] = PacketType::InitialCalibDone;
+        ensure(send(reply));
+        break;
+    case PacketType::PressCalib:
+        reply[1] = PacketType::PressCalibDone;
+        ensure(send(reply));
+        break;
+    default:
+        line_warn("emulator: unhandled packet type ", int(packet.type));
+        break;
+    }
+    return true;
+}
+} // namespace niz
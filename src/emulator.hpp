@@ -0,0 +1,48 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/fd.hpp"
+
+namespace niz {
+// software keyboard which speaks the report protocol over a SOCK_SEQPACKET socketpair
+// host_fd can be passed to any function which takes a hidraw fd
+struct Emulator {
+    struct Counters {
+        std::atomic_size_t received;
+        std::atomic_size_t sent;
+        std::atomic_size_t firmware_bytes;
+    };
+
+    std::string               version   = "ATOM66 emulator";
+    std::string               serial    = "EMU0001";
+    int                       key_count = 66;
+    std::vector<uint32_t>     counts    = std::vector<uint32_t>(66);
+    std::chrono::microseconds latency   = {}; // time taken for each received report, like the usb polling interval
+    Counters                  counters;
+
+    // raw KeyData payloads indexed by [layer - 1][pos - 1]
+    std::array<std::array<std::array<uint8_t, 64>, 255>, 3> keys = {};
+
+    FileDescriptor host;
+    FileDescriptor device;
+    std::thread    worker;
+    bool           keypress = true;
+
+    auto start() -> bool;
+    auto stop() -> void;
+    auto get_fd() const -> int;
+
+    ~Emulator();
+
+  private:
+    auto run() -> void;
+    auto handle(std::span<const uint8_t> report) -> bool;
+    auto send(std::span<const uint8_t> report) -> bool;
+};
+} // namespace niz
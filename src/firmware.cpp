@@ -1,48 +1,90 @@
-#include <unistd.h>
+#include <chrono>
+#include <utility>
 
 #include "common.hpp"
+#include "ihex.hpp"
 #include "macros/unwrap.hpp"
-#include "util/charconv.hpp"
-#include "util/file-io.hpp"
+#include "mapped-file.hpp"
+#include "niz.hpp"
 
 namespace niz {
-auto flush_firmware(int fd, const char* const firmware_path) -> bool {
-    unwrap(bin, read_file(firmware_path));
-    auto firmware = std::vector<std::vector<uint8_t>>();
-    // validate virmware
-    for(auto i = 0u; i < bin.size(); i += 1) {
-        ensure(bin[i] == std::byte(PacketType::Firmware)); // each line should begin with 0x3a(':')
-        i += 1;
-
-        const auto begin = i;
-        for(; bin[i] != std::byte('\n'); i += 1) {
-        }
-        const auto len = i - begin - 1;
-        ensure(len / 2 <= 63);
-        ensure(len % 2 == 0);
-
-        auto       part = std::vector<uint8_t>(len / 2);
-        const auto line = std::string_view((char*)&bin[begin], len);
-        // print(line);
-        for(auto i = 0u; i < len; i += 2) {
-            const auto byte_str = line.substr(i, 2);
-            unwrap(byte, from_chars<uint8_t>(byte_str, 16));
-            part[i / 2] = byte;
+namespace {
+// prints at most once per interval and when finished
+struct Progress {
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr auto interval = std::chrono::milliseconds(250);
+
+    size_t            total_packets;
+    Clock::time_point begin = Clock::now();
+    Clock::time_point last  = begin;
+
+    auto update(const size_t packets, const size_t bytes) -> void {
+        const auto now = Clock::now();
+        if(packets != total_packets && now - last < interval) {
+            return;
         }
-        firmware.emplace_back(std::move(part));
+        last = now;
+
+        const auto elapsed = std::chrono::duration<double>(now - begin).count();
+        const auto rate    = elapsed > 0 ? packets / elapsed : 0.0;
+        const auto eta     = rate > 0 ? (total_packets - packets) / rate : 0.0;
+        auto       line    = std::array<char, 96>();
+        snprintf(line.data(), line.size(), "%zu/%zu packets, %.1f KiB/s, eta %.1fs", packets, total_packets, elapsed > 0 ? bytes / elapsed / 1024 : 0.0, eta);
+        message(line.data(), MessageKind::Progress);
     }
+};
+} // namespace
+
+auto FirmwareImage::get_text() const -> std::string_view {
+    return std::string_view(std::bit_cast<const char*>(file.get_data().data()), file.get_data().size());
+}
 
-    print("sending firmware");
-    for(auto i = 0u; i < firmware.size(); i += 1) {
-        auto& part = firmware[i];
-        auto  buf  = std::array<uint8_t, 65>();
-        buf[0]     = 0; // report id
-        buf[1]     = 0; // Packet::unknown1
-        buf[2]     = PacketType::Firmware;
-        memcpy(&buf[3], part.data(), part.size());
-        print(i + 1, "/", firmware.size(), " ", part.size(), " bytes");
-        ensure(write(fd, buf.data(), buf.size()) == buf.size());
+auto FirmwareImage::open(const char* const path) -> std::optional<FirmwareImage> {
+    auto image = FirmwareImage();
+    unwrap_mut(file, MappedFile::open(path));
+    image.file = std::move(file);
+    unwrap(packets, ihex::validate(image.get_text()));
+    image.packets = packets;
+    return image;
+}
+
+auto flush_firmware(const int fd, const FirmwareImage& image) -> bool {
+    const auto text    = image.get_text();
+    const auto packets = image.packets;
+
+    // records are decoded straight into a batch of reports, which is sent as soon as it is full
+    constexpr auto batch_size = 64u;
+
+    auto batch    = std::array<Report, batch_size>();
+    auto batched  = 0u;
+    auto sent     = size_t(0);
+    auto bytes    = size_t(0);
+    auto progress = Progress{packets};
+    auto reader   = ihex::LineReader{text};
+
+    message("sending firmware");
+    while(!reader.at_end()) {
+        unwrap(record, reader.next());
+        auto& buf = batch[batched];
+        buf.fill(0);
+        buf[0] = 0; // report id
+        buf[1] = 0; // Packet::unknown1
+        buf[2] = PacketType::Firmware;
+        unwrap(len, ihex::decode_record(record, std::span<uint8_t, ihex::max_record_size>(&buf[3], ihex::max_record_size)));
+        batched += 1;
+        bytes += len;
+        if(batched == batch.size() || reader.at_end()) {
+            ensure(write_reports(fd, std::span(batch).first(batched)));
+            sent += std::exchange(batched, 0);
+            progress.update(sent, bytes);
+        }
     }
     return true;
 }
+
+auto flush_firmware(const int fd, const char* const firmware_path) -> bool {
+    unwrap(image, FirmwareImage::open(firmware_path));
+    return flush_firmware(fd, image);
+}
 } // namespace niz
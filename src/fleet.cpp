@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+#include <fcntl.h>
+
+#include "common.hpp"
+#include "fleet.hpp"
+#include "macros/assert.hpp"
+#include "niz.hpp"
+#include "util/file-io.hpp"
+
+namespace niz::fleet {
+namespace {
+auto is_keyboard_dir(const std::filesystem::path& dir) -> bool {
+    // control device should not have input capability
+    auto error = std::error_code();
+    if(std::filesystem::exists(dir / "device" / "input", error)) {
+        return false;
+    }
+    const auto uevent = read_file((dir / "device" / "uevent").c_str());
+    if(!uevent) {
+        return false;
+    }
+    auto text = std::string_view(std::bit_cast<const char*>(uevent->data()), uevent->size());
+    while(!text.empty()) {
+        const auto end  = std::min(text.find('\n'), text.size());
+        const auto line = text.substr(0, end);
+        if(line.starts_with("HID_NAME=")) {
+            return line.substr(9).starts_with("CATEX TECH");
+        }
+        text.remove_prefix(std::min(end + 1, text.size()));
+    }
+    return false;
+}
+} // namespace
+
+auto find_devices(const char* const sys_dir, const char* const dev_dir) -> std::vector<std::string> {
+    auto devices = std::vector<std::string>();
+    auto error   = std::error_code();
+    for(const auto& entry : std::filesystem::directory_iterator(sys_dir, error)) {
+        if(is_keyboard_dir(entry.path())) {
+            devices.push_back((std::filesystem::path(dev_dir) / entry.path().filename()).string());
+        }
+    }
+    // hidraw10 comes after hidraw9
+    std::ranges::sort(devices, [](const std::string& a, const std::string& b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    });
+    return devices;
+}
+
+auto is_keyboard(const char* const sys_dir, const std::string_view name) -> bool {
+    return is_keyboard_dir(std::filesystem::path(sys_dir) / name);
+}
+
+auto run_device(const std::string& device, const Job& job, const Opener& open) -> Result {
+    auto result   = Result();
+    result.device = device;
+
+    // messages of the library, such as retries, are kept with the result of this device
+    // progress would repeat every few hundred milliseconds in the summary, so it is dropped
+    auto messages = std::string();
+    auto previous = set_thread_message_handler([&messages](const std::string_view text, const MessageKind kind) {
+        if(kind == MessageKind::Progress) {
+            return;
+        }
+        messages += messages.empty() ? "" : "\n    ";
+        messages += text;
+    });
+
+    const auto begin = std::chrono::steady_clock::now();
+    const auto fd    = open(device);
+    if(fd.as_handle() < 0) {
+        result.output = strerror(errno);
+    } else if(const auto version = get_version(fd.as_handle())) {
+        result.version = *version;
+        result.ok      = job(fd.as_handle(), result.version, result.output);
+        if(!result.ok && result.output.empty()) {
+            result.output = "failed, the reason is printed above";
+        }
+    } else {
+        result.output = "can not read the version";
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    set_thread_message_handler(std::move(previous));
+    if(!messages.empty()) {
+        result.output = result.output.empty() ? std::move(messages) : build_string(messages, "\n    ", result.output);
+    }
+    return result;
+}
+
+auto open_device(const std::string& device) -> FileDescriptor {
+    return FileDescriptor(open(device.data(), O_RDWR | O_NONBLOCK | O_CLOEXEC));
+}
+
+auto run(const std::span<const std::string> devices, const Job& job, const size_t max_workers, const Opener& open) -> std::vector<Result> {
+    auto results = std::vector<Result>(devices.size());
+    auto next    = std::atomic_size_t(0);
+    auto worker  = [&]() {
+        for(auto i = next++; i < devices.size(); i = next++) {
+            results[i] = run_device(devices[i], job, open);
+        }
+    };
+
+    auto workers = std::vector<std::thread>(std::min(devices.size(), std::max(max_workers, size_t(1))));
+    for(auto& thread : workers) {
+        thread = std::thread(worker);
+    }
+    for(auto& thread : workers) {
+        thread.join();
+    }
+    return results;
+}
+
+auto print_summary(const std::span<const Result> results) -> bool {
+    auto succeeded = size_t(0);
+    for(const auto& result : results) {
+        printf("%-16s %-6s %7.2fs %s\n", result.device.data(), result.ok ? "ok" : "FAILED", result.seconds, result.version.data());
+        if(!result.output.empty()) {
+            printf("    %s\n", result.output.data());
+        }
+        succeeded += result.ok ? 1 : 0;
+    }
+    print(succeeded, " of ", results.size(), " devices succeeded");
+    return succeeded == results.size();
+}
+} // namespace niz::fleet
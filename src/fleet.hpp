@@ -0,0 +1,39 @@
+#pragma once
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "util/fd.hpp"
+
+namespace niz::fleet {
+// control interfaces of the keyboards, as found by scripts/find-hidraw.sh
+// returned paths are sorted by device number
+auto find_devices(const char* sys_dir = "/sys/class/hidraw", const char* dev_dir = "/dev") -> std::vector<std::string>;
+// whether the hidraw device named name(e.g. hidraw0) is a keyboard control interface
+auto is_keyboard(const char* sys_dir, std::string_view name) -> bool;
+
+struct Result {
+    std::string device;
+    std::string version;
+    std::string output;
+    double      seconds = 0;
+    bool        ok      = false;
+};
+
+// version is what the device reported when it was opened
+// output and the library messages of the job are printed in the summary, so that they do not interleave
+// assertion messages still go to stderr as they happen
+using Job    = std::function<bool(int fd, const std::string& version, std::string& output)>;
+using Opener = std::function<FileDescriptor(const std::string& device)>;
+
+auto open_device(const std::string& device) -> FileDescriptor;
+
+// opens the device, reads its version and runs job
+auto run_device(const std::string& device, const Job& job, const Opener& open = open_device) -> Result;
+// run_device on every device, on at most max_workers devices at a time
+// results are in the order of devices
+auto run(std::span<const std::string> devices, const Job& job, size_t max_workers, const Opener& open = open_device) -> std::vector<Result>;
+// returns true if every job succeeded
+auto print_summary(std::span<const Result> results) -> bool;
+} // namespace niz::fleet
@@ -0,0 +1,160 @@
+#include <array>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ihex.hpp"
+#include "macros/unwrap.hpp"
+
+namespace niz::ihex {
+namespace {
+constexpr auto invalid_nibble = uint8_t(0xff);
+
+constexpr auto nibble_table = [] {
+    auto table = std::array<uint8_t, 256>();
+    table.fill(invalid_nibble);
+    for(auto c = '0'; c <= '9'; c += 1) {
+        table[c] = c - '0';
+    }
+    for(auto c = 'a'; c <= 'f'; c += 1) {
+        table[c]             = c - 'a' + 10;
+        table[c - 'a' + 'A'] = c - 'a' + 10;
+    }
+    return table;
+}();
+
+#if defined(__SSE2__)
+// a < b for unsigned bytes
+auto less_epu8(const __m128i a, const __m128i b) -> __m128i {
+    return _mm_andnot_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, b), a), _mm_set1_epi8(-1));
+}
+
+// decodes 16 hex digits into 8 bytes
+auto decode_16(const char* const hex, uint8_t* const out) -> bool {
+    const auto chars = _mm_loadu_si128(std::bit_cast<const __m128i*>(hex));
+
+    const auto digit    = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    const auto is_digit = less_epu8(digit, _mm_set1_epi8(10));
+    // setting 0x20 folds 'A'-'F' into 'a'-'f'
+    const auto alpha    = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const auto is_alpha = less_epu8(alpha, _mm_set1_epi8(6));
+    if(_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+        return false;
+    }
+
+    const auto nibbles = _mm_or_si128(_mm_and_si128(is_digit, digit),
+                                      _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+    // even chars are the upper nibbles and sit in the low byte of each 16-bit lane
+    const auto upper = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4);
+    const auto lower = _mm_srli_epi16(nibbles, 8);
+    const auto bytes = _mm_packus_epi16(_mm_or_si128(upper, lower), _mm_setzero_si128());
+    _mm_storel_epi64(std::bit_cast<__m128i*>(out), bytes);
+    return true;
+}
+#endif
+} // namespace
+
+auto decode_hex_scalar(const std::string_view hex, const std::span<uint8_t> out) -> bool {
+    ensure(hex.size() % 2 == 0);
+    ensure(out.size() >= hex.size() / 2);
+    auto invalid = uint8_t(0);
+    for(auto i = 0u; i < hex.size(); i += 2) {
+        const auto upper = nibble_table[uint8_t(hex[i])];
+        const auto lower = nibble_table[uint8_t(hex[i + 1])];
+        invalid |= (upper | lower) & 0xf0;
+        out[i / 2] = upper << 4 | (lower & 0x0f);
+    }
+    return invalid == 0;
+}
+
+auto decode_hex(const std::string_view hex, const std::span<uint8_t> out) -> bool {
+    ensure(hex.size() % 2 == 0);
+    ensure(out.size() >= hex.size() / 2);
+    auto done = size_t(0);
+#if defined(__SSE2__)
+    for(; done + 16 <= hex.size(); done += 16) {
+        if(!decode_16(hex.data() + done, out.data() + done / 2)) {
+            return false;
+        }
+    }
+#endif
+    return decode_hex_scalar(hex.substr(done), out.subspan(done / 2));
+}
+
+auto decode_record(const std::string_view line, const std::span<uint8_t, max_record_size> out) -> std::optional<size_t> {
+    // length(1) + address(2) + type(1) + data(length) + checksum(1)
+    constexpr auto overhead = 5u;
+
+    ensure(line.size() % 2 == 0, "odd number of hex digits");
+    const auto size = line.size() / 2;
+    ensure(size >= overhead, "record too short");
+    ensure(size <= max_record_size, "record of ", size, " bytes does not fit in a report");
+    ensure(decode_hex(line, out), "invalid hex digit");
+
+    const auto length  = out[0];
+    const auto address = out[1] << 8 | out[2];
+    const auto type    = out[3];
+    ensure(length == size - overhead, "length field ", int(length), " does not match record size ", size);
+
+    auto sum = uint8_t(0);
+    for(auto i = 0u; i < size; i += 1) {
+        sum += out[i];
+    }
+    ensure(sum == 0, "checksum mismatch");
+
+    switch(type) {
+    case RecordType::Data:
+        ensure(address + length <= 0x10000, "data crosses the end of the 64KiB segment");
+        break;
+    case RecordType::EndOfFile:
+        ensure(length == 0 && address == 0, "malformed end of file record");
+        break;
+    case RecordType::ExtendedSegmentAddress:
+    case RecordType::ExtendedLinearAddress:
+        ensure(length == 2 && address == 0, "malformed extended address record");
+        break;
+    case RecordType::StartSegmentAddress:
+    case RecordType::StartLinearAddress:
+        ensure(length == 4 && address == 0, "malformed start address record");
+        break;
+    default:
+        bail("unknown record type ", int(type));
+    }
+    return size;
+}
+
+auto LineReader::at_end() const -> bool {
+    return pos >= text.size();
+}
+
+auto LineReader::next() -> std::optional<std::string_view> {
+    line += 1;
+    ensure(text[pos] == ':', "line ", line, " does not begin with ':'");
+    pos += 1;
+
+    auto end    = text.find('\n', pos);
+    end         = end == text.npos ? text.size() : end;
+    auto record = text.substr(pos, end - pos);
+    if(!record.empty() && record.back() == '\r') {
+        record.remove_suffix(1);
+    }
+    pos = end + 1;
+    return record;
+}
+
+auto validate(const std::string_view image) -> std::optional<size_t> {
+    auto reader = LineReader{image};
+    auto buf    = std::array<uint8_t, max_record_size>();
+    auto eof    = false;
+    while(!reader.at_end()) {
+        unwrap(record, reader.next());
+        ensure(!eof, "line ", reader.line, ": record after end of file");
+        const auto size = decode_record(record, buf);
+        ensure(size, "line ", reader.line, ": invalid record");
+        eof = buf[3] == RecordType::EndOfFile;
+    }
+    ensure(reader.line > 0, "empty image");
+    return reader.line;
+}
+} // namespace niz::ihex
@@ -0,0 +1,46 @@
+#pragma once
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace niz::ihex {
+struct RecordType {
+    enum : uint8_t {
+        Data                   = 0x00,
+        EndOfFile              = 0x01,
+        ExtendedSegmentAddress = 0x02,
+        StartSegmentAddress    = 0x03,
+        ExtendedLinearAddress  = 0x04,
+        StartLinearAddress     = 0x05,
+    };
+};
+
+// largest record that fits in a firmware report
+constexpr auto max_record_size = size_t(62);
+
+// converts pairs of hex digits into bytes, out must hold hex.size() / 2 bytes
+// returns false if hex has odd length or a non-hex character
+auto decode_hex(std::string_view hex, std::span<uint8_t> out) -> bool;
+// table-driven version, used for the tail of decode_hex and where sse2 is unavailable
+auto decode_hex_scalar(std::string_view hex, std::span<uint8_t> out) -> bool;
+
+// decodes a record, a line without the leading ':' and line terminator, into out
+// length, record type and checksum are verified
+// returns the size of the record in bytes
+auto decode_record(std::string_view line, std::span<uint8_t, max_record_size> out) -> std::optional<size_t>;
+
+// splits the image into records, accepts both LF and CRLF
+struct LineReader {
+    std::string_view text;
+    size_t           pos  = 0;
+    size_t           line = 0; // 1-based number of the last returned line
+
+    auto at_end() const -> bool;
+    // returns nullopt if the line does not begin with ':'
+    auto next() -> std::optional<std::string_view>;
+};
+
+// validates every record of an image before anything is sent
+// returns the number of records
+auto validate(std::string_view image) -> std::optional<size_t>;
+} // namespace niz::ihex
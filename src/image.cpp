@@ -0,0 +1,73 @@
+#include "image.hpp"
+#include "common.hpp"
+#include "macros/unwrap.hpp"
+#include "mapped-file.hpp"
+
+namespace niz::image {
+namespace {
+static_assert(std::endian::native == std::endian::little, "headers are written in host byte order");
+static_assert(sizeof(Header) == 24);
+
+auto get_type(const Report& report) -> uint8_t {
+    return std::bit_cast<const Packet*>(report.data() + 1)->type;
+}
+} // namespace
+
+auto compile(const KeyMap& keymap) -> std::optional<std::vector<uint8_t>> {
+    unwrap(compact, CompactKeyMap::from_keymap(keymap));
+    const auto reports = compact.make_reports();
+
+    const auto header = Header{
+        .magic        = magic,
+        .version      = version,
+        .key_count    = uint16_t(reports.size() - 2),
+        .report_count = uint32_t(reports.size()),
+        .report_size  = uint16_t(sizeof(Report)),
+        .reserved     = 0,
+        .hash         = hash_reports(reports),
+    };
+    auto image = std::vector<uint8_t>(sizeof(Header) + reports.size() * sizeof(Report));
+    memcpy(image.data(), &header, sizeof(Header));
+    memcpy(image.data() + sizeof(Header), reports.data(), reports.size() * sizeof(Report));
+    return image;
+}
+
+auto get_reports(const std::span<const uint8_t> image) -> std::optional<std::span<const Report>> {
+    ensure(image.size() >= sizeof(Header), "image too short");
+    const auto header = std::bit_cast<Header>(*std::bit_cast<const std::array<uint8_t, sizeof(Header)>*>(image.data()));
+    ensure(header.magic == magic, "not a keymap image");
+    ensure(header.version == version, "unsupported image version ", header.version);
+    ensure(header.report_size == sizeof(Report), "unexpected report size ", header.report_size);
+    ensure(header.report_count >= 2 && header.key_count == header.report_count - 2, "broken report count");
+    ensure(image.size() == sizeof(Header) + size_t(header.report_count) * sizeof(Report), "image size does not match the header");
+
+    const auto reports = std::span(std::bit_cast<const Report*>(image.data() + sizeof(Header)), header.report_count);
+    ensure(hash_reports(reports) == header.hash, "hash mismatch");
+    ensure(get_type(reports.front()) == PacketType::WriteAll);
+    ensure(get_type(reports.back()) == PacketType::DataEnd);
+    for(const auto& report : reports.subspan(1, reports.size() - 2)) {
+        ensure(get_type(report) == PacketType::KeyData, "unexpected packet type ", int(get_type(report)));
+    }
+    return reports;
+}
+
+auto decompile(const std::span<const uint8_t> image) -> std::optional<KeyMap> {
+    unwrap(reports, get_reports(image));
+    auto compact = CompactKeyMap();
+    for(const auto& report : reports.subspan(1, reports.size() - 2)) {
+        ensure(compact.set_key(std::span(report).subspan<1>()));
+    }
+    return compact.to_keymap();
+}
+
+auto write_to_keyboard(const int fd, const char* const path) -> bool {
+    unwrap(file, MappedFile::open(path));
+    unwrap(reports, get_reports(file.get_data()));
+    ensure(write_reports(fd, reports));
+    return true;
+}
+
+auto is_image_path(const std::string_view path) -> bool {
+    return path.ends_with(".nizb");
+}
+} // namespace niz::image
@@ -0,0 +1,33 @@
+#pragma once
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "niz.hpp"
+
+namespace niz::image {
+// precompiled keymap (.nizb), the report stream of write_to_keyboard behind a header
+// fields are little endian, reports are 65 bytes each, starting with the report id
+struct Header {
+    std::array<char, 4> magic;
+    uint16_t            version;
+    uint16_t            key_count;
+    uint32_t            report_count;
+    uint16_t            report_size;
+    uint16_t            reserved;
+    uint64_t            hash; // fnv-1a of the reports
+} __attribute__((packed));
+
+constexpr auto magic   = std::array{'N', 'I', 'Z', 'B'};
+constexpr auto version = uint16_t(1);
+
+auto compile(const KeyMap& keymap) -> std::optional<std::vector<uint8_t>>;
+// checks the header and the framing of the report stream
+// returns the reports, which point into image
+auto get_reports(std::span<const uint8_t> image) -> std::optional<std::span<const std::array<uint8_t, 65>>>;
+auto decompile(std::span<const uint8_t> image) -> std::optional<KeyMap>;
+// maps the image and sends its reports as they are
+auto write_to_keyboard(int fd, const char* path) -> bool;
+// whether path names an image rather than a text keymap
+auto is_image_path(std::string_view path) -> bool;
+} // namespace niz::image
@@ -9,25 +9,39 @@ struct KeyCount : Packet {
     uint8_t  data_size;
     uint32_t count[]; // not aligned!
 } __attribute__((packed));
-} // namespace
 
-auto read_counts(const int fd) -> std::optional<std::vector<uint32_t>> {
+auto try_read_counts(const int fd, std::vector<uint32_t>& counts) -> bool {
     ensure(send_packet(fd, PacketType::ReadCounter, {}));
 
-    auto counts = std::vector<uint32_t>();
+    auto size   = size_t(0);
     auto buf    = std::array<uint8_t, 64>();
+    auto reader = ReportReader(fd, PacketType::ReadCounter);
     while(true) {
-        const auto len = read(fd, buf.data(), buf.size());
+        const auto len = reader.read(buf);
         ensure(len > 0);
-        auto& count = *std::bit_cast<KeyCount*>(buf.data());
+        const auto& count = *std::bit_cast<KeyCount*>(buf.data());
         if(count.type != PacketType::ReadCounter) {
             break;
         }
-        for(auto i = 0; i < count.data_size / 4; i += 1) {
-            counts.push_back(count.count[i]);
+        const auto num = std::min<size_t>(count.data_size, buf.size() - sizeof(KeyCount)) / sizeof(uint32_t);
+        if(counts.size() < size + num) {
+            counts.resize(size + num);
         }
+        memcpy(&counts[size], buf.data() + sizeof(KeyCount), num * sizeof(uint32_t));
+        size += num;
     }
+    counts.resize(size);
+    return true;
+}
+} // namespace
 
+auto read_counts(const int fd, std::vector<uint32_t>& counts) -> bool {
+    return retry(fd, PacketType::ReadCounter, [fd, &counts]() { return try_read_counts(fd, counts); });
+}
+
+auto read_counts(const int fd) -> std::optional<std::vector<uint32_t>> {
+    auto counts = std::vector<uint32_t>();
+    ensure(read_counts(fd, counts));
     return counts;
 }
 } // namespace niz
@@ -1,171 +1,93 @@
+#include <algorithm>
+#include <limits>
+
 #include <unistd.h>
 
+#include "codec.hpp"
 #include "common.hpp"
-#include "macros/assert.hpp"
+#include "macros/unwrap.hpp"
 #include "niz.hpp"
+#include "stats.hpp"
 
 namespace niz {
 namespace {
-struct KeyFunctionType {
-    enum : uint8_t {
-        Keys        = 0x00, // press keys at the same time
-        Emulate     = 0x01, // press keys in a row at constant intervals
-        CountMacro  = 0x02, // run a recorded macro a specified number of times
-        HoldMacro   = 0x03, // run a recorded macro while the key is pressed
-        ToggleMacro = 0x04, // keep running the recorded macro until the same key is pressed again
-    };
-};
-
 struct KeyFunctionPacket : Packet {
     uint8_t layer;
     uint8_t pos;
-    uint8_t func_type;
-} __attribute__((packed));
-
-struct KeysKeyFunctionPacket : KeyFunctionPacket {
-    uint8_t data_size;
-    uint8_t keycodes[];
 } __attribute__((packed));
 
-struct EmulateKeyFunctionPacket : KeyFunctionPacket {
-    uint8_t delay_upper;
-    uint8_t delay_lower;
-    uint8_t data_size;
-    uint8_t keycodes[];
-} __attribute__((packed));
-
-struct MacroEvent {
-    uint8_t keycode;
-    uint8_t unknown1;
-    uint8_t delay_upper;
-    uint8_t delay_lower;
-} __attribute__((packed));
+static_assert(sizeof(KeyFunctionPacket) == codec::payload_offset);
+static_assert(codec::payload_offset + CompactKeyMap::max_payload_size == codec::packet_size);
 
-struct MacroKeyFunctionPacket : KeyFunctionPacket {
-    uint8_t repeat_count;
-    uint8_t use_recorded_delay;
-    uint8_t auto_delay_upper;
-    uint8_t auto_delay_lower;
-    uint8_t unknown2;
-    uint8_t data_size;
-} __attribute__((packed));
-
-struct AutoDelayMacroKeyFunctionPacket : MacroKeyFunctionPacket {
-    uint8_t keycodes[];
-} __attribute__((packed));
-
-struct RecordedDelayMacroKeyFunctionPacket : MacroKeyFunctionPacket {
-    MacroEvent macro_events[]; // unaligned!
-} __attribute__((packed));
+// KeyData packets without the report id
+using KeyPacket = std::array<uint8_t, codec::packet_size>;
 
 auto print_keycodes(std::span<const uint8_t> codes) -> void {
     for(const auto code : codes) {
-        printf("%d(%s),", int(code), keycodes[code]);
+        printf("%d(%s),", int(code), keycodes[code].data());
     }
     printf("\n");
 }
-} // namespace
-
-auto KeyMap::write_to_keyboard(const int fd) const -> bool {
-    send_packet(fd, PacketType::WriteAll, {});
 
-    auto  buf = std::array<uint8_t, 65>();
+auto encode_key_header(const int layer, const int pos, Report& buf) -> void {
+    buf.fill(0);
     auto& key = *std::bit_cast<KeyFunctionPacket*>(buf.data() + 1);
     key.type  = PacketType::KeyData;
+    key.layer = layer + 1;
+    key.pos   = pos + 1;
+}
 
-    for(auto i = 0; i < 3; i += 1) {
-        key.layer = i + 1;
-
-        auto& funcs = functions[i];
-        for(auto i = 0u; i < funcs.size(); i += 1) {
-            key.pos = i + 1;
-            switch(funcs[i].get_index()) {
-            case func::KeyFunction::index_of<func::KeysFunction>: {
-                const auto& func = funcs[i].as<func::KeysFunction>();
+auto get_packet(Report& buf) -> codec::Buffer {
+    return codec::Buffer(buf.data() + 1, codec::packet_size);
+}
 
-                auto& keys_key     = *std::bit_cast<KeysKeyFunctionPacket*>(&key);
-                keys_key.func_type = 0x00;
-                keys_key.data_size = func.keycodes.size();
-                for(auto i = 0u; i < func.keycodes.size(); i += 1) {
-                    keys_key.keycodes[i] = func.keycodes[i];
-                }
-                keys_key.keycodes[func.keycodes.size()] = 0;
-            } break;
-            case func::KeyFunction::index_of<func::EmulateKeyFunction>: {
-                const auto& func = funcs[i].as<func::EmulateKeyFunction>();
+// encodes a key function into a KeyData report, buf[0] is the report id
+// returns false if the function is empty
+auto encode_key_function(const func::KeyFunction& function, const int layer, const int pos, Report& buf) -> std::optional<bool> {
+    if(!function.is_valid()) {
+        return false;
+    }
+    encode_key_header(layer, pos, buf);
+    ensure(codec::encode_key(function, get_packet(buf)), "layer ", layer, " key ", pos);
+    return true;
+}
 
-                auto& emu_key       = *std::bit_cast<EmulateKeyFunctionPacket*>(&key);
-                emu_key.func_type   = 0x01;
-                emu_key.delay_upper = (func.delay & 0xff00) >> 8;
-                emu_key.delay_lower = (func.delay & 0x00ff);
-                emu_key.data_size   = func.keycodes.size();
-                for(auto i = 0u; i < func.keycodes.size(); i += 1) {
-                    emu_key.keycodes[i] = func.keycodes[i];
-                }
-            } break;
-            case func::KeyFunction::index_of<func::MacroKeyFunction>: {
-                const auto& func = funcs[i].as<func::MacroKeyFunction>();
+auto encode_empty_key(const int layer, const int pos, Report& buf) -> void {
+    encode_key_header(layer, pos, buf);
+    auto empty = func::KeyFunction();
+    empty.emplace<func::KeysFunction>();
+    codec::encode_key(empty, get_packet(buf));
+}
 
-                auto& macro_key = *std::bit_cast<MacroKeyFunctionPacket*>(&key);
-                switch(func.repeat) {
-                case func::MacroRepeat::Count:
-                    macro_key.func_type    = 0x02;
-                    macro_key.repeat_count = func.repeat_count;
-                    break;
-                case func::MacroRepeat::Hold:
-                    macro_key.func_type    = 0x03;
-                    macro_key.repeat_count = 0;
-                    break;
-                case func::MacroRepeat::Toggle:
-                    macro_key.func_type    = 0x04;
-                    macro_key.repeat_count = 0;
-                    break;
-                }
-                switch(func.sequence.get_index()) {
-                case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
-                    auto& sequence                    = func.sequence.as<func::AutoDelayMacroSequence>();
-                    auto& auto_macro_key              = *std::bit_cast<AutoDelayMacroKeyFunctionPacket*>(&key);
-                    auto_macro_key.use_recorded_delay = 0;
-                    auto_macro_key.auto_delay_upper   = (sequence.delay & 0xff00) >> 8;
-                    auto_macro_key.auto_delay_lower   = (sequence.delay & 0x00ff);
-                    auto_macro_key.unknown2           = 0;
-                    auto_macro_key.data_size          = sequence.keycodes.size();
-                    for(auto i = 0u; i < sequence.keycodes.size(); i += 1) {
-                        auto_macro_key.keycodes[i] = sequence.keycodes[i];
-                    }
-                } break;
-                case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
-                    auto& sequence                   = func.sequence.as<func::RecordedDelayMacroSequence>();
-                    auto& rec_macro_key              = *std::bit_cast<RecordedDelayMacroKeyFunctionPacket*>(&key);
-                    rec_macro_key.use_recorded_delay = 1;
-                    rec_macro_key.auto_delay_upper   = 0;
-                    rec_macro_key.auto_delay_lower   = 0;
-                    rec_macro_key.unknown2           = 0;
-                    rec_macro_key.data_size          = sequence.events.size() * sizeof(MacroEvent);
-                    for(auto i = 0u; i < sequence.events.size(); i += 1) {
-                        auto& key_event       = rec_macro_key.macro_events[i];
-                        auto& seq_event       = sequence.events[i];
-                        key_event.keycode     = seq_event.keycode;
-                        key_event.unknown1    = 0xc8;
-                        key_event.delay_upper = (seq_event.delay & 0xff00) >> 8;
-                        key_event.delay_lower = (seq_event.delay & 0x00ff);
-                    }
-                } break;
-                }
-            } break;
-            default:
-                continue;
+auto has_same_keys(const CompactKeyMap& a, const CompactKeyMap& b) -> bool {
+    for(auto layer = 0; layer < 3; layer += 1) {
+        for(auto pos = 0u; pos < CompactKeyMap::max_keys; pos += 1) {
+            if(!std::ranges::equal(a.get_payload(layer, pos), b.get_payload(layer, pos))) {
+                return false;
             }
-            ensure(write(fd, buf.data(), buf.size()) == buf.size());
         }
     }
+    return true;
+}
 
+auto make_data_end_report() -> Report {
+    auto buf = Report();
     for(auto i = 1u; i < buf.size(); i += 1) {
         buf[i] = PacketType::DataEnd;
     }
-    ensure(write(fd, buf.data(), buf.size()) == buf.size());
+    return buf;
+}
+} // namespace
 
-    return true;
+auto KeyMap::write_to_keyboard(const int fd) const -> bool {
+    unwrap(compact, CompactKeyMap::from_keymap(*this));
+    return compact.write_to_keyboard(fd);
+}
+
+auto KeyMap::write_diff_to_keyboard(const int fd, const KeyMap& current, const bool verify) const -> bool {
+    unwrap(compact, CompactKeyMap::from_keymap(*this));
+    unwrap(current_compact, CompactKeyMap::from_keymap(current));
+    return compact.write_diff_to_keyboard(fd, current_compact, verify);
 }
 
 auto KeyMap::debug_print() const -> void {
@@ -201,19 +123,19 @@ auto KeyMap::debug_print() const -> void {
                     print("  repeat: ", "toggle");
                     break;
                 }
-                switch(func.sequence.get_index()) {
+                switch(func.sequence->get_index()) {
                 case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
-                    auto& sequence = func.sequence.as<func::AutoDelayMacroSequence>();
+                    auto& sequence = func.sequence->as<func::AutoDelayMacroSequence>();
                     print("  auto delay: ", sequence.delay);
                     printf("  codes: ");
                     print_keycodes(sequence.keycodes);
                 } break;
                 case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>: {
-                    auto& sequence = func.sequence.as<func::RecordedDelayMacroSequence>();
+                    auto& sequence = func.sequence->as<func::RecordedDelayMacroSequence>();
                     printf("  events:");
                     for(auto i = 0u; i < sequence.events.size(); i += 1) {
                         auto& e = sequence.events[i];
-                        printf(" %s -> %dms ->", keycodes[e.keycode], e.delay);
+                        printf(" %s -> %dms ->", keycodes[e.keycode].data(), e.delay);
                     }
                     printf("\n");
                 } break;
@@ -225,91 +147,192 @@ auto KeyMap::debug_print() const -> void {
 }
 
 auto KeyMap::from_keyboard(const int fd) -> std::optional<KeyMap> {
-    auto keymap = KeyMap();
-    auto buf    = std::array<uint8_t, 64>();
-
-    ensure(send_packet(fd, PacketType::ReadAll, {}));
-    while(true) {
-        const auto len = read(fd, buf.data(), buf.size());
-        ensure(len > 0);
-        const auto& key = *std::bit_cast<KeyFunctionPacket*>(buf.data());
-        if(key.type == PacketType::DataEnd) {
-            break;
-        }
-        ensure(key.type == PacketType::KeyData);
+    unwrap(compact, CompactKeyMap::from_keyboard(fd));
+    return compact.to_keymap();
+}
 
-        auto func = func::KeyFunction();
-        switch(key.func_type) {
-        case KeyFunctionType::Keys: {
-            const auto& key = *std::bit_cast<KeysKeyFunctionPacket*>(buf.data());
-            if(key.data_size == 0) {
-                continue;
-            }
+auto CompactKeyMap::get_payload(const int layer, const int pos) const -> std::span<const uint8_t> {
+    const auto& slot = slots[layer][pos];
+    return std::span(pool.data() + slot.offset, slot.size);
+}
+
+auto CompactKeyMap::set_payload(const int layer, const int pos, const std::span<const uint8_t> payload) -> bool {
+    ensure(pos >= 0 && pos < int(max_keys), "key position ", pos, " out of range");
+    ensure(payload.size() <= max_payload_size);
+    ensure(pool.size() + payload.size() <= std::numeric_limits<uint16_t>::max(), "keymap too large");
+    slots[layer][pos] = Slot{uint16_t(pool.size()), uint8_t(payload.size())};
+    pool.insert(pool.end(), payload.begin(), payload.end());
+    return true;
+}
+
+auto CompactKeyMap::encode(const int layer, const int pos, std::array<uint8_t, 65>& buf) const -> bool {
+    const auto payload = get_payload(layer, pos);
+    if(payload.empty()) {
+        return false;
+    }
+    encode_key_header(layer, pos, buf);
+    memcpy(buf.data() + 1 + codec::payload_offset, payload.data(), payload.size());
+    return true;
+}
 
-            auto keycodes = std::vector<uint8_t>();
-            for(auto i = 0u; i < key.data_size; i += 1) {
-                keycodes.push_back(key.keycodes[i]);
+auto CompactKeyMap::count_keys() const -> size_t {
+    auto count = size_t(0);
+    for(const auto& layer : slots) {
+        count += std::count_if(layer.begin(), layer.end(), [](const Slot& slot) { return slot.size != 0; });
+    }
+    return count;
+}
+
+auto CompactKeyMap::make_reports() const -> std::vector<Report> {
+    auto reports = std::vector<Report>(count_keys() + 2);
+    auto report  = reports.begin();
+    *report++    = make_report(PacketType::WriteAll);
+    for(auto layer = 0; layer < 3; layer += 1) {
+        for(auto pos = 0u; pos < max_keys; pos += 1) {
+            if(encode(layer, pos, *report)) {
+                report += 1;
             }
+        }
+    }
+    *report = make_data_end_report();
+    return reports;
+}
 
-            func.emplace<func::KeysFunction>(std::move(keycodes));
-        } break;
-        case KeyFunctionType::CountMacro:
-        case KeyFunctionType::HoldMacro:
-        case KeyFunctionType::ToggleMacro: {
-            auto        macro_func = func::MacroKeyFunction();
-            const auto& key        = *std::bit_cast<MacroKeyFunctionPacket*>(buf.data());
-            switch(key.func_type) {
-            case KeyFunctionType::CountMacro:
-                macro_func.repeat       = func::MacroRepeat::Count;
-                macro_func.repeat_count = key.repeat_count;
-                break;
-            case KeyFunctionType::HoldMacro:
-                macro_func.repeat = func::MacroRepeat::Hold;
-                break;
-            case KeyFunctionType::ToggleMacro:
-                macro_func.repeat = func::MacroRepeat::Toggle;
-                break;
-            default:
+auto CompactKeyMap::get_hash() const -> uint64_t {
+    return hash_reports(make_reports());
+}
+
+auto CompactKeyMap::write_to_keyboard(const int fd) const -> bool {
+    ensure(write_reports(fd, make_reports()));
+    return true;
+}
+
+auto CompactKeyMap::write_diff_to_keyboard(const int fd, const CompactKeyMap& current, const bool verify) const -> bool {
+    // keys which are unset in this map but set on the device are cleared with an empty Keys function
+    auto changed = std::vector<Report>();
+    auto total   = 0u;
+    auto buf     = Report();
+    for(auto layer = 0; layer < 3; layer += 1) {
+        for(auto pos = 0u; pos < max_keys; pos += 1) {
+            const auto payload     = get_payload(layer, pos);
+            const auto cur_payload = current.get_payload(layer, pos);
+            total += payload.empty() ? 0 : 1;
+            if(std::ranges::equal(payload, cur_payload)) {
                 continue;
             }
-            if(key.use_recorded_delay) {
-                auto& sequence = macro_func.sequence.emplace<func::RecordedDelayMacroSequence>();
-
-                const auto& key = *std::bit_cast<RecordedDelayMacroKeyFunctionPacket*>(buf.data());
-                for(auto i = 0; i < int(key.data_size / sizeof(MacroEvent)); i += 1) {
-                    const auto& s     = key.macro_events[i];
-                    const auto  delay = uint16_t(s.delay_upper << 8 | s.delay_lower);
-                    sequence.events.push_back(func::RecordedDelayMacroSequence::Event{s.keycode, delay});
-                }
+            if(payload.empty()) {
+                encode_empty_key(layer, pos, buf);
             } else {
-                auto& sequence = macro_func.sequence.emplace<func::AutoDelayMacroSequence>();
+                encode(layer, pos, buf);
+            }
+            changed.push_back(buf);
+        }
+    }
 
-                const auto& key = *std::bit_cast<AutoDelayMacroKeyFunctionPacket*>(buf.data());
-                sequence.delay  = key.auto_delay_upper << 8 | key.auto_delay_lower;
-                for(auto i = 0; i < key.data_size; i += 1) {
-                    sequence.keycodes.push_back(key.keycodes[i]);
-                }
+    if(changed.empty()) {
+        message("keymap is up to date");
+        return true;
+    }
+    if(changed.size() >= total) {
+        // nothing to save, let the firmware take the regular path
+        return write_to_keyboard(fd);
+    }
+
+    message(build_string("writing ", changed.size(), " of ", total, " keys"));
+    changed.insert(changed.begin(), make_report(PacketType::WriteAll));
+    changed.push_back(make_data_end_report());
+    ensure(write_reports(fd, changed));
+    if(!verify) {
+        return true;
+    }
+
+    // nothing documents that the firmware keeps the unsent keys after WriteAll, so the result can be read back
+    // a firmware which cleared them gets the whole map
+    unwrap(written, CompactKeyMap::from_keyboard(fd));
+    if(!has_same_keys(*this, written)) {
+        message("keyboard did not keep the unchanged keys, writing every key");
+        return write_to_keyboard(fd);
+    }
+    return true;
+}
+
+auto CompactKeyMap::to_keymap() const -> std::optional<KeyMap> {
+    const auto timer  = stats::Timer(stats::Operation::Decode);
+    auto       keymap = KeyMap();
+    auto       buf    = KeyPacket();
+    for(auto layer = 0; layer < 3; layer += 1) {
+        // sized once up to the last key instead of growing key by key
+        const auto& layer_slots = slots[layer];
+        const auto  last        = std::find_if(layer_slots.rbegin(), layer_slots.rend(), [](const Slot& slot) { return slot.size != 0; });
+        keymap.functions[layer].resize(layer_slots.rend() - last);
+        for(auto pos = 0u; pos < keymap.functions[layer].size(); pos += 1) {
+            const auto payload = get_payload(layer, pos);
+            if(payload.empty()) {
+                continue;
             }
-            func.emplace<func::MacroKeyFunction>(std::move(macro_func));
-        } break;
-        case KeyFunctionType::Emulate: {
-            auto& emu_func = func.emplace<func::EmulateKeyFunction>();
-
-            const auto& key = *std::bit_cast<EmulateKeyFunctionPacket*>(buf.data());
-            emu_func.delay  = key.delay_upper << 8 | key.delay_lower;
-            for(auto i = 0; i < key.data_size; i += 1) {
-                emu_func.keycodes.push_back(key.keycodes[i]);
+            buf.fill(0);
+            memcpy(buf.data() + codec::payload_offset, payload.data(), payload.size());
+            unwrap_mut(function, codec::decode_key(buf));
+            keymap.functions[layer][pos] = std::move(function);
+        }
+    }
+    return keymap;
+}
+
+auto CompactKeyMap::from_keymap(const KeyMap& keymap) -> std::optional<CompactKeyMap> {
+    const auto timer   = stats::Timer(stats::Operation::Encode);
+    auto       compact = CompactKeyMap();
+    auto       buf     = Report();
+    for(auto layer = 0; layer < 3; layer += 1) {
+        auto& funcs = keymap.functions[layer];
+        ensure(funcs.size() <= max_keys, "too many keys in layer ", layer);
+        for(auto pos = 0u; pos < funcs.size(); pos += 1) {
+            unwrap(encoded, encode_key_function(funcs[pos], layer, pos, buf));
+            if(!encoded) {
+                continue;
             }
-        } break;
-        default:
-            line_warn("unknown function type: ");
-            dump_buffer(buf);
-            continue;
+            const auto packet = get_packet(buf);
+            unwrap(size, codec::get_payload_size(packet));
+            ensure(compact.set_payload(layer, pos, packet.subspan(codec::payload_offset, size)));
         }
+    }
+    return compact;
+}
 
-        may_enlarge(keymap.functions[key.layer - 1], key.pos - 1) = std::move(func);
+auto CompactKeyMap::set_key(const std::span<const uint8_t, codec::packet_size> packet) -> bool {
+    const auto& key = *std::bit_cast<const KeyFunctionPacket*>(packet.data());
+    ensure(key.type == PacketType::KeyData);
+    ensure(key.layer >= 1 && key.layer <= 3, "invalid layer ", int(key.layer));
+    ensure(key.pos >= 1, "invalid key position");
+
+    unwrap(size, codec::get_payload_size(packet));
+    if(size == 0) {
+        slots[key.layer - 1][key.pos - 1] = Slot();
+        return true;
     }
+    return set_payload(key.layer - 1, key.pos - 1, packet.subspan(codec::payload_offset, size));
+}
 
-    return std::move(keymap);
+auto CompactKeyMap::from_keyboard(const int fd) -> std::optional<CompactKeyMap> {
+    // a lost DataEnd makes the whole response time out, ReadAll is repeated in that case
+    return retry(fd, PacketType::ReadAll, [fd]() -> std::optional<CompactKeyMap> {
+        auto compact = CompactKeyMap();
+        auto buf     = KeyPacket();
+
+        ensure(send_packet(fd, PacketType::ReadAll, {}));
+        auto reader = ReportReader(fd, PacketType::ReadAll);
+        while(true) {
+            const auto len = reader.read(buf);
+            ensure(len > 0);
+            const auto& key = *std::bit_cast<KeyFunctionPacket*>(buf.data());
+            if(key.type == PacketType::DataEnd) {
+                break;
+            }
+            if(!compact.set_key(buf)) {
+                message(build_string("ignored invalid key packet\n", format_buffer(buf)));
+            }
+        }
+        return compact;
+    });
 }
 } // namespace niz
@@ -0,0 +1,69 @@
+#include "layout.hpp"
+#include "macros/assert.hpp"
+#include "name-table.hpp"
+
+namespace niz::layout {
+namespace {
+// from memo/atom66-index.txt, digits are prefixed so that names are not mistaken for positions
+constexpr auto atom66_positions = std::array<std::string_view, 66>{
+    "Esc", "Digit1", "Digit2", "Digit3", "Digit4", "Digit5", "Digit6", "Digit7", "Digit8", "Digit9", "Digit0", "-", "=", "`", "Backspace",
+    "Tab", "Q", "W", "E", "R", "T", "Y", "U", "I", "O", "P", "[", "]", "\\",
+    "Caps", "A", "S", "D", "F", "G", "H", "J", "K", "L", ";", "'", "Return",
+    "LShift", "Z", "X", "C", "V", "B", "N", "M", ",", ".", "/", "RShift", "Del",
+    "LCtrl", "LFn", "Mod", "LAlt", "Space", "RFn", "RAlt", "RCtrl", "Left", "Down", "Right",
+};
+constexpr auto atom66_table = NameTable<atom66_positions.size(), 256>(atom66_positions);
+
+static_assert(atom66_table.find("Tab") == 15);
+static_assert(atom66_table.find("LShift") == 42);
+static_assert(atom66_table.find("LFn") == 56);
+static_assert(atom66_table.find("Right") == 65);
+
+constexpr auto layouts = std::array{
+    Layout{
+        .name           = "ATOM66",
+        .version_prefix = "ATOM66",
+        .positions      = atom66_positions,
+        .layers         = {true, true, true},
+        .find_position  = [](const std::string_view name) { return atom66_table.find(name); },
+    },
+};
+
+// names must be unique, and a name which is a number would hide the position of the same number
+constexpr auto check_names(const Layout& layout) -> bool {
+    for(auto pos = 0u; pos < layout.positions.size(); pos += 1) {
+        const auto name = layout.positions[pos];
+        if(layout.find_position(name) != pos || name.find_first_not_of("0123456789") == name.npos) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(check_names(layouts[0]));
+} // namespace
+
+auto find(const std::string_view name) -> const Layout* {
+    for(const auto& layout : layouts) {
+        if(layout.name == name) {
+            return &layout;
+        }
+    }
+    return nullptr;
+}
+
+auto find_by_version(const std::string_view version) -> const Layout* {
+    for(const auto& layout : layouts) {
+        if(version.starts_with(layout.version_prefix)) {
+            return &layout;
+        }
+    }
+    return nullptr;
+}
+
+auto check_version(const Layout* const layout, const std::string_view version) -> bool {
+    const auto model = find_by_version(version);
+    ensure(layout == nullptr || model == nullptr || layout == model, "keymap is for ", layout->name, " but the keyboard is ", model->name);
+    return true;
+}
+} // namespace niz::layout
@@ -0,0 +1,31 @@
+#pragma once
+#include <array>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace niz::layout {
+// a keyboard model: its keys, their names and the layers it has
+struct Layout {
+    std::string_view name;
+    // get_version of the keyboards of this model begins with it
+    std::string_view version_prefix;
+    // names of the keys indexed by position, so its size is the key count
+    std::span<const std::string_view> positions;
+    // which of layer_names the model has
+    std::array<bool, 3> layers;
+    // looks up a name of positions in a table built at compile time
+    std::optional<uint8_t> (*find_position)(std::string_view name);
+
+    auto get_key_count() const -> size_t {
+        return positions.size();
+    }
+};
+
+// returns nullptr for an unknown model
+auto find(std::string_view name) -> const Layout*;
+auto find_by_version(std::string_view version) -> const Layout*;
+// whether a keymap for layout can be written to the keyboard which reported version
+// prints the models if not, keymaps without layout and unknown keyboards always match
+auto check_version(const Layout* layout, std::string_view version) -> bool;
+} // namespace niz::layout
@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "layout.hpp"
+#include "libniz.h"
+#include "macro.hpp"
+#include "macros/assert.hpp"
+#include "niz.hpp"
+#include "util/fd.hpp"
+#include "util/file-io.hpp"
+
+struct niz_device {
+    FileDescriptor             fd;
+    std::string                version;
+    std::optional<std::string> serial; // read on first use
+};
+
+struct niz_keymap {
+    niz::KeyMap keymap;
+};
+
+namespace {
+thread_local auto last_error = std::string();
+
+auto fail(const niz_status status, std::string message) -> niz_status {
+    last_error = std::move(message);
+    return status;
+}
+
+// first error of a parse, later ones are often caused by it
+auto fail_parse(const std::vector<niz::Diagnostic>& diagnostics) -> niz_status {
+    for(const auto& diagnostic : diagnostics) {
+        if(diagnostic.error) {
+            return fail(NIZ_ERROR_PARSE, build_string(diagnostic.line, ":", diagnostic.column, ": ", diagnostic.message));
+        }
+    }
+    return fail(NIZ_ERROR_PARSE, "invalid keymap");
+}
+
+// takes keymap and optimizes its macros, as the cli does before sending a keymap
+auto finish_keymap(niz::KeyMap keymap, niz_keymap** const result) -> niz_status {
+    if(!niz::macro::optimize(keymap)) {
+        return fail(NIZ_ERROR_ENCODE, "a macro does not fit in a packet");
+    }
+    *result = new niz_keymap{std::move(keymap)};
+    return NIZ_OK;
+}
+
+auto encode(const niz_keymap& keymap) -> std::optional<niz::CompactKeyMap> {
+    auto compact = niz::CompactKeyMap::from_keymap(keymap.keymap);
+    if(!compact) {
+        fail(NIZ_ERROR_ENCODE, "the keymap does not fit in the packets of the keyboard");
+    }
+    return compact;
+}
+
+// exceptions must not reach the c caller
+template <class Func>
+auto guard(const Func func) -> niz_status {
+    try {
+        return func();
+    } catch(const std::bad_alloc&) {
+        return fail(NIZ_ERROR_MEMORY, "out of memory");
+    } catch(const std::filesystem::filesystem_error& e) {
+        return fail(NIZ_ERROR_IO, e.what());
+    } catch(const std::exception& e) {
+        return fail(NIZ_ERROR_INTERNAL, e.what());
+    } catch(...) {
+        return fail(NIZ_ERROR_INTERNAL, "unknown exception");
+    }
+}
+
+auto check_layout(const niz_device& device, const niz_keymap& keymap) -> bool {
+    if(!niz::layout::check_version(keymap.keymap.layout, device.version)) {
+        fail(NIZ_ERROR_LAYOUT, build_string("the keymap is for ", keymap.keymap.layout->name, ", the keyboard is ", device.version));
+        return false;
+    }
+    return true;
+}
+} // namespace
+
+extern "C" {
+auto niz_abi_version() -> unsigned {
+    return NIZ_ABI_VERSION;
+}
+
+auto niz_status_string(const niz_status status) -> const char* {
+    switch(status) {
+    case NIZ_OK:
+        return "ok";
+    case NIZ_ERROR_ARGUMENT:
+        return "invalid argument";
+    case NIZ_ERROR_IO:
+        return "io error";
+    case NIZ_ERROR_DEVICE:
+        return "device error";
+    case NIZ_ERROR_PARSE:
+        return "invalid keymap";
+    case NIZ_ERROR_ENCODE:
+        return "keymap too large";
+    case NIZ_ERROR_LAYOUT:
+        return "keymap for another model";
+    case NIZ_ERROR_BUFFER_SIZE:
+        return "buffer too small";
+    case NIZ_ERROR_MEMORY:
+        return "out of memory";
+    case NIZ_ERROR_INTERNAL:
+        return "internal error";
+    }
+    return "unknown status";
+}
+
+auto niz_last_error() -> const char* {
+    return last_error.data();
+}
+
+auto niz_set_message_callback(const niz_message_callback callback, void* const data) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(callback == nullptr) {
+            niz::set_message_handler(nullptr);
+            return NIZ_OK;
+        }
+        niz::set_message_handler([callback, data](const std::string_view text, niz::MessageKind /*kind*/) {
+            // the callback takes a null terminated string
+            callback(data, std::string(text).data());
+        });
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_open(const char* const path, niz_device** const device) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(path == nullptr || device == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        // every wait for the device goes through poll with a deadline
+        auto fd = FileDescriptor(open(path, O_RDWR | O_CLOEXEC));
+        if(fd.as_handle() < 0 || fcntl(fd.as_handle(), F_SETFL, O_NONBLOCK) != 0) {
+            return fail(NIZ_ERROR_IO, build_string(path, ": ", strerror(errno)));
+        }
+        auto version = niz::get_version(fd.as_handle());
+        if(!version) {
+            return fail(NIZ_ERROR_DEVICE, "can not read the version");
+        }
+        *device = new niz_device{std::move(fd), std::move(*version), std::nullopt};
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_close(niz_device* const device) -> void {
+    delete device;
+}
+
+auto niz_device_get_version(const niz_device* const device) -> const char* {
+    return device != nullptr ? device->version.data() : "";
+}
+
+auto niz_device_get_serial(niz_device* const device, const char** const serial) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr || serial == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        if(!device->serial) {
+            device->serial = niz::get_serial(device->fd.as_handle());
+            if(!device->serial) {
+                return fail(NIZ_ERROR_DEVICE, "can not read the serial");
+            }
+        }
+        *serial = device->serial->data();
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_read_keymap(niz_device* const device, niz_keymap** const keymap) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr || keymap == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        const auto compact = niz::CompactKeyMap::from_keyboard(device->fd.as_handle());
+        if(!compact) {
+            return fail(NIZ_ERROR_DEVICE, "can not read the keymap");
+        }
+        auto result = compact->to_keymap();
+        if(!result) {
+            return fail(NIZ_ERROR_DEVICE, "the keyboard sent an invalid keymap");
+        }
+        result->set_layout_for(device->version);
+        *keymap = new niz_keymap{std::move(*result)};
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_write_keymap(niz_device* const device, const niz_keymap* const keymap) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr || keymap == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        if(!check_layout(*device, *keymap)) {
+            return NIZ_ERROR_LAYOUT;
+        }
+        const auto compact = encode(*keymap);
+        if(!compact) {
+            return NIZ_ERROR_ENCODE;
+        }
+        if(!compact->write_to_keyboard(device->fd.as_handle())) {
+            return fail(NIZ_ERROR_DEVICE, "can not write the keymap");
+        }
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_write_keymap_diff(niz_device* const device, const niz_keymap* const keymap, const niz_keymap* const current) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr || keymap == nullptr || current == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        if(!check_layout(*device, *keymap)) {
+            return NIZ_ERROR_LAYOUT;
+        }
+        const auto compact = encode(*keymap);
+        if(!compact) {
+            return NIZ_ERROR_ENCODE;
+        }
+        const auto compact_current = encode(*current);
+        if(!compact_current) {
+            return NIZ_ERROR_ENCODE;
+        }
+        if(!compact->write_diff_to_keyboard(device->fd.as_handle(), *compact_current)) {
+            return fail(NIZ_ERROR_DEVICE, "can not write the keymap");
+        }
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_read_counts(niz_device* const device, uint32_t* const counts, const size_t capacity, size_t* const count) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr || count == nullptr || (counts == nullptr && capacity != 0)) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        const auto result = niz::read_counts(device->fd.as_handle());
+        if(!result) {
+            return fail(NIZ_ERROR_DEVICE, "can not read the key counts");
+        }
+        *count = result->size();
+        if(result->size() > capacity) {
+            return fail(NIZ_ERROR_BUFFER_SIZE, build_string(result->size(), " keys do not fit in ", capacity));
+        }
+        std::ranges::copy(*result, counts);
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_enable_keypress(niz_device* const device, const int enable) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        if(!niz::enable_keypress(device->fd.as_handle(), enable != 0)) {
+            return fail(NIZ_ERROR_DEVICE, "can not change the keypress state");
+        }
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_flush_firmware(niz_device* const device, const char* const firmware_path) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr || firmware_path == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        // tells a missing image apart from a failed transfer
+        if(access(firmware_path, R_OK) != 0) {
+            return fail(NIZ_ERROR_IO, build_string(firmware_path, ": ", strerror(errno)));
+        }
+        if(!niz::flush_firmware(device->fd.as_handle(), firmware_path)) {
+            return fail(NIZ_ERROR_DEVICE, "can not flush the firmware");
+        }
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_initial_calibration(niz_device* const device) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        if(!niz::do_initial_calibration(device->fd.as_handle())) {
+            return fail(NIZ_ERROR_DEVICE, "initial calibration failed");
+        }
+        return NIZ_OK;
+    });
+}
+
+auto niz_device_press_calibration(niz_device* const device) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(device == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        if(!niz::do_press_calibration(device->fd.as_handle())) {
+            return fail(NIZ_ERROR_DEVICE, "press calibration failed");
+        }
+        return NIZ_OK;
+    });
+}
+
+auto niz_keymap_parse(const char* const text, const size_t size, const char* const path, niz_keymap** const keymap) -> niz_status {
+    return guard([&]() -> niz_status {
+        if((text == nullptr && size != 0) || keymap == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        // the diagnostics variant reports the errors through diagnostics, so that niz_last_error can tell them
+        auto diagnostics = std::vector<niz::Diagnostic>();
+        auto result      = niz::KeyMap::from_string(std::string_view(text, size), diagnostics, path);
+        if(!result) {
+            return fail_parse(diagnostics);
+        }
+        return finish_keymap(std::move(*result), keymap);
+    });
+}
+
+auto niz_keymap_load(const char* const path, niz_keymap** const keymap) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(path == nullptr || keymap == nullptr) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        const auto text = read_file(path);
+        if(!text) {
+            return fail(NIZ_ERROR_IO, build_string("can not read ", path));
+        }
+        return niz_keymap_parse(std::bit_cast<const char*>(text->data()), text->size(), path, keymap);
+    });
+}
+
+auto niz_keymap_free(niz_keymap* const keymap) -> void {
+    delete keymap;
+}
+
+auto niz_keymap_serialize(const niz_keymap* const keymap, char* const buf, const size_t size, size_t* const length) -> niz_status {
+    return guard([&]() -> niz_status {
+        if(keymap == nullptr || length == nullptr || (buf == nullptr && size != 0)) {
+            return fail(NIZ_ERROR_ARGUMENT, "null argument");
+        }
+        // one byte is kept for the null
+        *length = keymap->keymap.serialize(std::span(buf, size == 0 ? 0 : size - 1));
+        if(*length >= size) {
+            return fail(NIZ_ERROR_BUFFER_SIZE, build_string(*length + 1, " bytes do not fit in ", size));
+        }
+        buf[*length] = '\0';
+        return NIZ_OK;
+    });
+}
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NIZ_EXPORT __attribute__((visibility("default")))
+
+// bumped when a function changes incompatibly, functions are only added otherwise
+#define NIZ_ABI_VERSION 1
+
+typedef enum niz_status {
+    NIZ_OK = 0,
+    NIZ_ERROR_ARGUMENT,    // null handle or invalid value
+    NIZ_ERROR_IO,          // the device or a file can not be opened, read or written
+    NIZ_ERROR_DEVICE,      // the keyboard did not answer as expected
+    NIZ_ERROR_PARSE,       // invalid keymap text, see niz_last_error
+    NIZ_ERROR_ENCODE,      // the keymap does not fit in the packets of the keyboard
+    NIZ_ERROR_LAYOUT,      // the keymap is for another keyboard model
+    NIZ_ERROR_BUFFER_SIZE, // the output did not fit, the required size is returned
+    NIZ_ERROR_MEMORY,      // an allocation failed
+    NIZ_ERROR_INTERNAL,    // unexpected failure inside the library, see niz_last_error
+} niz_status;
+
+// opened keyboard, its version is read once when it is opened
+typedef struct niz_device niz_device;
+// parsed keymap with its macros optimized, as it is sent to the keyboard
+typedef struct niz_keymap niz_keymap;
+
+NIZ_EXPORT unsigned niz_abi_version(void);
+NIZ_EXPORT const char* niz_status_string(niz_status status);
+// message of the last failure on the calling thread, empty if there is none
+NIZ_EXPORT const char* niz_last_error(void);
+
+// receives progress and status messages, such as firmware progress and retries, nothing is printed by the library
+// process wide, set it before any device is opened, null removes it
+typedef void (*niz_message_callback)(void* data, const char* message);
+NIZ_EXPORT niz_status niz_set_message_callback(niz_message_callback callback, void* data);
+
+// path is a hidraw device file, e.g. /dev/hidraw0
+NIZ_EXPORT niz_status niz_device_open(const char* path, niz_device** device);
+NIZ_EXPORT void       niz_device_close(niz_device* device);
+// valid until the device is closed
+NIZ_EXPORT const char* niz_device_get_version(const niz_device* device);
+// hex digits of the serial number, valid until the device is closed
+NIZ_EXPORT niz_status niz_device_get_serial(niz_device* device, const char** serial);
+NIZ_EXPORT niz_status niz_device_read_keymap(niz_device* device, niz_keymap** keymap);
+NIZ_EXPORT niz_status niz_device_write_keymap(niz_device* device, const niz_keymap* keymap);
+// sends only the keys which differ from current, which the keyboard must hold
+NIZ_EXPORT niz_status niz_device_write_keymap_diff(niz_device* device, const niz_keymap* keymap, const niz_keymap* current);
+// count is set to the number of keys even if it exceeds capacity
+NIZ_EXPORT niz_status niz_device_read_counts(niz_device* device, uint32_t* counts, size_t capacity, size_t* count);
+NIZ_EXPORT niz_status niz_device_enable_keypress(niz_device* device, int enable);
+NIZ_EXPORT niz_status niz_device_flush_firmware(niz_device* device, const char* firmware_path);
+NIZ_EXPORT niz_status niz_device_initial_calibration(niz_device* device);
+NIZ_EXPORT niz_status niz_device_press_calibration(niz_device* device);
+
+// path is used for the includes of text and may be null, they are relative to the working directory then
+NIZ_EXPORT niz_status niz_keymap_parse(const char* text, size_t size, const char* path, niz_keymap** keymap);
+NIZ_EXPORT niz_status niz_keymap_load(const char* path, niz_keymap** keymap);
+NIZ_EXPORT void       niz_keymap_free(niz_keymap* keymap);
+// writes the keymap file text with a terminating null, length is set to its size without the null
+NIZ_EXPORT niz_status niz_keymap_serialize(const niz_keymap* keymap, char* buf, size_t size, size_t* length);
+
+#ifdef __cplusplus
+}
+#endif
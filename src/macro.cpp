@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include "codec.hpp"
+#include "common.hpp"
+#include "macro.hpp"
+#include "macros/unwrap.hpp"
+
+namespace niz::macro {
+namespace {
+using Event = func::RecordedDelayMacroSequence::Event;
+
+constexpr auto find_keycode(const std::string_view name) -> uint8_t {
+    for(auto i = 0u; i < keycodes.size(); i += 1) {
+        if(keycodes[i] == name) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+constexpr auto none_keycode = find_keycode("None");
+
+// keys whose release and press in the same instant make no difference to the host
+constexpr auto modifiers = std::array{
+    find_keycode("LeftShift"),
+    find_keycode("RightShift"),
+    find_keycode("LeftCtrl"),
+    find_keycode("RightCtrl"),
+    find_keycode("LeftAlt"),
+    find_keycode("RightAlt"),
+    find_keycode("LeftSuper"),
+    find_keycode("Right-Super"),
+};
+
+static_assert(none_keycode == 0);
+static_assert(std::ranges::find(modifiers, none_keycode) == modifiers.end(), "unknown modifier name");
+
+auto is_modifier(const uint8_t keycode) -> bool {
+    return std::ranges::find(modifiers, keycode) != modifiers.end();
+}
+
+auto to_events(const func::MacroSequence& sequence) -> std::vector<Event> {
+    auto events = std::vector<Event>();
+    switch(sequence.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>: {
+        const auto& fixed = sequence.as<func::AutoDelayMacroSequence>();
+        for(const auto keycode : fixed.keycodes) {
+            events.push_back({keycode, fixed.delay});
+        }
+    } break;
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>:
+        events = sequence.as<func::RecordedDelayMacroSequence>().events;
+        break;
+    }
+    return events;
+}
+
+// a fixed interval takes 1 byte per event instead of 4, so it is used whenever the delays allow
+auto from_events(std::vector<Event> events) -> func::MacroSequence {
+    auto       sequence = func::MacroSequence();
+    const auto uniform  = std::ranges::all_of(events, [&events](const Event& event) { return event.delay == events[0].delay; });
+    if(uniform) {
+        auto& fixed = sequence.emplace<func::AutoDelayMacroSequence>();
+        fixed.delay = events.empty() ? 0 : events[0].delay;
+        for(const auto& event : events) {
+            fixed.keycodes.push_back(event.keycode);
+        }
+    } else {
+        sequence.emplace<func::RecordedDelayMacroSequence>().events = std::move(events);
+    }
+    return sequence;
+}
+
+// returns false if the delay would overflow
+auto add_delay(Event& event, const uint16_t delay) -> bool {
+    if(event.delay + delay > 0xffff) {
+        return false;
+    }
+    event.delay += delay;
+    return true;
+}
+
+auto fold(const std::vector<Event>& events) -> std::vector<Event> {
+    auto folded  = std::vector<Event>();
+    auto pressed = std::array<bool, 256>();
+    for(const auto& event : events) {
+        if(event.keycode == none_keycode) {
+            if(folded.empty() || !add_delay(folded.back(), event.delay)) {
+                folded.push_back(event);
+            }
+            continue;
+        }
+        // the previous event released this modifier without waiting, drop the release and this press
+        const auto repress = !pressed[event.keycode] && is_modifier(event.keycode) &&
+                             folded.size() >= 2 && folded.back().keycode == event.keycode && folded.back().delay == 0;
+        if(repress && add_delay(folded[folded.size() - 2], event.delay)) {
+            folded.pop_back();
+            pressed[event.keycode] = true;
+            continue;
+        }
+        pressed[event.keycode] = !pressed[event.keycode];
+        folded.push_back(event);
+    }
+    return folded;
+}
+
+auto get_encoding_name(const func::MacroSequence& sequence) -> std::string {
+    switch(sequence.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>:
+        return build_string("fixed interval ", sequence.as<func::AutoDelayMacroSequence>().delay, "ms");
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>:
+        return "recorded delays";
+    }
+    return "unknown";
+}
+
+auto count_events(const func::MacroSequence& sequence) -> size_t {
+    switch(sequence.get_index()) {
+    case func::MacroSequence::index_of<func::AutoDelayMacroSequence>:
+        return sequence.as<func::AutoDelayMacroSequence>().keycodes.size();
+    case func::MacroSequence::index_of<func::RecordedDelayMacroSequence>:
+        return sequence.as<func::RecordedDelayMacroSequence>().events.size();
+    }
+    return 0;
+}
+
+auto describe_repeat(const func::MacroKeyFunction& macro, const uint32_t duration) -> std::string {
+    switch(macro.repeat) {
+    case func::MacroRepeat::Count:
+        return build_string("runs it ", int(macro.repeat_count), macro.repeat_count == 1 ? " time: " : " times: ", uint64_t(duration) * macro.repeat_count, "ms");
+    case func::MacroRepeat::Hold:
+        return build_string("runs it while held: ", duration, "ms per run");
+    case func::MacroRepeat::Toggle:
+        return build_string("runs it until pressed again: ", duration, "ms per run");
+    }
+    return "";
+}
+} // namespace
+
+auto simulate(const func::MacroSequence& sequence) -> Simulation {
+    auto simulation = Simulation();
+    auto pressed    = std::array<bool, 256>();
+    for(const auto& event : to_events(sequence)) {
+        if(event.keycode != none_keycode) {
+            pressed[event.keycode] = !pressed[event.keycode];
+            simulation.timeline.push_back({simulation.duration, event.keycode, pressed[event.keycode]});
+        }
+        simulation.duration += event.delay;
+    }
+    return simulation;
+}
+
+auto get_smallest(const func::MacroSequence& sequence) -> func::MacroSequence {
+    auto optimized = from_events(fold(to_events(sequence)));
+    if(codec::get_sequence_size(optimized) <= codec::get_sequence_size(sequence)) {
+        return optimized;
+    }
+    return sequence;
+}
+
+auto optimize(const func::MacroSequence& sequence) -> std::optional<func::MacroSequence> {
+    constexpr auto limit = CompactKeyMap::max_payload_size;
+
+    auto       smallest = get_smallest(sequence);
+    const auto size     = codec::get_sequence_size(smallest);
+    ensure(size <= limit, count_events(smallest), " events take ", size, " bytes, the limit is ", limit);
+    return smallest;
+}
+
+auto optimize(KeyMap& keymap) -> bool {
+    auto optimized = std::unordered_map<const func::MacroSequence*, std::shared_ptr<const func::MacroSequence>>();
+    for(auto layer = 0u; layer < keymap.functions.size(); layer += 1) {
+        for(auto pos = 0u; pos < keymap.functions[layer].size(); pos += 1) {
+            auto& function = keymap.functions[layer][pos];
+            if(function.get_index() != func::KeyFunction::index_of<func::MacroKeyFunction>) {
+                continue;
+            }
+            auto& macro         = function.as<func::MacroKeyFunction>();
+            auto [it, inserted] = optimized.try_emplace(macro.sequence.get());
+            if(inserted) {
+                auto sequence = optimize(*macro.sequence);
+                ensure(sequence, "macro of ", layer_names[layer], " ", pos, " does not fit in a packet");
+                it->second = std::make_shared<const func::MacroSequence>(std::move(*sequence));
+            }
+            macro.sequence = it->second;
+        }
+    }
+    return true;
+}
+
+auto describe(const KeyMap& keymap) -> std::string {
+    // sequences in the order of their first key, with the keys which run them
+    struct Users {
+        const func::MacroSequence* sequence;
+        std::vector<std::string>   keys;
+    };
+    auto macros  = std::vector<Users>();
+    auto indices = std::unordered_map<const func::MacroSequence*, size_t>();
+    for(auto layer = 0u; layer < keymap.functions.size(); layer += 1) {
+        for(auto pos = 0u; pos < keymap.functions[layer].size(); pos += 1) {
+            const auto& function = keymap.functions[layer][pos];
+            if(function.get_index() != func::KeyFunction::index_of<func::MacroKeyFunction>) {
+                continue;
+            }
+            const auto& macro         = function.as<func::MacroKeyFunction>();
+            const auto [it, inserted] = indices.try_emplace(macro.sequence.get(), macros.size());
+            if(inserted) {
+                macros.push_back({macro.sequence.get(), {}});
+            }
+            const auto duration = simulate(*macro.sequence).duration;
+            macros[it->second].keys.emplace_back(build_string(layer_names[layer], " ", pos, " ", describe_repeat(macro, duration)));
+        }
+    }
+
+    auto text = std::string();
+    for(auto i = 0u; i < macros.size(); i += 1) {
+        const auto& sequence   = *macros[i].sequence;
+        const auto  simulation = simulate(sequence);
+        text += build_string("macro", i + 1, ": ", get_encoding_name(sequence), ", ", count_events(sequence), " events, ",
+                             codec::get_sequence_size(sequence), " of ", CompactKeyMap::max_payload_size, " bytes, ", simulation.duration, "ms per run\n");
+        for(const auto& key : macros[i].keys) {
+            text += build_string("    ", key, "\n");
+        }
+        const auto smallest = get_smallest(sequence);
+        const auto size     = codec::get_sequence_size(smallest);
+        if(size < codec::get_sequence_size(sequence)) {
+            text += build_string("    optimized: ", get_encoding_name(smallest), ", ", count_events(smallest), " events, ", size, " bytes\n");
+        }
+        if(size > CompactKeyMap::max_payload_size) {
+            text += "    does not fit in a packet\n";
+        }
+        for(const auto& event : simulation.timeline) {
+            text += build_string("    ", event.time, "ms ", event.press ? "press " : "release ", keycodes[event.keycode], "\n");
+        }
+        text += build_string("    ", simulation.duration, "ms end\n");
+    }
+    return text;
+}
+} // namespace niz::macro
@@ -0,0 +1,36 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "niz.hpp"
+
+namespace niz::macro {
+// each event of a sequence toggles its key, the first one presses it
+struct TimelineEvent {
+    uint32_t time; // milliseconds from the start of the run
+    uint8_t  keycode;
+    bool     press;
+};
+
+struct Simulation {
+    std::vector<TimelineEvent> timeline;
+    // milliseconds of one run, including the delay after the last event
+    uint32_t duration = 0;
+};
+
+// None events only wait, they are not in the timeline
+auto simulate(const func::MacroSequence& sequence) -> Simulation;
+
+// returns the equivalent sequence which takes the fewest bytes in a KeyData packet, whether or not it fits
+// delays of None events are merged into the previous event, modifiers which are released and pressed again at once are kept pressed
+// and the events are stored with a fixed interval if every delay is the same
+auto get_smallest(const func::MacroSequence& sequence) -> func::MacroSequence;
+// get_smallest, returns nullopt if it does not fit in a packet
+auto optimize(const func::MacroSequence& sequence) -> std::optional<func::MacroSequence>;
+// optimizes the macros of every key, keys which shared a sequence keep sharing the optimized one
+auto optimize(KeyMap& keymap) -> bool;
+
+// text report of the macros in keymap: size, duration of each repeat mode and the event timeline
+auto describe(const KeyMap& keymap) -> std::string;
+} // namespace niz::macro
@@ -1,17 +1,74 @@
 #include <fcntl.h>
 
+#include "cache.hpp"
+#include "check.hpp"
+#include "common.hpp"
+#include "fleet.hpp"
+#include "image.hpp"
+#include "layout.hpp"
+#include "macro.hpp"
 #include "macros/unwrap.hpp"
+#include "mapped-file.hpp"
 #include "niz.hpp"
+#include "sampler.hpp"
+#include "server.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "util/charconv.hpp"
 #include "util/fd.hpp"
 #include "util/file-io.hpp"
+#include "watch.hpp"
 
 namespace {
 auto usage = R"(Read/Write Keymap from/to keyboard
     niz-kbd-util read-keymap DEVICE CONFIG
-    niz-kbd-util write-keymap DEVICE CONFIG
+    niz-kbd-util write-keymap DEVICE CONFIG|IMAGE
+    niz-kbd-util write-keymap-diff DEVICE CONFIG [BASE]
 
     DEVICE: hidraw device file(e.g. /dev/hidraw0)
+            write-keymap, flush-firmware, print-keycounts and calibration
+            also accept "all", which runs on every connected keyboard at once
     CONFIG: keymap file(.niz)
+    IMAGE: compiled keymap file(.nizb), sent without parsing
+    BASE: keymap file(.niz) known to be on the keyboard
+          only keys that differ from BASE are sent, every key if the keyboard did not keep the others
+          if omitted, the current keymap is read from the keyboard
+
+
+Write keymap to every keyboard as soon as it is connected
+    niz-kbd-util watch CONFIG|IMAGE [DEV_DIR SYS_DIR]
+
+    DEV_DIR: directory of the device files, "/dev" if omitted
+    SYS_DIR: hidraw class directory, "/sys/class/hidraw" if omitted
+    runs until interrupted, the time from connection to applied keymap is logged
+
+
+Serve requests over a unix socket, keeping the device open
+    niz-kbd-util daemon DEVICE SOCKET
+    niz-kbd-util client SOCKET version|print-keycounts|stop
+    niz-kbd-util client SOCKET read-keymap|write-keymap|write-keymap-diff CONFIG
+    niz-kbd-util client SOCKET enable-keypress|disable-keypress|initial-calib|press-calib
+
+    SOCKET: path of the socket
+    the daemon caches the version and the keymap, write-keymap-diff is relative to the cached keymap
+
+
+Compile keymap into an image, or turn an image back into a keymap
+    niz-kbd-util compile-keymap CONFIG IMAGE
+    niz-kbd-util decompile-keymap IMAGE CONFIG
+
+
+Check keymap files without a keyboard
+    niz-kbd-util check CONFIG|DIR...
+
+    DIR: directory which is searched for .niz files recursively
+    files are checked in parallel, every problem is printed as "FILE:LINE:COLUMN: error|warning: MESSAGE"
+
+
+Print the size, run time and event timeline of each macro
+    niz-kbd-util simulate-macros CONFIG
+
+    macros are optimized before they are sent, the smaller form is printed if there is one
 
 
 Flush firmware
@@ -24,6 +81,18 @@ Print Keycounts
     niz-kbd-util print-keycounts DEVICE
 
 
+Record keycounts over time
+    niz-kbd-util sample-keycounts DEVICE OUTPUT [INTERVAL [BATCH]]
+
+    OUTPUT: file which the changes of the counts are appended to
+    INTERVAL: sampling interval in milliseconds, 1000 if omitted
+    BATCH: number of samples written at once, 60 if omitted
+
+
+Print a trace
+    niz-kbd-util print-trace FILE
+
+
 Enable/Disable keypress for calibration
     niz-kbd-util enable-keypress DEVICE
     niz-kbd-util disable-keypress DEVICE
@@ -34,13 +103,288 @@ Calibration
     niz-kbd-util press-calib DEVICE
 
 
+Options, given before the action
+    --report-timeout MS: time to wait for each report, 1000 if omitted
+    --session-timeout MS: time to wait for a whole response, 10000 if omitted
+    --calib-timeout MS: time to wait for the end of a calibration, 600000 if omitted
+    --retries N: repeats of a failed read-only request, 2 if omitted
+    --trace FILE: record every report sent and received into FILE
+    --replay FILE: answer with the responses recorded in FILE instead of DEVICE, which is not opened
+    --replay-timed FILE: like --replay, and respond as late as the device did
+    --stats text|json: print packet counts and latencies by operation to stderr at exit
+    --stats-file FILE: write the stats of --stats into FILE instead of stderr
+    --no-cache: always write the keymap, even if the keyboard has it already
+    --cached: read the keymap, or the base of write-keymap-diff, from the cache of the last known keymap
+    --verify: read the keymap back after write-keymap-diff, and write every key if the keyboard lost the unchanged ones
+
+
 Print this help
     niz-kbd-util help
     niz-kbd-util -h
     niz-kbd-util --help)";
+
+struct Options {
+    const char*      trace        = nullptr;
+    const char*      replay       = nullptr;
+    bool             replay_timed = false;
+    std::string_view stats;                // "text" or "json"
+    const char*      stats_file = nullptr; // stderr if null
+    bool             cache      = true;    // skip writes of the keymap which is on the keyboard already
+    bool             cached     = false;   // read the keymap from the cache instead of the keyboard
+    bool             verify     = false;   // read the keymap back after writing the changed keys
+};
+
+// prints the stats however main returns
+// stdout has the output of the action, so that the stats go to stderr or a file
+struct StatsPrinter {
+    std::string_view format;
+    const char*      path;
+
+    ~StatsPrinter() {
+        if(format.empty()) {
+            return;
+        }
+        const auto out = path != nullptr ? fopen(path, "w") : stderr;
+        if(out == nullptr) {
+            warn("can not write ", path, ": ", strerror(errno));
+            return;
+        }
+        if(format == "json") {
+            niz::stats::print_json(out);
+        } else if(format == "text") {
+            niz::stats::print_summary(out);
+        }
+        if(out != stderr) {
+            fclose(out);
+        }
+    }
+};
+
+// parses the options before the action
+// returns the number of arguments taken
+auto parse_options(const int argc, const char* const argv[], Options& options) -> std::optional<int> {
+    auto deadlines = niz::get_deadlines();
+    auto i         = 1;
+    for(; i < argc && std::string_view(argv[i]).starts_with("--") && std::string_view(argv[i]) != "--help"; i += 2) {
+        const auto option = std::string_view(argv[i]);
+        // flags without value
+        if(option == "--no-cache") {
+            options.cache = false;
+            i -= 1;
+            continue;
+        } else if(option == "--cached") {
+            options.cached = true;
+            i -= 1;
+            continue;
+        } else if(option == "--verify") {
+            options.verify = true;
+            i -= 1;
+            continue;
+        }
+        ensure(i + 1 < argc, "missing value of ", option);
+        const auto arg = argv[i + 1];
+        if(option == "--trace") {
+            options.trace = arg;
+            continue;
+        } else if(option == "--replay" || option == "--replay-timed") {
+            options.replay       = arg;
+            options.replay_timed = option == "--replay-timed";
+            continue;
+        } else if(option == "--stats") {
+            options.stats = arg;
+            ensure(options.stats == "text" || options.stats == "json", "--stats takes text or json");
+            continue;
+        } else if(option == "--stats-file") {
+            options.stats_file = arg;
+            continue;
+        }
+        unwrap(value, from_chars<int>(arg));
+        ensure(value >= 0, "negative value of ", option);
+        if(option == "--report-timeout") {
+            deadlines.report = std::chrono::milliseconds(value);
+        } else if(option == "--session-timeout") {
+            deadlines.session = std::chrono::milliseconds(value);
+        } else if(option == "--calib-timeout") {
+            deadlines.calibration = std::chrono::milliseconds(value);
+        } else if(option == "--retries") {
+            deadlines.retries = value;
+        } else {
+            bail("unknown option ", option);
+        }
+    }
+    niz::set_deadlines(deadlines);
+    return i - 1;
+}
+
+// keyboards are handled in parallel, most of the time is spent waiting for the devices
+constexpr auto max_fleet_workers = size_t(16);
+
+// parses a keymap file and optimizes its macros, as every keymap is before it is sent
+auto load_keymap(const char* const path) -> std::optional<niz::KeyMap> {
+    unwrap_mut(keymap, niz::KeyMap::from_file(path));
+    ensure(niz::macro::optimize(keymap));
+    return std::move(keymap);
+}
+
+// a keymap as it is sent to the keyboard
+struct KeymapSource {
+    std::optional<niz::MappedFile> image;
+    std::vector<niz::Report>       storage; // reports of a text keymap
+    std::span<const niz::Report>   reports;
+    uint64_t                       hash = 0;
+    std::string                    text;             // normalized keymap for the cache
+    const niz::layout::Layout*     layout = nullptr; // model which the keymap is written for
+
+    // entry is the cache entry of the keyboard, if the cache is used
+    auto write(const int fd, const std::string& version, const std::optional<niz::cache::Entry>& entry, const bool use_cache, std::string& output) const -> bool {
+        ensure(niz::layout::check_version(layout, version));
+        if(!use_cache) {
+            return niz::write_reports(fd, reports);
+        }
+        return niz::cache::write_if_changed(fd, entry, reports, hash, text, output);
+    }
+};
+
+// loads a keymap or an image once, so that it can be shared by every worker
+auto load_keymap_source(const char* const path, const bool use_cache) -> std::optional<std::shared_ptr<const KeymapSource>> {
+    auto source = std::make_shared<KeymapSource>();
+    if(niz::image::is_image_path(path)) {
+        source->image = niz::MappedFile::open(path);
+        ensure(source->image);
+        unwrap(reports, niz::image::get_reports(source->image->get_data()));
+        source->reports = reports;
+        if(use_cache) {
+            unwrap(keymap, niz::image::decompile(source->image->get_data()));
+            source->text = keymap.to_string();
+        }
+    } else {
+        unwrap(keymap, load_keymap(path));
+        unwrap(compact, niz::CompactKeyMap::from_keymap(keymap));
+        source->layout = keymap.layout;
+        source->storage = compact.make_reports();
+        source->reports = source->storage;
+        if(use_cache) {
+            unwrap(normalized, compact.to_keymap());
+            source->text = normalized.to_string();
+        }
+    }
+    source->hash = niz::hash_reports(source->reports);
+    return std::shared_ptr<const KeymapSource>(std::move(source));
+}
+
+// writes the keymap to every keyboard which it is run on, each opens its own cache entry
+auto make_write_keymap_job(const char* const path, const bool use_cache) -> std::optional<niz::fleet::Job> {
+    unwrap_mut(source, load_keymap_source(path, use_cache));
+    return [source = std::move(source), use_cache](const int fd, const std::string& version, std::string& output) -> bool {
+        const auto entry = use_cache ? niz::cache::open_device(fd, version) : std::nullopt;
+        return source->write(fd, version, entry, use_cache, output);
+    };
+}
+
+auto run_client(const int argc, const char* const argv[]) -> bool {
+    ensure(argc == 4 || argc == 5);
+    const auto action = std::string_view(argv[3]);
+    const auto fd     = niz::server::connect(argv[2]);
+    ensure(fd.as_handle() >= 0, "can not connect to ", argv[2], ": ", strerror(errno));
+
+    if(action == "read-keymap") {
+        ensure(argc == 5);
+        unwrap(keymap_txt, niz::server::request(fd.as_handle(), niz::server::Command::ReadKeymap));
+        const auto conf = FileDescriptor(open(argv[4], O_RDWR | O_CREAT | O_TRUNC, 0644));
+        ensure(conf.as_handle() >= 0, strerror(errno));
+        ensure(conf.write(keymap_txt.data(), keymap_txt.size()));
+        return true;
+    } else if(action == "write-keymap" || action == "write-keymap-diff") {
+        ensure(argc == 5);
+        unwrap(keymap_txt, read_file(argv[4]));
+        const auto command = action == "write-keymap" ? niz::server::Command::WriteKeymap : niz::server::Command::WriteKeymapDiff;
+        return niz::server::request(fd.as_handle(), command, std::string_view((char*)keymap_txt.data(), keymap_txt.size())).has_value();
+    }
+
+    ensure(argc == 4);
+    auto command = uint8_t();
+    if(action == "version") {
+        command = niz::server::Command::Version;
+    } else if(action == "print-keycounts") {
+        command = niz::server::Command::ReadCounts;
+    } else if(action == "enable-keypress") {
+        command = niz::server::Command::EnableKeypress;
+    } else if(action == "disable-keypress") {
+        command = niz::server::Command::DisableKeypress;
+    } else if(action == "initial-calib") {
+        command = niz::server::Command::InitialCalib;
+    } else if(action == "press-calib") {
+        command = niz::server::Command::PressCalib;
+    } else if(action == "stop") {
+        command = niz::server::Command::Stop;
+    } else {
+        bail("unknown action");
+    }
+    unwrap(response, niz::server::request(fd.as_handle(), command));
+    if(!response.empty()) {
+        print(response);
+    }
+    return true;
+}
+
+auto run_fleet(const std::string_view action, const int argc, const char* const argv[], const Options& options) -> bool {
+    auto job = niz::fleet::Job();
+    if(action == "write-keymap") {
+        ensure(argc == 4);
+        unwrap_mut(write_job, make_write_keymap_job(argv[3], options.cache));
+        job = std::move(write_job);
+    } else if(action == "flush-firmware") {
+        ensure(argc == 4);
+        // validated once, every worker sends the same mapping
+        unwrap_mut(image, niz::FirmwareImage::open(argv[3]));
+        job = [image = std::make_shared<const niz::FirmwareImage>(std::move(image))](const int fd, const std::string&, std::string&) -> bool {
+            return niz::flush_firmware(fd, *image);
+        };
+    } else if(action == "print-keycounts") {
+        ensure(argc == 3);
+        job = [](const int fd, const std::string&, std::string& output) -> bool {
+            unwrap(counts, niz::read_counts(fd));
+            for(const auto c : counts) {
+                output += build_string(c, " ");
+            }
+            return true;
+        };
+    } else if(action == "initial-calib") {
+        ensure(argc == 3);
+        job = [](const int fd, const std::string&, std::string&) -> bool { return niz::do_initial_calibration(fd); };
+    } else if(action == "press-calib") {
+        ensure(argc == 3);
+        job = [](const int fd, const std::string&, std::string&) -> bool { return niz::do_press_calibration(fd); };
+    } else {
+        bail(action, " can not run on all devices");
+    }
+
+    const auto devices = niz::fleet::find_devices();
+    ensure(!devices.empty(), "no keyboard found");
+    print("running ", action, " on ", devices.size(), " keyboards");
+    return niz::fleet::print_summary(niz::fleet::run(devices, job, max_fleet_workers));
+}
 } // namespace
 
-auto main(const int argc, const char* const argv[]) -> int {
+auto main(int argc, const char* const argv[]) -> int {
+    auto options = Options();
+    unwrap(options_count, parse_options(argc, argv, options));
+    // the action becomes argv[1], argv[0] is not used
+    argc -= options_count;
+    argv += options_count;
+    // progress of the library, flushed at once so that it can be followed through a pipe
+    niz::set_message_handler([](const std::string_view text, niz::MessageKind /*kind*/) {
+        printf("%.*s\n", int(text.size()), text.data());
+        fflush(stdout);
+    });
+    if(options.trace != nullptr) {
+        ensure(niz::trace::start(options.trace));
+    }
+    if(!options.stats.empty()) {
+        niz::stats::enable();
+    }
+    const auto stats_printer = StatsPrinter{options.stats, options.stats_file};
+
     if(argc < 2) {
         print(usage);
         return 0;
@@ -51,29 +395,145 @@ auto main(const int argc, const char* const argv[]) -> int {
         return 0;
     }
 
+    // actions without device
+    if(action == "compile-keymap") {
+        ensure(argc == 4);
+        unwrap(keymap, load_keymap(argv[2]));
+        unwrap(image, niz::image::compile(keymap));
+        const auto out = FileDescriptor(open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644));
+        ensure(out.as_handle() >= 0, strerror(errno));
+        ensure(out.write(image.data(), image.size()));
+        print("done");
+        return 0;
+    } else if(action == "check") {
+        ensure(argc >= 3);
+        auto       errors = std::vector<niz::check::FileResult>();
+        const auto files  = niz::check::find_files(std::span(argv + 2, argc - 2), errors);
+        ensure(!files.empty() || !errors.empty(), "no keymap file found");
+        auto results = niz::check::run(files);
+        for(auto& error : errors) {
+            results.push_back(std::move(error));
+        }
+        return niz::check::print_report(results) ? 0 : 1;
+    } else if(action == "simulate-macros") {
+        ensure(argc == 3);
+        unwrap(keymap, niz::KeyMap::from_file(argv[2]));
+        printf("%s", niz::macro::describe(keymap).data());
+        return 0;
+    } else if(action == "decompile-keymap") {
+        ensure(argc == 4);
+        unwrap(image, niz::MappedFile::open(argv[2]));
+        unwrap(keymap, niz::image::decompile(image.get_data()));
+        const auto out = FileDescriptor(open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644));
+        ensure(out.as_handle() >= 0, strerror(errno));
+        ensure(keymap.write_to_file(out.as_handle()));
+        print("done");
+        return 0;
+    } else if(action == "client") {
+        return run_client(argc, argv) ? 0 : 1;
+    } else if(action == "watch") {
+        ensure(argc == 3 || argc == 5);
+        unwrap_mut(job, make_write_keymap_job(argv[2], options.cache));
+        auto watch_options = niz::watch::Options();
+        if(argc == 5) {
+            watch_options.dev_dir = argv[3];
+            watch_options.sys_dir = argv[4];
+        }
+        return niz::watch::run(watch_options, job) ? 0 : 1;
+    } else if(action == "print-trace") {
+        ensure(argc == 3);
+        unwrap(records, niz::trace::load(argv[2]));
+        niz::trace::dump(records);
+        return 0;
+    }
+
     ensure(argc >= 3);
 
-    const auto fd = FileDescriptor(open(argv[2], O_RDWR));
+    if(std::string_view(argv[2]) == "all") {
+        ensure(options.replay == nullptr, "a replay has only one device");
+        return run_fleet(action, argc, argv, options) ? 0 : 1;
+    }
+
+    // the recorded session stands in for the device
+    auto replayer = niz::trace::Replayer();
+    if(options.replay != nullptr) {
+        unwrap_mut(records, niz::trace::load(options.replay));
+        ensure(replayer.start(std::move(records), options.replay_timed));
+    }
+
+    // every wait for the device goes through poll with a deadline
+    const auto fd = FileDescriptor(options.replay != nullptr ? dup(replayer.get_fd()) : open(argv[2], O_RDWR));
     ensure(fd.as_handle() >= 0, strerror(errno));
+    ensure(fcntl(fd.as_handle(), F_SETFL, O_NONBLOCK) == 0, strerror(errno));
 
     unwrap(version, niz::get_version(fd.as_handle()));
     print("version: ", version);
 
+    // only keymap actions use the cache, the other actions do not pay for reading the serial
+    const auto keymap_action = action == "read-keymap" || action == "write-keymap" || action == "write-keymap-diff";
+    const auto cache_entry   = options.cache && keymap_action ? niz::cache::open_device(fd.as_handle(), version) : std::nullopt;
     if(action == "read-keymap") {
         ensure(argc == 4);
-        auto conf = FileDescriptor(open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644));
-        ensure(conf.as_handle() >= 0);
-        unwrap(keymap, niz::KeyMap::from_keyboard(fd.as_handle()));
-        const auto keymap_str = keymap.to_string();
-        ensure(conf.write(keymap_str.data(), keymap_str.size()));
+        auto text = std::optional<std::string>();
+        if(cache_entry && options.cached) {
+            text = cache_entry->read_keymap();
+        }
+        if(text) {
+            print("keymap read from cache");
+        } else {
+            unwrap(compact, niz::CompactKeyMap::from_keyboard(fd.as_handle()));
+            unwrap_mut(keymap, compact.to_keymap());
+            keymap.set_layout_for(version);
+            text = keymap.to_string();
+            if(cache_entry) {
+                cache_entry->store(compact.get_hash(), *text);
+            }
+        }
+        const auto conf = FileDescriptor(open(argv[3], O_RDWR | O_CREAT | O_TRUNC, 0644));
+        ensure(conf.as_handle() >= 0, strerror(errno));
+        ensure(conf.write(text->data(), text->size()));
     } else if(action == "write-keymap") {
         ensure(argc == 4);
-        unwrap(keymap_txt, read_file(argv[3]));
-        unwrap(keymap, niz::KeyMap::from_string(std::string_view((char*)keymap_txt.data(), keymap_txt.size())));
-        ensure(keymap.write_to_keyboard(fd.as_handle()));
+        unwrap(source, load_keymap_source(argv[3], cache_entry.has_value()));
+        auto       output = std::string();
+        const auto ok     = source->write(fd.as_handle(), version, cache_entry, cache_entry.has_value(), output);
+        if(!output.empty()) {
+            print(output);
+        }
+        ensure(ok);
+    } else if(action == "write-keymap-diff") {
+        ensure(argc == 4 || argc == 5);
+        unwrap(keymap, load_keymap(argv[3]));
+        ensure(niz::layout::check_version(keymap.layout, version));
+        unwrap(compact, niz::CompactKeyMap::from_keymap(keymap));
+        // both sides are compared in wire format, the keymap of the keyboard is never decoded
+        auto current = std::optional<niz::CompactKeyMap>();
+        if(argc == 5) {
+            // the keyboard holds the optimized form of the base
+            unwrap(base, load_keymap(argv[4]));
+            current = niz::CompactKeyMap::from_keymap(base);
+        } else if(const auto cached = cache_entry && options.cached ? cache_entry->read_keymap() : std::nullopt) {
+            print("base keymap read from cache");
+            unwrap(base, niz::KeyMap::from_string(*cached));
+            current = niz::CompactKeyMap::from_keymap(base);
+        } else {
+            current = niz::CompactKeyMap::from_keyboard(fd.as_handle());
+        }
+        ensure(current);
+        if(cache_entry) {
+            cache_entry->invalidate();
+        }
+        ensure(compact.write_diff_to_keyboard(fd.as_handle(), *current, options.verify));
+        if(cache_entry) {
+            unwrap(normalized, compact.to_keymap());
+            cache_entry->store(compact.get_hash(), normalized.to_string());
+        }
     } else if(action == "flush-firmware") {
         ensure(argc == 4);
         ensure(niz::flush_firmware(fd.as_handle(), argv[3]));
+    } else if(action == "daemon") {
+        ensure(argc == 4);
+        ensure(niz::server::serve(fd.as_handle(), version, argv[3]));
     } else if(action == "print-keycounts") {
         ensure(argc == 3);
         unwrap(counts, niz::read_counts(fd.as_handle()));
@@ -81,6 +541,20 @@ auto main(const int argc, const char* const argv[]) -> int {
             printf("%u ", c);
         }
         printf("\n");
+    } else if(action == "sample-keycounts") {
+        ensure(argc >= 4 && argc <= 6);
+        auto sample_options = niz::sampler::Options();
+        if(argc >= 5) {
+            unwrap(interval, from_chars<int>(argv[4]));
+            sample_options.interval = std::chrono::milliseconds(interval);
+        }
+        if(argc >= 6) {
+            unwrap(batch_size, from_chars<size_t>(argv[5]));
+            sample_options.batch_size = batch_size;
+        }
+        const auto out = FileDescriptor(open(argv[3], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+        ensure(out.as_handle() >= 0, strerror(errno));
+        ensure(niz::sampler::run(fd.as_handle(), out.as_handle(), sample_options));
     } else if(action == "enable-keypress") {
         ensure(argc == 3);
         ensure(niz::enable_keypress(fd.as_handle(), true));
@@ -97,6 +571,10 @@ auto main(const int argc, const char* const argv[]) -> int {
         bail("unknown action");
     }
 
+    if(options.replay != nullptr) {
+        ensure(replayer.mismatches == 0, replayer.mismatches.load(), " reports differ from the trace");
+    }
     print("done");
     return 0;
 }
+
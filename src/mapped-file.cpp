@@ -0,0 +1,50 @@
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "macros/assert.hpp"
+#include "mapped-file.hpp"
+#include "util/fd.hpp"
+
+namespace niz {
+auto MappedFile::get_data() const -> std::span<const uint8_t> {
+    return {ptr, size};
+}
+
+auto MappedFile::open(const char* const path) -> std::optional<MappedFile> {
+    const auto fd = FileDescriptor(::open(path, O_RDONLY | O_CLOEXEC));
+    ensure(fd.as_handle() >= 0, path, ": ", strerror(errno));
+    struct stat st = {};
+    ensure(fstat(fd.as_handle(), &st) == 0, strerror(errno));
+
+    auto file = MappedFile();
+    if(st.st_size == 0) {
+        return file; // mmap rejects empty mappings
+    }
+    const auto ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.as_handle(), 0);
+    ensure(ptr != MAP_FAILED, strerror(errno));
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+    file.ptr  = std::bit_cast<const uint8_t*>(ptr);
+    file.size = st.st_size;
+    return file;
+}
+
+MappedFile::MappedFile(MappedFile&& o)
+    : ptr(std::exchange(o.ptr, nullptr)),
+      size(std::exchange(o.size, 0)) {
+}
+
+auto MappedFile::operator=(MappedFile&& o) -> MappedFile& {
+    std::swap(ptr, o.ptr);
+    std::swap(size, o.size);
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    if(ptr != nullptr) {
+        munmap(const_cast<uint8_t*>(ptr), size);
+    }
+}
+} // namespace niz
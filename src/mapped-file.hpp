@@ -0,0 +1,22 @@
+#pragma once
+#include <optional>
+#include <span>
+
+namespace niz {
+// read-only mapping of a whole file
+class MappedFile {
+  private:
+    const uint8_t* ptr  = nullptr;
+    size_t         size = 0;
+
+  public:
+    auto get_data() const -> std::span<const uint8_t>;
+
+    static auto open(const char* path) -> std::optional<MappedFile>;
+
+    MappedFile() = default;
+    MappedFile(MappedFile&& o);
+    auto operator=(MappedFile&& o) -> MappedFile&;
+    ~MappedFile();
+};
+} // namespace niz
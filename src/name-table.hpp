@@ -0,0 +1,49 @@
+#pragma once
+#include <array>
+#include <optional>
+#include <string_view>
+
+namespace niz {
+constexpr auto hash_name(const std::string_view str) -> uint32_t {
+    // fnv-1a
+    auto hash = uint32_t(2166136261u);
+    for(const auto c : str) {
+        hash = (hash ^ uint8_t(c)) * 16777619u;
+    }
+    return hash;
+}
+
+// open addressing hash table from names to indices, built at compile time
+// slots hold index + 1, 0 marks an empty slot
+// only the first of duplicated names is registered
+template <size_t names_count, size_t slots_count>
+struct NameTable {
+    static_assert((slots_count & (slots_count - 1)) == 0, "slots_count must be a power of 2");
+    static_assert(slots_count >= names_count * 2, "keep the load factor at most 0.5");
+
+    std::array<std::string_view, names_count> names;
+    std::array<uint16_t, slots_count>         slots = {};
+
+    constexpr NameTable(const std::array<std::string_view, names_count>& names)
+        : names(names) {
+        for(auto i = 0u; i < names_count; i += 1) {
+            auto slot = hash_name(names[i]) & (slots_count - 1);
+            while(slots[slot] != 0 && names[slots[slot] - 1] != names[i]) {
+                slot = (slot + 1) & (slots_count - 1);
+            }
+            if(slots[slot] == 0) {
+                slots[slot] = i + 1;
+            }
+        }
+    }
+
+    constexpr auto find(const std::string_view str) const -> std::optional<uint8_t> {
+        for(auto slot = hash_name(str) & (slots_count - 1); slots[slot] != 0; slot = (slot + 1) & (slots_count - 1)) {
+            if(names[slots[slot] - 1] == str) {
+                return slots[slot] - 1;
+            }
+        }
+        return std::nullopt;
+    }
+};
+} // namespace niz
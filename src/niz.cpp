@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <chrono>
+
 #include <unistd.h>
 
 #include "common.hpp"
@@ -5,10 +8,50 @@
 #include "niz.hpp"
 
 namespace niz {
+namespace {
+constexpr auto serial_timeout = std::chrono::milliseconds(200);
+
+auto read_serial(const int fd, const Deadlines& deadlines) -> std::optional<std::string> {
+    // [unknown1, type, serial...], the serial is padded with zeros
+    auto buf = std::array<uint8_t, 64>();
+    ensure(send_packet(fd, PacketType::ReadSerial, {}));
+    ensure(read_report(fd, PacketType::ReadSerial, buf, deadlines) > 0);
+    ensure(buf[1] == PacketType::ReadSerial, "unexpected response ", get_packet_name(buf[1]));
+
+    auto end = buf.size();
+    while(end > 2 && buf[end - 1] == 0) {
+        end -= 1;
+    }
+    ensure(end > 2, "empty serial");
+    auto serial = std::string();
+    for(const auto byte : std::span(buf).subspan(2, end - 2)) {
+        constexpr auto digits = std::string_view("0123456789abcdef");
+        serial += digits[byte >> 4];
+        serial += digits[byte & 0x0f];
+    }
+    return serial;
+}
+} // namespace
+
 auto get_version(int fd) -> std::optional<std::string> {
-    auto buf = std::array<char, 64>();
-    ensure(send_packet(fd, PacketType::Version, {}));
-    ensure(read(fd, buf.data(), buf.size()) > 0);
-    return buf.data() + 1;
+    return retry(fd, PacketType::Version, [fd]() -> std::optional<std::string> {
+        auto buf = std::array<uint8_t, 64>();
+        ensure(send_packet(fd, PacketType::Version, {}));
+        ensure(read_report(fd, PacketType::Version, buf) > 0);
+        buf.back() = 0;
+        return std::bit_cast<const char*>(buf.data()) + 1;
+    });
+}
+
+auto get_serial(const int fd) -> std::optional<std::string> {
+    // boards which do not know ReadSerial stay silent, so it is asked once with a short deadline instead of retried
+    auto deadlines   = get_deadlines();
+    deadlines.report = std::min(deadlines.report, serial_timeout);
+    if(auto serial = read_serial(fd, deadlines)) {
+        return serial;
+    }
+    // a late answer must not be taken as the response to the next request
+    prepare_retry(fd, PacketType::ReadSerial, deadlines.retries);
+    return std::nullopt;
 }
 } // namespace niz
@@ -1,10 +1,19 @@
 #pragma once
+#include <array>
+#include <memory>
 #include <optional>
+#include <span>
+#include <string>
 #include <vector>
 
+#include "mapped-file.hpp"
 #include "util/variant.hpp"
 
 namespace niz {
+namespace layout {
+struct Layout;
+}
+
 namespace func {
 struct KeysFunction {
     std::vector<uint8_t> keycodes;
@@ -37,29 +46,123 @@ struct RecordedDelayMacroSequence {
 using MacroSequence = Variant<AutoDelayMacroSequence, RecordedDelayMacroSequence>;
 
 struct MacroKeyFunction {
-    MacroRepeat   repeat;
-    uint8_t       repeat_count;
-    MacroSequence sequence;
+    MacroRepeat repeat;
+    uint8_t     repeat_count;
+    // keys which run the same macro share its body
+    std::shared_ptr<const MacroSequence> sequence;
 };
 
 using KeyFunction = Variant<KeysFunction, EmulateKeyFunction, MacroKeyFunction>;
 } // namespace func
 
 auto get_version(int fd) -> std::optional<std::string>;
+// hex digits of the serial number, which tells keyboards of the same model apart
+// asked once with a short deadline, since some firmwares do not answer it
+auto get_serial(int fd) -> std::optional<std::string>;
 auto read_counts(int fd) -> std::optional<std::vector<uint32_t>>;
+// reuses the storage of counts, which is resized to the number of keys
+auto read_counts(int fd, std::vector<uint32_t>& counts) -> bool;
+// Intel HEX image which was validated as a whole, so that a corrupt image is not flashed halfway
+// one image can be flushed to many keyboards
+struct FirmwareImage {
+    MappedFile file;
+    size_t     packets = 0; // every record is sent as one packet
+
+    auto get_text() const -> std::string_view;
+
+    static auto open(const char* path) -> std::optional<FirmwareImage>;
+};
+
+auto flush_firmware(int fd, const FirmwareImage& image) -> bool;
 auto flush_firmware(int fd, const char* firmware_path) -> bool;
 auto enable_keypress(int fd, bool flag) -> bool;
 auto do_initial_calibration(int fd) -> bool;
 auto do_press_calibration(int fd) -> bool;
 
+// problem found in a keymap file, line and column are 1-based
+struct Diagnostic {
+    size_t      line;
+    size_t      column;
+    bool        error; // warnings do not make the file invalid
+    std::string message;
+};
+
+// files included by a batch of keymaps, so that a file included by many of them is parsed once
+// the files must not change while it is alive
+struct ParseCache {
+    struct Entries;
+    std::unique_ptr<Entries> entries;
+
+    ParseCache();
+    ~ParseCache();
+};
+
 struct KeyMap {
     std::array<std::vector<func::KeyFunction>, 3> functions;
+    // set by the layout statement, positions are bounded by it and written with their names
+    const layout::Layout* layout = nullptr;
 
+    // sets the layout of the keyboard which reported version, unless some key is not one of its positions
+    // the parser rejects such keys with a layout, so they are kept as numbers instead
+    auto set_layout_for(std::string_view version) -> void;
     auto write_to_keyboard(int fd) const -> bool;
+    // sends only the keys which differ from current, see CompactKeyMap::write_diff_to_keyboard for verify
+    auto write_diff_to_keyboard(int fd, const KeyMap& current, bool verify = false) const -> bool;
     auto to_string() const -> std::string;
+    // writes the text of to_string() without building it in memory
+    // returns the full size of the text, which is truncated if buf is too small
+    auto serialize(std::span<char> buf) const -> size_t;
+    auto write_to_file(int fd) const -> bool;
     auto debug_print() const -> void;
 
     static auto from_keyboard(int fd) -> std::optional<KeyMap>;
+    // included files are relative to the working directory
     static auto from_string(std::string_view str) -> std::optional<KeyMap>;
+    // parses every line instead of stopping at the first error, the problems are added to diagnostics instead of printed
+    // also warns about keys which are bound more than once
+    // path is the file which str was read from, if any, included files are relative to it
+    // cache is shared by the keymaps of a batch, the included files are parsed again for each call without it
+    static auto from_string(std::string_view str, std::vector<Diagnostic>& diagnostics, const char* path = nullptr, ParseCache* cache = nullptr) -> std::optional<KeyMap>;
+    // included files are relative to path
+    static auto from_file(const char* path) -> std::optional<KeyMap>;
+};
+
+// keymap kept in wire format, used by KeyMap for the device io
+// every key has a fixed slot, which points at its KeyData packet from func_type onwards in a shared pool
+struct CompactKeyMap {
+    // positions are sent as pos + 1 in a byte
+    static constexpr auto max_keys = size_t(255);
+    // bytes after the packet header
+    static constexpr auto max_payload_size = size_t(60);
+
+    struct Slot {
+        uint16_t offset = 0;
+        uint8_t  size   = 0; // 0 for an empty key
+    };
+
+    std::array<std::array<Slot, max_keys>, 3> slots = {};
+    std::vector<uint8_t>                       pool;
+
+    auto get_payload(int layer, int pos) const -> std::span<const uint8_t>;
+    // the previous payload of the key is left in the pool
+    auto set_payload(int layer, int pos, std::span<const uint8_t> payload) -> bool;
+    // builds a KeyData report, returns false for an empty key
+    auto encode(int layer, int pos, std::array<uint8_t, 65>& buf) const -> bool;
+    auto count_keys() const -> size_t;
+    // stores a KeyData packet without the report id, an empty function clears the key
+    auto set_key(std::span<const uint8_t, 64> packet) -> bool;
+    // WriteAll, KeyData for every key and DataEnd, as sent by write_to_keyboard
+    auto make_reports() const -> std::vector<std::array<uint8_t, 65>>;
+    // hash_reports of make_reports, equal for keymaps which differ only in formatting
+    auto get_hash() const -> uint64_t;
+
+    auto write_to_keyboard(int fd) const -> bool;
+    // sends only the keys which differ from current
+    // with verify, reads the keymap back afterwards and writes every key if the keyboard lost the others
+    auto write_diff_to_keyboard(int fd, const CompactKeyMap& current, bool verify = false) const -> bool;
+    auto to_keymap() const -> std::optional<KeyMap>;
+
+    static auto from_keymap(const KeyMap& keymap) -> std::optional<CompactKeyMap>;
+    static auto from_keyboard(int fd) -> std::optional<CompactKeyMap>;
 };
 } // namespace niz
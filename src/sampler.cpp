@@ -0,0 +1,192 @@
+#include <charconv>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "macros/assert.hpp"
+#include "niz.hpp"
+#include "sampler.hpp"
+#include "util/fd.hpp"
+
+namespace niz::sampler {
+namespace {
+// holds the deltas of the samples which were not written yet
+// storage is allocated once, the oldest sample is dropped if writes keep failing
+struct Ring {
+    size_t                keys;
+    size_t                capacity;
+    std::vector<int64_t>  times;
+    std::vector<uint32_t> deltas; // capacity * keys
+    size_t                head    = 0;
+    size_t                size    = 0;
+    size_t                dropped = 0;
+
+    auto at(const size_t index) -> std::span<uint32_t> {
+        return std::span(deltas).subspan((head + index) % capacity * keys, keys);
+    }
+
+    auto push(const int64_t time) -> std::span<uint32_t> {
+        if(size == capacity) {
+            head = (head + 1) % capacity;
+            size -= 1;
+            dropped += 1;
+        }
+        times[(head + size) % capacity] = time;
+        size += 1;
+        return at(size - 1);
+    }
+
+    Ring(const size_t keys, const size_t capacity)
+        : keys(keys),
+          capacity(capacity),
+          times(capacity),
+          deltas(capacity * keys) {}
+};
+
+auto append_number(std::string& text, const uint64_t value) -> void {
+    auto buf       = std::array<char, 20>();
+    const auto end = std::to_chars(buf.data(), buf.data() + buf.size(), value).ptr;
+    text.append(buf.data(), end);
+}
+
+// formats every sample in a single buffer, which is written at once
+auto flush(Ring& ring, std::string& text, const int out_fd) -> bool {
+    text.clear();
+    for(auto i = size_t(0); i < ring.size; i += 1) {
+        append_number(text, ring.times[(ring.head + i) % ring.capacity]);
+        const auto deltas = ring.at(i);
+        for(auto key = size_t(0); key < deltas.size(); key += 1) {
+            if(deltas[key] == 0) {
+                continue;
+            }
+            text += ' ';
+            append_number(text, key);
+            text += ':';
+            append_number(text, deltas[key]);
+        }
+        text += '\n';
+    }
+    ensure(write(out_fd, text.data(), text.size()) == ssize_t(text.size()), "write: ", strerror(errno));
+    ring.head = 0;
+    ring.size = 0;
+    return true;
+}
+
+auto make_timer(const std::chrono::milliseconds interval) -> FileDescriptor {
+    auto fd = FileDescriptor(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC));
+    if(fd.as_handle() < 0) {
+        return fd;
+    }
+    const auto secs = std::chrono::duration_cast<std::chrono::seconds>(interval);
+    const auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(interval - secs);
+    auto       spec = itimerspec();
+    spec.it_interval.tv_sec  = secs.count();
+    spec.it_interval.tv_nsec = nsec.count();
+    spec.it_value            = spec.it_interval;
+    if(timerfd_settime(fd.as_handle(), 0, &spec, nullptr) != 0) {
+        return FileDescriptor();
+    }
+    return fd;
+}
+} // namespace
+
+auto run(const int fd, const int out_fd, const Options& options) -> bool {
+    ensure(options.interval.count() > 0);
+    ensure(options.batch_size > 0);
+
+    // the first read sets the baseline and the size of every buffer
+    auto previous = std::vector<uint32_t>();
+    auto current  = std::vector<uint32_t>();
+    ensure(read_counts(fd, previous));
+    ensure(!previous.empty(), "keyboard reported no counts");
+    current.reserve(previous.size());
+
+    // a failed write is retried with the next batch, before anything is dropped
+    auto ring = Ring(previous.size(), options.batch_size * 2);
+    auto text = std::string();
+
+    auto header = std::string("# keys ");
+    append_number(header, previous.size());
+    header += " interval_ms ";
+    append_number(header, options.interval.count());
+    header += '\n';
+    ensure(write(out_fd, header.data(), header.size()) == ssize_t(header.size()), "write: ", strerror(errno));
+
+    auto signals = sigset_t();
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ensure(pthread_sigmask(SIG_BLOCK, &signals, nullptr) == 0);
+    const auto signal_fd = FileDescriptor(signalfd(-1, &signals, SFD_CLOEXEC));
+    ensure(signal_fd.as_handle() >= 0, strerror(errno));
+    const auto timer_fd = make_timer(options.interval);
+    ensure(timer_fd.as_handle() >= 0, "timerfd: ", strerror(errno));
+
+    auto samples  = size_t(0);
+    auto failures = size_t(0); // failed reads in a row
+    while(options.max_samples == 0 || samples < options.max_samples) {
+        auto fds = std::array{
+            pollfd{.fd = signal_fd.as_handle(), .events = POLLIN, .revents = 0},
+            pollfd{.fd = timer_fd.as_handle(), .events = POLLIN, .revents = 0},
+        };
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            ensure(errno == EINTR, "poll: ", strerror(errno));
+            continue;
+        }
+        if(fds[0].revents & POLLIN) {
+            break;
+        }
+        if(!(fds[1].revents & POLLIN)) {
+            continue;
+        }
+        // expirations missed while the device was slow are covered by the next delta
+        auto expirations = uint64_t();
+        ensure(read(timer_fd.as_handle(), &expirations, sizeof(expirations)) == sizeof(expirations));
+        samples += 1;
+
+        // a failed read is skipped, the next sample covers its presses
+        if(!read_counts(fd, current)) {
+            failures += 1;
+            line_warn("can not read the key counts, ", failures, " failures in a row");
+            if(failures >= options.max_failures) {
+                break;
+            }
+            continue;
+        }
+        failures = 0;
+        if(current.size() != previous.size()) {
+            line_warn("number of keys changed from ", previous.size(), " to ", current.size(), ", restarting from this sample");
+            std::swap(previous, current);
+            continue;
+        }
+        auto changed = false;
+        for(auto i = size_t(0); i < current.size(); i += 1) {
+            changed |= current[i] != previous[i];
+        }
+        if(changed) {
+            const auto now    = std::chrono::system_clock::now().time_since_epoch();
+            const auto deltas = ring.push(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+            for(auto i = size_t(0); i < current.size(); i += 1) {
+                // counters start over when the keyboard is reset
+                deltas[i] = current[i] >= previous[i] ? current[i] - previous[i] : current[i];
+            }
+        }
+        std::swap(previous, current);
+
+        if(ring.size >= options.batch_size && !flush(ring, text, out_fd)) {
+            line_warn("keeping ", ring.size, " samples for the next batch");
+        }
+    }
+
+    if(ring.dropped > 0) {
+        line_warn(ring.dropped, " samples were dropped");
+    }
+    ensure(ring.size == 0 || flush(ring, text, out_fd));
+    ensure(failures < options.max_failures, "keyboard stopped answering");
+    return true;
+}
+} // namespace niz::sampler
@@ -0,0 +1,19 @@
+#pragma once
+#include <chrono>
+
+namespace niz::sampler {
+struct Options {
+    std::chrono::milliseconds interval = std::chrono::seconds(1);
+    // samples are written to disk in batches of this size
+    size_t batch_size = 60;
+    // return after this many samples, 0 to run until SIGINT or SIGTERM
+    size_t max_samples = 0;
+    // reads which may fail in a row before the keyboard is taken as gone, the samples so far are written first
+    size_t max_failures = 10;
+};
+
+// reads the key counts every interval and appends the changes to out_fd
+// each line is "TIME KEY:DELTA KEY:DELTA...", TIME is in unix milliseconds and KEY is 0-based
+// samples without any key press are not written
+auto run(int fd, int out_fd, const Options& options) -> bool;
+} // namespace niz::sampler
@@ -0,0 +1,266 @@
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "layout.hpp"
+#include "macro.hpp"
+#include "macros/assert.hpp"
+#include "macros/unwrap.hpp"
+#include "niz.hpp"
+#include "server.hpp"
+
+namespace niz::server {
+namespace {
+// a client which stops in the middle of a message must not stall the others
+constexpr auto client_timeout = timeval{.tv_sec = 1, .tv_usec = 0};
+constexpr auto max_clients    = size_t(64);
+
+auto make_address(const char* const path) -> std::optional<sockaddr_un> {
+    auto addr       = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    ensure(strlen(path) < sizeof(addr.sun_path), "socket path too long");
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+auto send_all(const int fd, const void* const data, const size_t size) -> bool {
+    for(auto done = size_t(0); done < size;) {
+        const auto ret = send(fd, std::bit_cast<const char*>(data) + done, size - done, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        ensure(ret > 0, "send: ", strerror(errno));
+        done += ret;
+    }
+    return true;
+}
+
+auto receive_all(const int fd, void* const data, const size_t size) -> bool {
+    for(auto done = size_t(0); done < size;) {
+        const auto ret = recv(fd, std::bit_cast<char*>(data) + done, size - done, 0);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return false; // closed by the peer, not worth a warning
+        }
+        done += ret;
+    }
+    return true;
+}
+
+auto send_message(const int fd, const uint8_t code, const std::string_view payload) -> bool {
+    ensure(payload.size() <= max_payload_size);
+    const auto header = Header{code, uint32_t(payload.size())};
+    return send_all(fd, &header, sizeof(header)) && send_all(fd, payload.data(), payload.size());
+}
+
+auto receive_message(const int fd, Header& header, std::string& payload) -> bool {
+    if(!receive_all(fd, &header, sizeof(header))) {
+        return false;
+    }
+    ensure(header.size <= max_payload_size, "payload of ", uint32_t(header.size), " bytes is too large");
+    payload.resize(header.size);
+    return receive_all(fd, payload.data(), payload.size());
+}
+
+struct Device {
+    int         fd;
+    std::string version;
+    // what was last read from or written to the keyboard, in wire format so that diffs need no decoding
+    std::optional<CompactKeyMap> keymap;
+    bool                         stop = false;
+
+    auto get_keymap() -> const CompactKeyMap*;
+    auto handle(uint8_t command, std::string_view payload) -> std::optional<std::string>;
+};
+
+auto Device::get_keymap() -> const CompactKeyMap* {
+    if(!keymap) {
+        keymap = CompactKeyMap::from_keyboard(fd);
+    }
+    return keymap ? &*keymap : nullptr;
+}
+
+// the text of a client keymap, optimized and encoded as it is sent
+auto load_keymap(const std::string_view payload, const std::string_view version) -> std::optional<CompactKeyMap> {
+    unwrap_mut(keymap, KeyMap::from_string(payload));
+    ensure(macro::optimize(keymap));
+    ensure(layout::check_version(keymap.layout, version));
+    return CompactKeyMap::from_keymap(keymap);
+}
+
+auto Device::handle(const uint8_t command, const std::string_view payload) -> std::optional<std::string> {
+    switch(command) {
+    case Command::Version:
+        return version;
+    case Command::ReadKeymap: {
+        unwrap(current, get_keymap());
+        unwrap_mut(decoded, current.to_keymap());
+        // the same text as read-keymap of the cli
+        decoded.set_layout_for(version);
+        return decoded.to_string();
+    }
+    case Command::WriteKeymap: {
+        unwrap_mut(next, load_keymap(payload, version));
+        // the keyboard may hold a partial keymap if the write fails
+        keymap.reset();
+        ensure(next.write_to_keyboard(fd));
+        keymap = std::move(next);
+        return std::string();
+    }
+    case Command::WriteKeymapDiff: {
+        unwrap_mut(next, load_keymap(payload, version));
+        unwrap(current, get_keymap());
+        if(!next.write_diff_to_keyboard(fd, current)) {
+            // the keyboard may hold a partial keymap
+            keymap.reset();
+            bail("can not write the keymap");
+        }
+        // current points into keymap, which is still set
+        *keymap = std::move(next);
+        return std::string();
+    }
+    case Command::ReadCounts: {
+        unwrap(counts, read_counts(fd));
+        auto text = std::string();
+        for(const auto c : counts) {
+            text += std::to_string(c);
+            text += ' ';
+        }
+        return text;
+    }
+    case Command::EnableKeypress:
+    case Command::DisableKeypress:
+        ensure(enable_keypress(fd, command == Command::EnableKeypress));
+        return std::string();
+    case Command::InitialCalib:
+        ensure(do_initial_calibration(fd));
+        return std::string();
+    case Command::PressCalib:
+        ensure(do_press_calibration(fd));
+        return std::string();
+    case Command::Stop:
+        stop = true;
+        return std::string();
+    default:
+        bail("unknown command ", int(command));
+    }
+}
+
+// returns false if the client should be disconnected
+auto serve_client(Device& device, const int fd) -> bool {
+    auto header  = Header();
+    auto payload = std::string();
+    if(!receive_message(fd, header, payload)) {
+        return false;
+    }
+    if(const auto response = device.handle(header.code, payload)) {
+        return send_message(fd, Status::Ok, *response);
+    } else {
+        return send_message(fd, Status::Error, "request failed, see the log of the daemon");
+    }
+}
+
+auto listen_unix(const char* const path) -> FileDescriptor {
+    unwrap(addr, make_address(path));
+    // a socket file without a listener is left behind by a daemon which did not exit cleanly
+    if(connect(path).as_handle() >= 0) {
+        line_warn("daemon is already running on ", path);
+        return FileDescriptor();
+    }
+    unlink(path);
+    auto fd = FileDescriptor(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    ensure(fd.as_handle() >= 0, strerror(errno));
+    ensure(bind(fd.as_handle(), std::bit_cast<const sockaddr*>(&addr), sizeof(addr)) == 0, "bind: ", strerror(errno));
+    ensure(listen(fd.as_handle(), 16) == 0, "listen: ", strerror(errno));
+    return fd;
+}
+} // namespace
+
+auto serve(const int device_fd, std::string version, const char* const socket_path) -> bool {
+    auto device = Device{device_fd, std::move(version), {}};
+
+    auto signals = sigset_t();
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ensure(pthread_sigmask(SIG_BLOCK, &signals, nullptr) == 0);
+    const auto signal_fd = FileDescriptor(signalfd(-1, &signals, SFD_CLOEXEC));
+    ensure(signal_fd.as_handle() >= 0, strerror(errno));
+
+    const auto listen_fd = listen_unix(socket_path);
+    ensure(listen_fd.as_handle() >= 0);
+    print("listening on ", socket_path);
+
+    auto clients = std::vector<FileDescriptor>();
+    auto fds     = std::vector<pollfd>();
+    while(!device.stop) {
+        fds.clear();
+        fds.push_back(pollfd{.fd = signal_fd.as_handle(), .events = POLLIN, .revents = 0});
+        fds.push_back(pollfd{.fd = listen_fd.as_handle(), .events = POLLIN, .revents = 0});
+        for(const auto& client : clients) {
+            fds.push_back(pollfd{.fd = client.as_handle(), .events = POLLIN, .revents = 0});
+        }
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            ensure(errno == EINTR, "poll: ", strerror(errno));
+            continue;
+        }
+        if(fds[0].revents & POLLIN) {
+            print("stopping");
+            break;
+        }
+
+        // requests are handled in the order of the clients, one at a time
+        for(auto i = clients.size(); i > 0; i -= 1) {
+            const auto revents = fds[i + 1].revents;
+            if(revents == 0) {
+                continue;
+            }
+            if(!(revents & POLLIN) || !serve_client(device, clients[i - 1].as_handle())) {
+                clients.erase(clients.begin() + (i - 1));
+            }
+        }
+
+        if(fds[1].revents & POLLIN) {
+            auto client = FileDescriptor(accept4(listen_fd.as_handle(), nullptr, nullptr, SOCK_CLOEXEC));
+            if(client.as_handle() < 0) {
+                line_warn("accept: ", strerror(errno));
+            } else if(clients.size() >= max_clients) {
+                line_warn("too many clients");
+            } else {
+                setsockopt(client.as_handle(), SOL_SOCKET, SO_RCVTIMEO, &client_timeout, sizeof(client_timeout));
+                setsockopt(client.as_handle(), SOL_SOCKET, SO_SNDTIMEO, &client_timeout, sizeof(client_timeout));
+                clients.push_back(std::move(client));
+            }
+        }
+    }
+    unlink(socket_path);
+    return true;
+}
+
+auto connect(const char* const socket_path) -> FileDescriptor {
+    const auto addr = make_address(socket_path);
+    if(!addr) {
+        return FileDescriptor();
+    }
+    auto fd = FileDescriptor(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if(fd.as_handle() < 0 || ::connect(fd.as_handle(), std::bit_cast<const sockaddr*>(&*addr), sizeof(*addr)) != 0) {
+        return FileDescriptor();
+    }
+    return fd;
+}
+
+auto request(const int fd, const uint8_t command, const std::string_view payload) -> std::optional<std::string> {
+    ensure(send_message(fd, command, payload));
+    auto header   = Header();
+    auto response = std::string();
+    ensure(receive_message(fd, header, response), "connection closed");
+    ensure(header.code == Status::Ok, response);
+    return response;
+}
+} // namespace niz::server
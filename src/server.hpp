@@ -0,0 +1,47 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "util/fd.hpp"
+
+namespace niz::server {
+// every message is a header followed by size bytes of payload
+// fields are in host byte order, since both ends are on the same machine
+struct Command {
+    enum : uint8_t {
+        Version         = 0x01, // response: version string
+        ReadKeymap      = 0x02, // response: keymap text
+        WriteKeymap     = 0x03, // request: keymap text
+        WriteKeymapDiff = 0x04, // request: keymap text, only keys which differ from the cached keymap are sent
+        ReadCounts      = 0x05, // response: counts separated by spaces
+        EnableKeypress  = 0x06,
+        DisableKeypress = 0x07,
+        InitialCalib    = 0x08,
+        PressCalib      = 0x09,
+        Stop            = 0x0a,
+    };
+};
+
+struct Status {
+    enum : uint8_t {
+        Ok    = 0x00,
+        Error = 0x01, // payload: error message
+    };
+};
+
+struct Header {
+    uint8_t  code; // Command in requests, Status in responses
+    uint32_t size;
+} __attribute__((packed));
+
+constexpr auto max_payload_size = size_t(16) * 1024 * 1024;
+
+// serves requests until SIGINT, SIGTERM or Command::Stop
+// the version and the keymap are cached, requests of every client are handled one at a time
+auto serve(int device_fd, std::string version, const char* socket_path) -> bool;
+
+auto connect(const char* socket_path) -> FileDescriptor;
+// returns the payload of the response, nullopt if the request failed
+auto request(int fd, uint8_t command, std::string_view payload = {}) -> std::optional<std::string>;
+} // namespace niz::server
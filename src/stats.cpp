@@ -0,0 +1,176 @@
+#include <array>
+#include <bit>
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+
+#include "common.hpp"
+#include "stats.hpp"
+
+namespace niz::stats {
+namespace {
+// log-linear buckets of nanoseconds, 8 per power of 2, so that a percentile is within 12.5%
+constexpr auto sub_bits     = 3u;
+constexpr auto sub_buckets  = 1u << sub_bits;
+constexpr auto bucket_count = (64 - sub_bits + 1) * sub_buckets;
+
+constexpr auto get_bucket(const uint64_t value) -> size_t {
+    if(value < sub_buckets) {
+        return value;
+    }
+    const auto exp = size_t(std::bit_width(value) - 1);
+    const auto sub = (value >> (exp - sub_bits)) & (sub_buckets - 1);
+    return (exp - sub_bits + 1) * sub_buckets + sub;
+}
+
+// largest value which falls into bucket
+constexpr auto get_bucket_limit(const size_t bucket) -> uint64_t {
+    if(bucket < sub_buckets) {
+        return bucket;
+    }
+    const auto exp = bucket / sub_buckets + sub_bits - 1;
+    const auto sub = bucket % sub_buckets;
+    return ((sub_buckets + sub + 1) << (exp - sub_bits)) - 1;
+}
+
+static_assert(get_bucket(7) == 7 && get_bucket(8) == 8 && get_bucket(15) == 15 && get_bucket(16) == 16 && get_bucket(18) == 17);
+static_assert(get_bucket_limit(get_bucket(1000)) >= 1000 && get_bucket_limit(get_bucket(1000) - 1) < 1000);
+static_assert(get_bucket(~uint64_t(0)) == bucket_count - 1);
+
+struct Histogram {
+    std::array<std::atomic_uint64_t, bucket_count> buckets = {};
+    std::atomic_uint64_t                           count   = 0;
+    std::atomic_uint64_t                           total   = 0;
+    std::atomic_uint64_t                           max     = 0;
+
+    auto add(const uint64_t value) -> void {
+        buckets[get_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(value, std::memory_order_relaxed);
+        for(auto prev = max.load(std::memory_order_relaxed); prev < value && !max.compare_exchange_weak(prev, value, std::memory_order_relaxed);) {
+        }
+    }
+
+    // upper bound of the bucket which holds the percentile, at most max
+    auto get_percentile(const double percentile) const -> uint64_t {
+        const auto rank = uint64_t(percentile / 100 * count.load(std::memory_order_relaxed));
+        auto       seen = uint64_t(0);
+        for(auto i = size_t(0); i < bucket_count; i += 1) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if(seen > rank) {
+                return std::min(get_bucket_limit(i), max.load(std::memory_order_relaxed));
+            }
+        }
+        return max.load(std::memory_order_relaxed);
+    }
+};
+
+struct PacketCounter {
+    std::atomic_uint64_t packets = 0;
+    std::atomic_uint64_t bytes   = 0;
+};
+
+struct Stats {
+    std::atomic_bool                              enabled = false;
+    std::array<std::array<PacketCounter, 256>, 2> packets; // [sent][type]
+    std::array<Histogram, Operation::Count>       latencies;
+    std::chrono::steady_clock::time_point         begin;
+};
+
+auto stats = Stats();
+
+constexpr auto operation_names = std::array<const char*, Operation::Count>{"write", "read", "parse", "serialize", "encode", "decode"};
+
+auto to_us(const uint64_t ns) -> double {
+    return ns / 1000.0;
+}
+} // namespace
+
+auto enable() -> void {
+    stats.begin = std::chrono::steady_clock::now();
+    stats.enabled.store(true, std::memory_order_relaxed);
+}
+
+auto is_enabled() -> bool {
+    return stats.enabled.load(std::memory_order_relaxed);
+}
+
+auto count_packet(const bool sent, const int type, const size_t bytes) -> void {
+    if(!is_enabled()) {
+        return;
+    }
+    auto& counter = stats.packets[sent][type & 0xff];
+    counter.packets.fetch_add(1, std::memory_order_relaxed);
+    counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+auto add_latency(const uint8_t operation, const std::chrono::nanoseconds latency) -> void {
+    if(!is_enabled()) {
+        return;
+    }
+    stats.latencies[operation].add(latency.count());
+}
+
+Timer::Timer(const uint8_t operation)
+    : operation(operation) {
+    if(is_enabled()) {
+        begin = std::chrono::steady_clock::now();
+    }
+}
+
+Timer::~Timer() {
+    if(is_enabled()) {
+        add_latency(operation, std::chrono::steady_clock::now() - begin);
+    }
+}
+
+auto print_summary(FILE* const out) -> void {
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats.begin).count();
+    fprintf(out, "session: %.3fms\n", elapsed * 1000);
+    fprintf(out, "%-22s %-4s %10s %12s\n", "packet", "dir", "packets", "bytes");
+    for(const auto sent : {true, false}) {
+        for(auto type = 0; type < 256; type += 1) {
+            const auto& counter = stats.packets[sent][type];
+            if(counter.packets == 0) {
+                continue;
+            }
+            fprintf(out, "%-22s %-4s %10" PRIu64 " %12" PRIu64 "\n", get_packet_name(type).data(), sent ? "sent" : "recv", counter.packets.load(), counter.bytes.load());
+        }
+    }
+    fprintf(out, "%-10s %10s %12s %12s %12s %12s\n", "operation", "count", "total(us)", "p50(us)", "p99(us)", "max(us)");
+    for(auto op = 0; op < Operation::Count; op += 1) {
+        const auto& hist = stats.latencies[op];
+        if(hist.count == 0) {
+            continue;
+        }
+        fprintf(out, "%-10s %10" PRIu64 " %12.1f %12.1f %12.1f %12.1f\n", operation_names[op], hist.count.load(), to_us(hist.total), to_us(hist.get_percentile(50)), to_us(hist.get_percentile(99)), to_us(hist.max));
+    }
+}
+
+auto print_json(FILE* const out) -> void {
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats.begin).count();
+    fprintf(out, R"({"session_ms":%.3f,"packets":[)", elapsed * 1000);
+    auto first = true;
+    for(const auto sent : {true, false}) {
+        for(auto type = 0; type < 256; type += 1) {
+            const auto& counter = stats.packets[sent][type];
+            if(counter.packets == 0) {
+                continue;
+            }
+            fprintf(out, R"(%s{"type":"%s","direction":"%s","packets":%)" PRIu64 R"(,"bytes":%)" PRIu64 R"(})", first ? "" : ",", get_packet_name(type).data(), sent ? "sent" : "received", counter.packets.load(), counter.bytes.load());
+            first = false;
+        }
+    }
+    fprintf(out, R"(],"latency":[)");
+    first = true;
+    for(auto op = 0; op < Operation::Count; op += 1) {
+        const auto& hist = stats.latencies[op];
+        if(hist.count == 0) {
+            continue;
+        }
+        fprintf(out, R"(%s{"operation":"%s","count":%)" PRIu64 R"(,"total_us":%.1f,"p50_us":%.1f,"p99_us":%.1f,"max_us":%.1f})", first ? "" : ",", operation_names[op], hist.count.load(), to_us(hist.total), to_us(hist.get_percentile(50)), to_us(hist.get_percentile(99)), to_us(hist.max));
+        first = false;
+    }
+    fprintf(out, "]}\n");
+}
+} // namespace niz::stats
@@ -0,0 +1,39 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+namespace niz::stats {
+// counters and latency histograms, collected only after enable()
+// everything is updated with relaxed atomics, so that fleet workers can share them
+struct Operation {
+    enum : uint8_t {
+        Write,     // one report, including the wait for the device to take it
+        Read,      // one report, including the wait for it to arrive
+        Parse,     // KeyMap::from_string
+        Serialize, // KeyMap::to_string and write_to_file
+        Encode,    // CompactKeyMap::from_keymap
+        Decode,    // CompactKeyMap::to_keymap
+        Count,
+    };
+};
+
+auto enable() -> void;
+auto is_enabled() -> bool;
+
+auto count_packet(bool sent, int type, size_t bytes) -> void;
+auto add_latency(uint8_t operation, std::chrono::nanoseconds latency) -> void;
+
+// measures its own lifetime, does not read the clock while disabled
+struct Timer {
+    uint8_t                               operation;
+    std::chrono::steady_clock::time_point begin;
+
+    Timer(uint8_t operation);
+    Timer(const Timer&) = delete;
+    ~Timer();
+};
+
+auto print_summary(FILE* out) -> void;
+auto print_json(FILE* out) -> void;
+} // namespace niz::stats
@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "macros/assert.hpp"
+#include "macros/unwrap.hpp"
+#include "mapped-file.hpp"
+#include "trace.hpp"
+
+namespace niz::trace {
+static_assert(sizeof(FileHeader) == 16);
+static_assert(sizeof(RecordHeader) == 14);
+
+namespace {
+struct Writer {
+    static constexpr auto buffer_size = size_t(64) * 1024;
+
+    std::mutex                            lock;
+    FileDescriptor                        fd;
+    std::vector<uint8_t>                  buffer;
+    std::chrono::steady_clock::time_point begin;
+    std::atomic_bool                      active = false;
+
+    auto flush() -> bool {
+        ensure(fd.write(buffer.data(), buffer.size()), "trace write: ", strerror(errno));
+        buffer.clear();
+        return true;
+    }
+
+    auto append(const void* const data, const size_t size) -> void {
+        const auto ptr = std::bit_cast<const uint8_t*>(data);
+        buffer.insert(buffer.end(), ptr, ptr + size);
+    }
+
+    ~Writer() {
+        if(active) {
+            flush();
+        }
+    }
+};
+
+auto writer = Writer();
+} // namespace
+
+auto start(const char* const path) -> bool {
+    const auto guard = std::lock_guard(writer.lock);
+    ensure(!writer.active);
+    writer.fd = FileDescriptor(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    ensure(writer.fd.as_handle() >= 0, "can not open ", path, ": ", strerror(errno));
+    writer.buffer.reserve(Writer::buffer_size);
+    writer.begin = std::chrono::steady_clock::now();
+
+    const auto now    = std::chrono::system_clock::now().time_since_epoch();
+    auto       header = FileHeader{magic, version, 0, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count())};
+    writer.append(&header, sizeof(header));
+    writer.active = true;
+    return true;
+}
+
+auto record(const int fd, const uint8_t direction, const std::span<const uint8_t> report) -> void {
+    if(!writer.active.load(std::memory_order_relaxed)) {
+        return;
+    }
+    const auto now    = std::chrono::steady_clock::now();
+    const auto guard  = std::lock_guard(writer.lock);
+    const auto size   = std::min(report.size(), sizeof(Record::data));
+    const auto header = RecordHeader{uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - writer.begin).count()), uint32_t(fd), direction, uint8_t(size)};
+    writer.append(&header, sizeof(header));
+    writer.append(report.data(), size);
+    if(writer.buffer.size() >= Writer::buffer_size && !writer.flush()) {
+        // a broken trace should not fail the session
+        writer.active = false;
+    }
+}
+
+auto stop() -> bool {
+    const auto guard = std::lock_guard(writer.lock);
+    ensure(writer.active);
+    writer.active = false;
+    ensure(writer.flush());
+    writer.fd.close();
+    return true;
+}
+
+auto Record::get_data() const -> std::span<const uint8_t> {
+    return std::span(data).first(size);
+}
+
+auto load(const char* const path) -> std::optional<std::vector<Record>> {
+    unwrap(file, MappedFile::open(path));
+    auto data = file.get_data();
+    ensure(data.size() >= sizeof(FileHeader), "trace too short");
+    const auto header = std::bit_cast<FileHeader>(*std::bit_cast<const std::array<uint8_t, sizeof(FileHeader)>*>(data.data()));
+    ensure(header.magic == magic, "not a trace");
+    ensure(header.version == version, "unsupported trace version ", header.version);
+    data = data.subspan(sizeof(FileHeader));
+
+    auto records = std::vector<Record>();
+    records.reserve(data.size() / (sizeof(RecordHeader) + 64));
+    while(!data.empty()) {
+        ensure(data.size() >= sizeof(RecordHeader), "truncated record ", records.size());
+        const auto rec = std::bit_cast<RecordHeader>(*std::bit_cast<const std::array<uint8_t, sizeof(RecordHeader)>*>(data.data()));
+        ensure(rec.direction <= Direction::Received, "invalid direction of record ", records.size());
+        ensure(rec.size <= sizeof(Record::data), "oversized record ", records.size());
+        ensure(data.size() >= sizeof(RecordHeader) + rec.size, "truncated record ", records.size());
+
+        auto& record     = records.emplace_back();
+        record.time      = rec.time;
+        record.channel   = rec.channel;
+        record.direction = rec.direction;
+        record.size      = rec.size;
+        memcpy(record.data.data(), data.data() + sizeof(RecordHeader), rec.size);
+        data = data.subspan(sizeof(RecordHeader) + rec.size);
+    }
+    return records;
+}
+
+auto dump(const std::span<const Record> records) -> void {
+    auto previous = uint64_t(0);
+    for(const auto& record : records) {
+        // time since the previous record tells the latency of the device
+        printf("%12.3fms %+10.3fms %4u %s ", record.time / 1e6, (record.time - previous) / 1e6, record.channel, record.direction == Direction::Sent ? "->" : "<-");
+        for(const auto byte : record.get_data()) {
+            printf("%02X", byte);
+        }
+        printf("\n");
+        previous = record.time;
+    }
+}
+
+auto Replayer::start(std::vector<Record> trace, const bool timed) -> bool {
+    ensure(!trace.empty(), "empty trace");
+    const auto channel = trace[0].channel;
+    std::erase_if(trace, [channel](const Record& record) { return record.channel != channel; });
+    records     = std::move(trace);
+    this->timed = timed;
+
+    auto fds = std::array<int, 2>();
+    ensure(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds.data()) == 0, strerror(errno));
+    host   = FileDescriptor(fds[0]);
+    device = FileDescriptor(fds[1]);
+    worker = std::thread(&Replayer::run, this);
+    return true;
+}
+
+auto Replayer::stop() -> void {
+    if(!worker.joinable()) {
+        return;
+    }
+    shutdown(host.as_handle(), SHUT_RDWR);
+    worker.join();
+}
+
+auto Replayer::get_fd() const -> int {
+    return host.as_handle();
+}
+
+Replayer::~Replayer() {
+    stop();
+}
+
+auto Replayer::run() -> void {
+    auto buf       = std::array<uint8_t, 65>();
+    auto last_sent = std::chrono::steady_clock::now();
+    auto last_time = uint64_t(0);
+    for(auto i = size_t(0); i < records.size(); i += 1) {
+        const auto& record = records[i];
+        if(record.direction == Direction::Sent) {
+            const auto len = read(device.as_handle(), buf.data(), buf.size());
+            if(len <= 0) {
+                break;
+            }
+            last_sent = std::chrono::steady_clock::now();
+            last_time = record.time;
+            if(!std::ranges::equal(std::span(buf).first(len), record.get_data())) {
+                if(mismatches == 0) {
+                    line_warn("replay diverged from the trace at record ", i);
+                }
+                mismatches += 1;
+            }
+        } else {
+            if(timed) {
+                std::this_thread::sleep_until(last_sent + std::chrono::nanoseconds(record.time - last_time));
+            }
+            if(write(device.as_handle(), record.data.data(), record.size) != ssize_t(record.size)) {
+                break;
+            }
+        }
+    }
+    // the host sees the end of the trace as a device which stopped answering
+    auto rest = std::array<uint8_t, 65>();
+    while(read(device.as_handle(), rest.data(), rest.size()) > 0) {
+    }
+}
+} // namespace niz::trace
@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "util/fd.hpp"
+
+namespace niz::trace {
+// binary log of every report which goes through common.cpp
+// a file header is followed by records, each a RecordHeader and size bytes of the report
+// fields are little endian
+struct FileHeader {
+    std::array<char, 4> magic;
+    uint16_t            version;
+    uint16_t            reserved;
+    uint64_t            start; // unix time in nanoseconds
+} __attribute__((packed));
+
+struct Direction {
+    enum : uint8_t {
+        Sent     = 0, // 65 bytes with the leading report id
+        Received = 1, // up to 64 bytes
+    };
+};
+
+struct RecordHeader {
+    uint64_t time;    // nanoseconds since the start of the trace, monotonic
+    uint32_t channel; // fd of the device, tells concurrent sessions apart
+    uint8_t  direction;
+    uint8_t  size;
+} __attribute__((packed));
+
+constexpr auto magic   = std::array{'N', 'I', 'Z', 'T'};
+constexpr auto version = uint16_t(1);
+
+// records are buffered and written when the buffer is full and at exit
+auto start(const char* path) -> bool;
+auto record(int fd, uint8_t direction, std::span<const uint8_t> report) -> void;
+// flushes the buffer, recording stops
+auto stop() -> bool;
+
+struct Record {
+    uint64_t                time;
+    uint32_t                channel;
+    uint8_t                 direction;
+    std::array<uint8_t, 65> data;
+    uint8_t                 size;
+
+    auto get_data() const -> std::span<const uint8_t>;
+};
+
+auto load(const char* path) -> std::optional<std::vector<Record>>;
+auto dump(std::span<const Record> records) -> void;
+
+// plays the device side of a trace over a socketpair, get_fd can be passed to any function which takes a hidraw fd
+// sent reports are compared with the trace, the recorded responses are sent back in order
+struct Replayer {
+    std::vector<Record> records; // of a single channel
+    bool                timed = false; // delay responses as long as the device did
+    std::atomic_size_t  mismatches = 0;
+
+    FileDescriptor host;
+    FileDescriptor device;
+    std::thread    worker;
+
+    // uses the channel of the first record
+    auto start(std::vector<Record> trace, bool timed) -> bool;
+    auto stop() -> void;
+    auto get_fd() const -> int;
+
+    ~Replayer();
+
+  private:
+    auto run() -> void;
+};
+} // namespace niz::trace
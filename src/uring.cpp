@@ -0,0 +1,356 @@
+#include <atomic>
+#include <memory>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "macros/assert.hpp"
+#include "uring.hpp"
+#include "util/fd.hpp"
+
+namespace niz::uring {
+namespace {
+// IORING_OP_READ_MULTISHOT, added in linux 6.7, may be missing from older headers
+constexpr auto op_read_multishot = uint8_t(49);
+
+constexpr auto ring_entries   = 64u;
+constexpr auto buffer_entries = 64u; // must be a power of 2
+constexpr auto buffer_size    = 64u;
+constexpr auto buffer_group   = uint16_t(0);
+
+constexpr auto user_data_write  = uint64_t(1);
+constexpr auto user_data_read   = uint64_t(2);
+constexpr auto user_data_cancel = uint64_t(3);
+
+template <class T>
+auto load_acquire(T* ptr) -> T {
+    return std::atomic_ref<T>(*ptr).load(std::memory_order_acquire);
+}
+
+template <class T>
+auto store_release(T* ptr, const T value) -> void {
+    std::atomic_ref<T>(*ptr).store(value, std::memory_order_release);
+}
+
+struct Mapping {
+    void*  ptr  = MAP_FAILED;
+    size_t size = 0;
+
+    auto map(const int fd, const size_t size, const off_t offset) -> bool {
+        this->size = size;
+        ptr        = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return ptr != MAP_FAILED;
+    }
+
+    template <class T = uint8_t>
+    auto at(const size_t offset) const -> T* {
+        return std::bit_cast<T*>(std::bit_cast<uint8_t*>(ptr) + offset);
+    }
+
+    ~Mapping() {
+        if(ptr != MAP_FAILED) {
+            munmap(ptr, size);
+        }
+    }
+};
+
+struct Ring {
+    FileDescriptor fd;
+    Mapping        sq_mapping;
+    Mapping        sqes_mapping;
+    Mapping        buf_ring_mapping;
+
+    uint32_t*      sq_tail;
+    uint32_t*      sq_mask;
+    uint32_t*      sq_array;
+    io_uring_sqe*  sqes;
+    uint32_t*      cq_head;
+    uint32_t*      cq_tail;
+    uint32_t*      cq_mask;
+    io_uring_cqe*  cqes;
+    uint32_t       sq_entries;
+    uint32_t       pending = 0;
+
+    io_uring_buf_ring*                                          buf_ring;
+    std::array<std::array<uint8_t, buffer_size>, buffer_entries> buffers;
+    uint16_t                                                    buf_tail = 0;
+
+    auto init() -> bool;
+    auto init_buffers() -> bool;
+    auto get_sqe() -> io_uring_sqe*;
+    auto submit(uint32_t wait) -> bool;
+    auto peek() -> io_uring_cqe*;
+    auto pop() -> void;
+    auto recycle_buffer(uint16_t bid) -> void;
+};
+
+auto Ring::init() -> bool {
+    auto params = io_uring_params();
+    fd          = FileDescriptor(syscall(__NR_io_uring_setup, ring_entries, &params));
+    ensure(fd.as_handle() >= 0, "io_uring_setup: ", strerror(errno));
+    ensure(params.features & IORING_FEAT_SINGLE_MMAP);
+
+    const auto sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    const auto cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ensure(sq_mapping.map(fd.as_handle(), std::max(sq_size, cq_size), IORING_OFF_SQ_RING));
+    ensure(sqes_mapping.map(fd.as_handle(), params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+
+    sq_tail    = sq_mapping.at<uint32_t>(params.sq_off.tail);
+    sq_mask    = sq_mapping.at<uint32_t>(params.sq_off.ring_mask);
+    sq_array   = sq_mapping.at<uint32_t>(params.sq_off.array);
+    sqes       = sqes_mapping.at<io_uring_sqe>(0);
+    cq_head    = sq_mapping.at<uint32_t>(params.cq_off.head);
+    cq_tail    = sq_mapping.at<uint32_t>(params.cq_off.tail);
+    cq_mask    = sq_mapping.at<uint32_t>(params.cq_off.ring_mask);
+    cqes       = sq_mapping.at<io_uring_cqe>(params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    return true;
+}
+
+auto Ring::init_buffers() -> bool {
+    const auto size = buffer_entries * sizeof(io_uring_buf);
+    buf_ring_mapping.size = size;
+    buf_ring_mapping.ptr  = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ensure(buf_ring_mapping.ptr != MAP_FAILED);
+    buf_ring = buf_ring_mapping.at<io_uring_buf_ring>(0);
+
+    auto reg         = io_uring_buf_reg();
+    reg.ring_addr    = std::bit_cast<uint64_t>(buf_ring);
+    reg.ring_entries = buffer_entries;
+    reg.bgid         = buffer_group;
+    ensure(syscall(__NR_io_uring_register, fd.as_handle(), IORING_REGISTER_PBUF_RING, &reg, 1) == 0, "register pbuf ring: ", strerror(errno));
+
+    for(auto i = 0u; i < buffer_entries; i += 1) {
+        recycle_buffer(i);
+    }
+    return true;
+}
+
+auto Ring::get_sqe() -> io_uring_sqe* {
+    const auto tail  = *sq_tail + pending;
+    const auto index = tail & *sq_mask;
+    auto&      sqe   = sqes[index];
+    sqe              = io_uring_sqe();
+    sq_array[index]  = index;
+    pending += 1;
+    return &sqe;
+}
+
+auto Ring::submit(const uint32_t wait) -> bool {
+    store_release(sq_tail, *sq_tail + pending);
+    const auto count = std::exchange(pending, 0);
+    while(true) {
+        const auto ret = syscall(__NR_io_uring_enter, fd.as_handle(), count, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        ensure(ret >= 0, "io_uring_enter: ", strerror(errno));
+        return true;
+    }
+}
+
+auto Ring::peek() -> io_uring_cqe* {
+    const auto head = *cq_head;
+    if(head == load_acquire(cq_tail)) {
+        return nullptr;
+    }
+    return &cqes[head & *cq_mask];
+}
+
+auto Ring::pop() -> void {
+    store_release(cq_head, *cq_head + 1);
+}
+
+auto Ring::recycle_buffer(const uint16_t bid) -> void {
+    // io_uring_buf_ring::bufs is misplaced in c++, since the empty struct in __DECLARE_FLEX_ARRAY has non-zero size
+    auto& buf = std::bit_cast<io_uring_buf*>(buf_ring)[buf_tail & (buffer_entries - 1)];
+    buf.addr  = std::bit_cast<uint64_t>(buffers[bid].data());
+    buf.len   = buffer_size;
+    buf.bid   = bid;
+    buf_tail += 1;
+    store_release(&buf_ring->tail, buf_tail);
+}
+
+auto get_ring() -> Ring* {
+    thread_local auto ring   = std::unique_ptr<Ring>();
+    thread_local auto failed = false;
+    if(!ring && !failed) {
+        auto new_ring = std::make_unique<Ring>();
+        if(new_ring->init() && new_ring->init_buffers()) {
+            ring = std::move(new_ring);
+        } else {
+            line_warn("io_uring is unavailable, falling back to blocking io");
+            failed = true;
+        }
+    }
+    return ring.get();
+}
+} // namespace
+
+struct Stream {
+    Ring* ring;
+    int   fd;
+    bool  armed = false;
+};
+
+auto available() -> bool {
+    return get_ring() != nullptr;
+}
+
+auto write_reports(const int fd, const std::span<const std::array<uint8_t, 65>> reports) -> std::optional<size_t> {
+    auto ring = get_ring();
+    ensure(ring != nullptr);
+
+    for(auto begin = 0u; begin < reports.size(); begin += ring->sq_entries) {
+        const auto count = std::min<size_t>(ring->sq_entries, reports.size() - begin);
+        for(auto i = 0u; i < count; i += 1) {
+            auto& report    = reports[begin + i];
+            auto  sqe       = ring->get_sqe();
+            sqe->opcode     = IORING_OP_WRITE;
+            sqe->fd         = fd;
+            sqe->addr       = std::bit_cast<uint64_t>(report.data());
+            sqe->len        = report.size();
+            sqe->off        = uint64_t(-1);
+            sqe->flags      = i + 1 < count ? IOSQE_IO_LINK : 0;
+            sqe->user_data  = user_data_write | uint64_t(i) << 8;
+        }
+        ensure(ring->submit(count));
+
+        auto ok     = true;
+        auto resume = count; // first report which was not taken
+        for(auto done = 0u; done < count;) {
+            auto cqe = ring->peek();
+            if(cqe == nullptr) {
+                ensure(ring->submit(count - done));
+                continue;
+            }
+            if(cqe->res != int(reports[0].size())) {
+                // a non-blocking fd fails the write instead of waiting, and the rest of the chain is cancelled
+                if(cqe->res == -EAGAIN || cqe->res == -ECANCELED) {
+                    resume = std::min<size_t>(resume, cqe->user_data >> 8);
+                } else if(ok) {
+                    line_warn("write failed: ", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+                    ok = false;
+                }
+            }
+            ring->pop();
+            done += 1;
+        }
+        ensure(ok);
+        if(resume < count) {
+            return begin + resume;
+        }
+    }
+    return reports.size();
+}
+
+auto open_stream(const int fd) -> Stream* {
+    auto ring = get_ring();
+    if(ring == nullptr) {
+        return nullptr;
+    }
+    return new Stream{ring, fd};
+}
+
+auto read_stream(Stream* const stream, const std::span<uint8_t> buf, const int timeout_ms) -> ssize_t {
+    auto& ring = *stream->ring;
+    while(true) {
+        if(!stream->armed) {
+            auto sqe       = ring.get_sqe();
+            sqe->opcode    = op_read_multishot;
+            sqe->fd        = stream->fd;
+            sqe->off       = uint64_t(-1);
+            sqe->flags     = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = buffer_group;
+            sqe->user_data = user_data_read;
+            stream->armed  = true;
+            if(!ring.submit(0)) {
+                return -1;
+            }
+        }
+
+        auto cqe = ring.peek();
+        if(cqe == nullptr) {
+            // the ring fd becomes readable when a completion is posted
+            auto       pfd = pollfd{.fd = ring.fd.as_handle(), .events = POLLIN, .revents = 0};
+            const auto ret = poll(&pfd, 1, timeout_ms);
+            if(ret == 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if(ret < 0 && errno != EINTR) {
+                line_warn("poll: ", strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+
+        const auto res   = cqe->res;
+        const auto flags = cqe->flags;
+        const auto data  = cqe->user_data;
+        ring.pop();
+        if(data != user_data_read) {
+            continue;
+        }
+        if(!(flags & IORING_CQE_F_MORE)) {
+            stream->armed = false;
+        }
+        if(res == -EINVAL && !(flags & IORING_CQE_F_BUFFER)) {
+            return 0; // multishot read is not supported
+        }
+        if(res == -ENOBUFS) {
+            continue;
+        }
+        if(res < 0) {
+            line_warn("read failed: ", strerror(-res));
+            return -1;
+        }
+        if(!(flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+        const auto bid = uint16_t(flags >> IORING_CQE_BUFFER_SHIFT);
+        const auto len = std::min(size_t(res), buf.size());
+        memcpy(buf.data(), ring.buffers[bid].data(), len);
+        ring.recycle_buffer(bid);
+        return len;
+    }
+}
+
+auto close_stream(Stream* const stream) -> void {
+    auto& ring = *stream->ring;
+    if(stream->armed) {
+        auto sqe       = ring.get_sqe();
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = user_data_read;
+        sqe->user_data = user_data_cancel;
+        ring.submit(1);
+
+        // wait for both the cancel result and the final read completion
+        auto cancelled = false;
+        while(stream->armed || !cancelled) {
+            auto cqe = ring.peek();
+            if(cqe == nullptr) {
+                if(!ring.submit(1)) {
+                    break;
+                }
+                continue;
+            }
+            if(cqe->user_data == user_data_cancel) {
+                cancelled = true;
+            } else if(cqe->user_data == user_data_read) {
+                if(cqe->flags & IORING_CQE_F_BUFFER) {
+                    ring.recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                    stream->armed = false;
+                }
+            }
+            ring.pop();
+        }
+    }
+    delete stream;
+}
+} // namespace niz::uring
@@ -0,0 +1,29 @@
+#pragma once
+#include <array>
+#include <optional>
+#include <span>
+
+#include <sys/types.h>
+
+namespace niz::uring {
+// io_uring transport, used by common.cpp when built with NIZ_IO_URING
+// the ring is set up lazily, once per thread
+
+// returns false if io_uring can not be used on this system
+auto available() -> bool;
+
+// writes reports in order as chains of linked writes, one io_uring_enter per chain
+// returns the number of reports written, which is less than reports.size() if a non-blocking fd was not ready
+auto write_reports(int fd, std::span<const std::array<uint8_t, 65>> reports) -> std::optional<size_t>;
+
+// multishot read of a response stream into a ring of provided buffers
+struct Stream;
+
+auto open_stream(int fd) -> Stream*;
+// returns the number of bytes read
+// 0 if the kernel does not support multishot reads, in that case nothing is consumed and the caller should fall back to read()
+// -1 on error, with errno set to ETIMEDOUT if nothing arrived within timeout_ms
+auto read_stream(Stream* stream, std::span<uint8_t> buf, int timeout_ms) -> ssize_t;
+// cancels the pending read, reports which arrive while cancelling are dropped
+auto close_stream(Stream* stream) -> void;
+} // namespace niz::uring
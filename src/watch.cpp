@@ -0,0 +1,237 @@
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <thread>
+
+#include <linux/netlink.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+#include "macros/assert.hpp"
+#include "util/fd.hpp"
+#include "watch.hpp"
+
+namespace niz::watch {
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// udev may still be adjusting the permissions of a new node
+constexpr auto open_timeout  = std::chrono::seconds(2);
+constexpr auto open_interval = std::chrono::milliseconds(5);
+
+auto open_netlink() -> FileDescriptor {
+    auto fd = FileDescriptor(socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT));
+    if(fd.as_handle() < 0) {
+        return fd;
+    }
+    auto addr      = sockaddr_nl();
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // kernel events
+    if(bind(fd.as_handle(), std::bit_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        return FileDescriptor();
+    }
+    return fd;
+}
+
+auto open_inotify(const char* const dev_dir) -> FileDescriptor {
+    auto fd = FileDescriptor(inotify_init1(IN_CLOEXEC));
+    if(fd.as_handle() < 0 || inotify_add_watch(fd.as_handle(), dev_dir, IN_CREATE) < 0) {
+        return FileDescriptor();
+    }
+    return fd;
+}
+
+// returns the device name of a hidraw add event, or an empty view
+auto parse_uevent(const std::string_view message) -> std::string_view {
+    // "add@/devices/...\0ACTION=add\0SUBSYSTEM=hidraw\0DEVNAME=hidraw0\0..."
+    auto action    = std::string_view();
+    auto subsystem = std::string_view();
+    auto devname   = std::string_view();
+    for(auto rest = message; !rest.empty();) {
+        const auto end   = std::min(rest.find('\0'), rest.size());
+        const auto field = rest.substr(0, end);
+        if(field.starts_with("ACTION=")) {
+            action = field.substr(7);
+        } else if(field.starts_with("SUBSYSTEM=")) {
+            subsystem = field.substr(10);
+        } else if(field.starts_with("DEVNAME=")) {
+            devname = field.substr(8);
+        }
+        rest.remove_prefix(std::min(end + 1, rest.size()));
+    }
+    if(action != "add" || subsystem != "hidraw") {
+        return {};
+    }
+    // DEVNAME may be relative to /dev or absolute
+    if(const auto slash = devname.rfind('/'); slash != devname.npos) {
+        devname.remove_prefix(slash + 1);
+    }
+    return devname;
+}
+
+auto read_netlink(const int fd, std::vector<std::string>& names) -> bool {
+    auto buf    = std::array<char, 8192>();
+    auto sender = sockaddr_nl();
+    auto iov    = iovec{buf.data(), buf.size()};
+    auto msg    = msghdr();
+    msg.msg_name    = &sender;
+    msg.msg_namelen = sizeof(sender);
+    msg.msg_iov     = &iov;
+    msg.msg_iovlen  = 1;
+    const auto len = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if(len < 0) {
+        ensure(errno == EAGAIN || errno == ENOBUFS, "recvmsg: ", strerror(errno));
+        return true;
+    }
+    // only the kernel may send uevents
+    if(sender.nl_pid != 0) {
+        return true;
+    }
+    if(const auto name = parse_uevent(std::string_view(buf.data(), len)); !name.empty()) {
+        names.emplace_back(name);
+    }
+    return true;
+}
+
+auto read_inotify(const int fd, std::vector<std::string>& names) -> bool {
+    alignas(inotify_event) auto buf = std::array<char, 4096>();
+    const auto len = read(fd, buf.data(), buf.size());
+    ensure(len > 0, "inotify: ", strerror(errno));
+    for(auto ptr = buf.data(); ptr < buf.data() + len;) {
+        const auto& event = *std::bit_cast<const inotify_event*>(ptr);
+        const auto  name  = std::string_view(event.len > 0 ? event.name : "");
+        if(name.starts_with("hidraw")) {
+            names.emplace_back(name);
+        }
+        ptr += sizeof(inotify_event) + event.len;
+    }
+    return true;
+}
+
+auto open_with_retry(const fleet::Opener& open, const std::string& device) -> FileDescriptor {
+    const auto deadline = Clock::now() + open_timeout;
+    while(true) {
+        auto fd = open(device);
+        if(fd.as_handle() >= 0 || (errno != EACCES && errno != EPERM && errno != ENOENT) || Clock::now() >= deadline) {
+            return fd;
+        }
+        std::this_thread::sleep_for(open_interval);
+    }
+}
+
+struct Worker {
+    std::thread      thread;
+    fleet::Result    result;
+    Clock::duration  latency;
+    std::atomic_bool done = false;
+};
+
+// printed by the watching thread, so that messages of devices do not interleave
+auto print_result(const Worker& worker) -> void {
+    const auto& result = worker.result;
+    const auto  ms     = std::chrono::duration<double, std::milli>(worker.latency).count();
+    if(result.ok) {
+        print(result.device, ": keymap applied ", ms, "ms after connection, version: ", result.version);
+    } else {
+        print(result.device, ": failed ", ms, "ms after connection");
+    }
+    if(!result.output.empty()) {
+        print(result.device, ": ", result.output);
+    }
+}
+} // namespace
+
+auto run(const Options& options, const fleet::Job& job, const fleet::Opener& open) -> bool {
+    auto signals = sigset_t();
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ensure(pthread_sigmask(SIG_BLOCK, &signals, nullptr) == 0);
+    const auto signal_fd = FileDescriptor(signalfd(-1, &signals, SFD_CLOEXEC));
+    ensure(signal_fd.as_handle() >= 0, strerror(errno));
+
+    auto netlink = options.dev_dir == "/dev" ? open_netlink() : FileDescriptor();
+    auto inotify = FileDescriptor();
+    if(netlink.as_handle() < 0) {
+        inotify = open_inotify(options.dev_dir.data());
+        ensure(inotify.as_handle() >= 0, "can not watch ", options.dev_dir, ": ", strerror(errno));
+    }
+    // finished workers signal this, so that they are reaped without delay
+    const auto done_fd = FileDescriptor(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    ensure(done_fd.as_handle() >= 0, strerror(errno));
+    print("watching for keyboards using ", netlink.as_handle() >= 0 ? "netlink" : "inotify");
+
+    auto workers = std::list<Worker>();
+    auto handled = size_t(0);
+    auto names   = std::vector<std::string>();
+    while(options.max_devices == 0 || handled < options.max_devices || !workers.empty()) {
+        auto fds = std::array{
+            pollfd{.fd = signal_fd.as_handle(), .events = POLLIN, .revents = 0},
+            pollfd{.fd = netlink.as_handle() >= 0 ? netlink.as_handle() : inotify.as_handle(), .events = POLLIN, .revents = 0},
+            pollfd{.fd = done_fd.as_handle(), .events = POLLIN, .revents = 0},
+        };
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            ensure(errno == EINTR, "poll: ", strerror(errno));
+            continue;
+        }
+        if(fds[0].revents & POLLIN) {
+            print("stopping");
+            break;
+        }
+
+        if(fds[1].revents & POLLIN) {
+            const auto now = Clock::now();
+            names.clear();
+            if(netlink.as_handle() >= 0) {
+                ensure(read_netlink(netlink.as_handle(), names));
+            } else {
+                ensure(read_inotify(inotify.as_handle(), names));
+            }
+            for(const auto& name : names) {
+                if(!fleet::is_keyboard(options.sys_dir.data(), name)) {
+                    continue;
+                }
+                if(options.max_devices != 0 && handled + workers.size() >= options.max_devices) {
+                    break;
+                }
+                const auto device = options.dev_dir + "/" + name;
+                print(device, ": connected");
+                auto& worker  = workers.emplace_back();
+                worker.thread = std::thread([&job, &open, &worker, &done_fd, device, now]() {
+                    const auto retrying_open = [&open](const std::string& device) { return open_with_retry(open, device); };
+                    worker.result            = fleet::run_device(device, job, retrying_open);
+                    worker.latency           = Clock::now() - now;
+                    worker.done              = true;
+                    eventfd_write(done_fd.as_handle(), 1);
+                });
+            }
+        }
+
+        if(fds[2].revents & POLLIN) {
+            auto count = eventfd_t();
+            eventfd_read(done_fd.as_handle(), &count);
+        }
+        for(auto it = workers.begin(); it != workers.end();) {
+            if(!it->done) {
+                it = std::next(it);
+                continue;
+            }
+            it->thread.join();
+            print_result(*it);
+            it = workers.erase(it);
+            handled += 1;
+        }
+    }
+
+    for(auto& worker : workers) {
+        worker.thread.join();
+        print_result(worker);
+    }
+    return true;
+}
+} // namespace niz::watch
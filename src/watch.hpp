@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+
+#include "fleet.hpp"
+
+namespace niz::watch {
+struct Options {
+    // dev_dir and sys_dir can point at a temporary directory for testing
+    // netlink is only used with the real /dev, otherwise dev_dir is watched with inotify
+    std::string dev_dir = "/dev";
+    std::string sys_dir = "/sys/class/hidraw";
+    // return after this many keyboards were handled, 0 to run until SIGINT or SIGTERM
+    size_t max_devices = 0;
+};
+
+// runs job on every keyboard which appears, and logs the time from the event to the end of the job
+auto run(const Options& options, const fleet::Job& job, const fleet::Opener& open = fleet::open_device) -> bool;
+} // namespace niz::watch